@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocprof.h"
+#include "vm.h"
+
+// Where the program allocates its objects (`--alloc-profile`).
+// Every allocation counts its bytes down to the next sample. The object that crosses it is charged to its
+// site: the function and line of the topmost frame (what a native allocates goes to the line calling the
+// native, what the compiler allocates to no frame at all), and its type. The distances between samples are
+// random around `sampleBytes`, so a loop allocating in a fixed pattern can't keep hitting or missing
+// the same object. An object of `size` bytes is sampled with a chance of about size / sampleBytes,
+// so each sample stands for sampleBytes / size objects (one, for objects bigger than that).
+//
+// Only the object itself is counted: the characters of a string, the entries of a table and the
+// upvalue array of a closure are allocated on their own.
+
+typedef struct {
+    char* function; // copied: the function may be freed long before the report
+    int line;
+    ObjType type;
+    double objects; // estimated from the samples
+    double bytes;
+} AllocSite;
+
+typedef struct AllocProfile {
+    const char* path;
+    size_t sampleBytes;
+    long untilSample; // bytes left until the next sample
+    uint64_t random;
+    size_t samples;
+    AllocSite* sites; // open addressing, NULL `function`: empty
+    int count;
+    int capacity;
+} AllocProfile;
+
+static const char* typeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_BOUND_METHOD] = "bound method",
+    [OBJ_CLASS] = "class",
+    [OBJ_CLOSURE] = "closure",
+    [OBJ_FIBER] = "fiber",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_GENERATOR] = "generator",
+    [OBJ_INSTANCE] = "instance",
+    [OBJ_NATIVE] = "native",
+    [OBJ_STRING] = "string",
+    [OBJ_UPVALUE] = "upvalue",
+};
+
+// xorshift: anything will do, as long as it doesn't line up with the program
+static long nextDistance(AllocProfile* profile) {
+    uint64_t x = profile->random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    profile->random = x;
+    // anywhere from 1 to twice the average
+    return 1 + (long)(x % (2 * profile->sampleBytes));
+}
+
+AllocProfile* newAllocProfile(const char* path, size_t sampleBytes) {
+    AllocProfile* profile = (AllocProfile*)malloc(sizeof(AllocProfile));
+    if (profile == NULL) exit(1);
+    profile->path = path;
+    profile->sampleBytes = sampleBytes > 0 ? sampleBytes : 1;
+    profile->random = 0x9e3779b97f4a7c15u;
+    profile->untilSample = nextDistance(profile);
+    profile->samples = 0;
+    profile->sites = NULL;
+    profile->count = 0;
+    profile->capacity = 0;
+    return profile;
+}
+
+static uint32_t hashSite(const char* function, int line, ObjType type) {
+    // FNV-1a, like the strings
+    uint32_t hash = 2166136261u;
+    for (const char* c = function; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619;
+    }
+    hash ^= (uint32_t)line * 31 + type;
+    hash *= 16777619;
+    return hash;
+}
+
+static AllocSite* findSite(AllocSite* sites, int capacity, const char* function, int line, ObjType type) {
+    uint32_t index = hashSite(function, line, type) & (capacity - 1);
+    for (;;) {
+        AllocSite* site = &sites[index];
+        if (site->function == NULL) return site;
+        if (site->line == line && site->type == type && strcmp(site->function, function) == 0) return site;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+// plain `malloc`, like the gray stack: the profiler mustn't trigger a GC from inside an allocation
+static void growSites(AllocProfile* profile) {
+    int capacity = profile->capacity < 64 ? 64 : profile->capacity * 2;
+    AllocSite* sites = (AllocSite*)calloc(capacity, sizeof(AllocSite));
+    if (sites == NULL) exit(1);
+    for (int i = 0; i < profile->capacity; i++) {
+        AllocSite* site = &profile->sites[i];
+        if (site->function == NULL) continue;
+        *findSite(sites, capacity, site->function, site->line, site->type) = *site;
+    }
+    free(profile->sites);
+    profile->sites = sites;
+    profile->capacity = capacity;
+}
+
+static void sample(AllocProfile* profile, size_t size, ObjType type) {
+    const char* function = "(compiler)";
+    int line = 0;
+    if (vm->frameCount > 0) {
+        CallFrame* frame = &vm->frames[vm->frameCount - 1];
+        ObjFunction* running = frame->closure->function;
+        function = running->name == NULL ? "script" : running->name->chars;
+        // ip already points past the instruction that is allocating (none yet: the call itself)
+        size_t instruction = frame->ip - running->chunk.code;
+        line = running->chunk.lines[instruction > 0 ? instruction - 1 : 0];
+    }
+
+    if (profile->count + 1 > profile->capacity * 3 / 4) growSites(profile);
+    AllocSite* site = findSite(profile->sites, profile->capacity, function, line, type);
+    if (site->function == NULL) {
+        site->function = strdup(function);
+        if (site->function == NULL) exit(1);
+        site->line = line;
+        site->type = type;
+        site->objects = 0;
+        site->bytes = 0;
+        profile->count++;
+    }
+
+    double objects = size < profile->sampleBytes ? (double)profile->sampleBytes / size : 1;
+    site->objects += objects;
+    site->bytes += objects * size;
+    profile->samples++;
+}
+
+void profileAllocation(size_t size, ObjType type) {
+    AllocProfile* profile = vm->allocProfile;
+    profile->untilSample -= (long)size;
+    if (profile->untilSample > 0) return;
+    profile->untilSample = nextDistance(profile);
+    sample(profile, size, type);
+}
+
+static int compareSites(const void* a, const void* b) {
+    const AllocSite* left = *(const AllocSite* const*)a;
+    const AllocSite* right = *(const AllocSite* const*)b;
+    if (left->bytes != right->bytes) return left->bytes < right->bytes ? 1 : -1;
+    return left->line - right->line;
+}
+
+static void writeReport(FILE* file, int limit) {
+    AllocProfile* profile = vm->allocProfile;
+    AllocSite** sorted = (AllocSite**)malloc(sizeof(AllocSite*) * (profile->count > 0 ? profile->count : 1));
+    if (sorted == NULL) exit(1);
+    double totalBytes = 0;
+    double totalObjects = 0;
+    int count = 0;
+    for (int i = 0; i < profile->capacity; i++) {
+        AllocSite* site = &profile->sites[i];
+        if (site->function == NULL) continue;
+        sorted[count++] = site;
+        totalBytes += site->bytes;
+        totalObjects += site->objects;
+    }
+    qsort(sorted, count, sizeof(AllocSite*), compareSites);
+
+    fprintf(file, "== allocation sites: %zu samples, 1 per %zu bytes on average ==\n",
+            profile->samples, profile->sampleBytes);
+    fprintf(file, "%12s %6s %12s  %-12s %s\n", "bytes", "%", "objects", "type", "site");
+    for (int i = 0; i < count && i < limit; i++) {
+        AllocSite* site = sorted[i];
+        fprintf(file, "%12.0f %5.1f%% %12.0f  %-12s ", site->bytes,
+                totalBytes > 0 ? site->bytes * 100 / totalBytes : 0, site->objects, typeNames[site->type]);
+        if (site->line == 0) {
+            fprintf(file, "%s\n", site->function);
+        } else {
+            fprintf(file, "[line %d] in %s%s\n", site->line, site->function,
+                    strcmp(site->function, "script") == 0 ? "" : "()");
+        }
+    }
+    if (count > limit) fprintf(file, "... %d more sites ...\n", count - limit);
+    fprintf(file, "%12.0f %6s %12.0f  total\n", totalBytes, "", totalObjects);
+    free(sorted);
+}
+
+Value allocReportNative(int argCount, Value* args) {
+    if (argCount > 1 || (argCount == 1 && (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1))) {
+        return nativeError("allocReport() takes the number of sites to print, 1 or more.");
+    }
+    if (vm->allocProfile == NULL) return nativeError("Allocations are only recorded with --alloc-profile.");
+    writeReport(stdout, argCount == 1 ? (int)AS_NUMBER(args[0]) : ALLOC_REPORT_SITES);
+    return NIL_VAL;
+}
+
+void finishAllocProfile() {
+    AllocProfile* profile = vm->allocProfile;
+    if (profile == NULL) return;
+
+    FILE* file = strcmp(profile->path, "-") == 0 ? stderr : fopen(profile->path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write the allocation profile to \"%s\".\n", profile->path);
+    } else {
+        writeReport(file, ALLOC_REPORT_SITES);
+        if (file != stderr) fclose(file);
+    }
+
+    for (int i = 0; i < profile->capacity; i++) free(profile->sites[i].function);
+    free(profile->sites);
+    free(profile);
+    vm->allocProfile = NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef clox_allocprof_h
+#define clox_allocprof_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// on average one object is sampled per this many bytes allocated, 1: every object
+#define ALLOC_SAMPLE_BYTES 4096
+// the report lists this many sites at most, the biggest first
+#define ALLOC_REPORT_SITES 30
+
+struct AllocProfile;
+
+// for `vm->allocProfile`: record where the program allocates, reported in the file at `path` ("-": stderr)
+// once the VM is freed, `sampleBytes`: see ALLOC_SAMPLE_BYTES
+struct AllocProfile* newAllocProfile(const char* path, size_t sampleBytes);
+// `allocateObject` with `vm->allocProfile` on: an object of `size` bytes and `type` was just allocated
+void profileAllocation(size_t size, ObjType type);
+// allocReport([sites]): print the biggest sites so far to stdout
+Value allocReportNative(int argCount, Value* args);
+// write out the report and free the sites
+void finishAllocProfile();
+
+#endif
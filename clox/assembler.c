@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "assembler.h"
+#include "memory.h"
+
+void initAssembler(Assembler* as) {
+    as->count = 0;
+    as->capacity = 0;
+    as->code = NULL;
+}
+
+void freeAssembler(Assembler* as) {
+    // machine code isn't part of the Lox heap, so it bypasses `reallocate` (and the GC) entirely
+    free(as->code);
+    initAssembler(as);
+}
+
+void asmByte(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        as->capacity = GROW_CAPACITY(as->capacity);
+        as->code = (uint8_t*)realloc(as->code, as->capacity);
+        if (as->code == NULL) exit(1);
+    }
+    as->code[as->count++] = byte;
+}
+
+void asmInt32(Assembler* as, int32_t value) {
+    // x86 is little-endian
+    for (int i = 0; i < 4; i++) {
+        asmByte(as, (uint8_t)((uint32_t)value >> (8 * i)));
+    }
+}
+
+static void asmInt64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        asmByte(as, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+// REX prefix: W selects 64-bit operands, R and B extend the ModRM reg and rm fields to r8-r15
+static void rex(Assembler* as, bool wide, int reg, int rm) {
+    uint8_t prefix = 0x40 | (wide ? 0x08 : 0) | ((reg >> 3) & 1) << 2 | ((rm >> 3) & 1);
+    if (prefix != 0x40) asmByte(as, prefix);
+}
+
+// ModRM for a register-register operation
+static void modrmRegister(Assembler* as, int reg, int rm) {
+    asmByte(as, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// ModRM (and SIB) for a [base + disp32] memory operand
+static void modrmMemory(Assembler* as, int reg, Register base, int32_t disp) {
+    asmByte(as, 0x80 | (reg & 7) << 3 | (base & 7));
+    // rsp and r12 as base can only be encoded with a SIB byte
+    if ((base & 7) == RSP) asmByte(as, 0x24);
+    asmInt32(as, disp);
+}
+
+void asmMovImm(Assembler* as, Register dst, uint64_t imm) {
+    rex(as, true, 0, dst);
+    asmByte(as, 0xb8 + (dst & 7));
+    asmInt64(as, imm);
+}
+
+// the `op r/m64, r64` family: mov, add, sub, and, cmp
+static void registerOp(Assembler* as, uint8_t opcode, Register rm, Register reg) {
+    rex(as, true, reg, rm);
+    asmByte(as, opcode);
+    modrmRegister(as, reg, rm);
+}
+
+void asmMov(Assembler* as, Register dst, Register src) { registerOp(as, 0x89, dst, src); }
+void asmAdd(Assembler* as, Register dst, Register src) { registerOp(as, 0x01, dst, src); }
+void asmSub(Assembler* as, Register dst, Register src) { registerOp(as, 0x29, dst, src); }
+void asmAnd(Assembler* as, Register dst, Register src) { registerOp(as, 0x21, dst, src); }
+void asmCmp(Assembler* as, Register a, Register b) { registerOp(as, 0x39, a, b); }
+
+void asmLoad(Assembler* as, Register dst, Register base, int32_t disp) {
+    rex(as, true, dst, base);
+    asmByte(as, 0x8b);
+    modrmMemory(as, dst, base, disp);
+}
+
+void asmStore(Assembler* as, Register base, int32_t disp, Register src) {
+    rex(as, true, src, base);
+    asmByte(as, 0x89);
+    modrmMemory(as, src, base, disp);
+}
+
+// the `op r/m64, imm32` group, `extension` goes into the ModRM reg field
+static void immediateOp(Assembler* as, int extension, Register dst, int32_t imm) {
+    rex(as, true, 0, dst);
+    asmByte(as, 0x81);
+    modrmRegister(as, extension, dst);
+    asmInt32(as, imm);
+}
+
+void asmAddImm(Assembler* as, Register dst, int32_t imm) { immediateOp(as, 0, dst, imm); }
+void asmSubImm(Assembler* as, Register dst, int32_t imm) { immediateOp(as, 5, dst, imm); }
+
+void asmCmpImm(Assembler* as, Register a, int8_t imm) {
+    rex(as, true, 0, a);
+    asmByte(as, 0x83);
+    modrmRegister(as, 7, a);
+    asmByte(as, (uint8_t)imm);
+}
+
+void asmCmp32Imm(Assembler* as, Register a, int8_t imm) {
+    // for C functions returning `int`, the upper half of rax is garbage
+    rex(as, false, 0, a);
+    asmByte(as, 0x83);
+    modrmRegister(as, 7, a);
+    asmByte(as, (uint8_t)imm);
+}
+
+void asmIncrement(Assembler* as, Register base, int32_t disp) {
+    rex(as, true, 0, base);
+    asmByte(as, 0x83);
+    modrmMemory(as, 0, base, disp);
+    asmByte(as, 1);
+}
+
+void asmFlipSign(Assembler* as, Register reg) {
+    rex(as, true, 0, reg);
+    asmByte(as, 0x0f);
+    asmByte(as, 0xba);
+    modrmRegister(as, 7, reg);
+    asmByte(as, 63);
+}
+
+void asmTestAl(Assembler* as) {
+    asmByte(as, 0x84);
+    asmByte(as, 0xc0);
+}
+
+void asmSetccAl(Assembler* as, Condition cc) {
+    asmByte(as, 0x0f);
+    asmByte(as, 0x90 | cc);
+    asmByte(as, 0xc0);
+}
+
+void asmMovzxAl(Assembler* as) {
+    asmByte(as, 0x0f);
+    asmByte(as, 0xb6);
+    asmByte(as, 0xc0);
+}
+
+void asmMovqToXmm(Assembler* as, XmmRegister dst, Register src) {
+    asmByte(as, 0x66);
+    rex(as, true, dst, src);
+    asmByte(as, 0x0f);
+    asmByte(as, 0x6e);
+    modrmRegister(as, dst, src);
+}
+
+void asmMovqFromXmm(Assembler* as, Register dst, XmmRegister src) {
+    asmByte(as, 0x66);
+    rex(as, true, src, dst);
+    asmByte(as, 0x0f);
+    asmByte(as, 0x7e);
+    modrmRegister(as, src, dst);
+}
+
+void asmSse(Assembler* as, SseOp op, XmmRegister dst, XmmRegister src) {
+    asmByte(as, 0xf2);
+    asmByte(as, 0x0f);
+    asmByte(as, op);
+    modrmRegister(as, dst, src);
+}
+
+void asmUcomisd(Assembler* as, XmmRegister a, XmmRegister b) {
+    asmByte(as, 0x66);
+    asmByte(as, 0x0f);
+    asmByte(as, 0x2e);
+    modrmRegister(as, a, b);
+}
+
+void asmPush(Assembler* as, Register reg) {
+    rex(as, false, 0, reg);
+    asmByte(as, 0x50 | (reg & 7));
+}
+
+void asmPop(Assembler* as, Register reg) {
+    rex(as, false, 0, reg);
+    asmByte(as, 0x58 | (reg & 7));
+}
+
+void asmRet(Assembler* as) {
+    asmByte(as, 0xc3);
+}
+
+void asmCall(Assembler* as, void* function) {
+    // the code lives in mmap'd memory, which may be too far away from the C code for a rel32 call
+    asmMovImm(as, RAX, (uint64_t)(uintptr_t)function);
+    asmByte(as, 0xff);
+    modrmRegister(as, 2, RAX);
+}
+
+void asmJmpReg(Assembler* as, Register target) {
+    rex(as, false, 0, target);
+    asmByte(as, 0xff);
+    modrmRegister(as, 4, target);
+}
+
+void asmPatch(Assembler* as, int position, int target) {
+    // rel32 is relative to the end of the jump instruction, which is where the operand ends
+    int32_t rel = target - (position + 4);
+    memcpy(as->code + position, &rel, sizeof(rel));
+}
+
+int asmJmp(Assembler* as) {
+    asmByte(as, 0xe9);
+    asmInt32(as, 0);
+    return as->count - 4;
+}
+
+int asmJcc(Assembler* as, Condition cc) {
+    asmByte(as, 0x0f);
+    asmByte(as, 0x80 | cc);
+    asmInt32(as, 0);
+    return as->count - 4;
+}
+
+void asmJmpTo(Assembler* as, int target) {
+    asmPatch(as, asmJmp(as), target);
+}
+
+void asmJccTo(Assembler* as, Condition cc, int target) {
+    asmPatch(as, asmJcc(as, cc), target);
+}
+
+uint8_t* asmFinalize(Assembler* as) {
+    // W^X: write the code while the pages are writable, then flip them to executable
+    void* memory = mmap(NULL, as->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+
+    memcpy(memory, as->code, as->count);
+    if (mprotect(memory, as->count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, as->count);
+        return NULL;
+    }
+    return (uint8_t*)memory;
+}
+
+void asmFreeCode(uint8_t* code, size_t size) {
+    munmap(code, size);
+}
@@ -0,0 +1,91 @@
+#ifndef clox_assembler_h
+#define clox_assembler_h
+
+#include "common.h"
+
+// a tiny x86-64 assembler, just enough instructions for the JIT templates
+
+// general purpose registers, numbered as in the instruction encoding
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+// SSE registers used for double arithmetic
+typedef enum {
+    XMM0, XMM1
+} XmmRegister;
+
+// condition codes for `jcc` and `setcc` (the low nibble of their opcode)
+typedef enum {
+    CC_B  = 0x2, // below (unsigned <)
+    CC_AE = 0x3, // above or equal (unsigned >=)
+    CC_E  = 0x4, // equal
+    CC_NE = 0x5, // not equal
+    CC_BE = 0x6, // below or equal (unsigned <=)
+    CC_A  = 0x7, // above (unsigned >)
+} Condition;
+
+// scalar double operations, the value is the last opcode byte of `F2 0F xx`
+typedef enum {
+    SSE_ADD = 0x58,
+    SSE_MUL = 0x59,
+    SSE_SUB = 0x5c,
+    SSE_DIV = 0x5e,
+} SseOp;
+
+// a growable buffer of machine code
+typedef struct {
+    int count;
+    int capacity;
+    uint8_t* code;
+} Assembler;
+
+void initAssembler(Assembler* as);
+void freeAssembler(Assembler* as);
+
+void asmByte(Assembler* as, uint8_t byte);
+void asmInt32(Assembler* as, int32_t value);
+
+void asmMovImm(Assembler* as, Register dst, uint64_t imm);     // mov dst, imm64
+void asmMov(Assembler* as, Register dst, Register src);        // mov dst, src
+void asmLoad(Assembler* as, Register dst, Register base, int32_t disp);  // mov dst, [base + disp]
+void asmStore(Assembler* as, Register base, int32_t disp, Register src); // mov [base + disp], src
+void asmAdd(Assembler* as, Register dst, Register src);        // add dst, src
+void asmSub(Assembler* as, Register dst, Register src);        // sub dst, src
+void asmAnd(Assembler* as, Register dst, Register src);        // and dst, src
+void asmCmp(Assembler* as, Register a, Register b);            // cmp a, b
+void asmAddImm(Assembler* as, Register dst, int32_t imm);      // add dst, imm32
+void asmSubImm(Assembler* as, Register dst, int32_t imm);      // sub dst, imm32
+void asmCmpImm(Assembler* as, Register a, int8_t imm);         // cmp a, imm8
+void asmCmp32Imm(Assembler* as, Register a, int8_t imm);       // cmp a (low 32 bits), imm8
+void asmIncrement(Assembler* as, Register base, int32_t disp); // add qword [base + disp], 1
+void asmFlipSign(Assembler* as, Register reg);                 // btc reg, 63
+void asmTestAl(Assembler* as);                                 // test al, al
+void asmSetccAl(Assembler* as, Condition cc);                  // setcc al
+void asmMovzxAl(Assembler* as);                                // movzx eax, al
+
+void asmMovqToXmm(Assembler* as, XmmRegister dst, Register src);   // movq dst, src
+void asmMovqFromXmm(Assembler* as, Register dst, XmmRegister src); // movq dst, src
+void asmSse(Assembler* as, SseOp op, XmmRegister dst, XmmRegister src);
+void asmUcomisd(Assembler* as, XmmRegister a, XmmRegister b);
+
+void asmPush(Assembler* as, Register reg);
+void asmPop(Assembler* as, Register reg);
+void asmRet(Assembler* as);
+void asmCall(Assembler* as, void* function); // absolute call through rax
+void asmJmpReg(Assembler* as, Register target);
+
+// jumps to a known native offset
+void asmJmpTo(Assembler* as, int target);
+void asmJccTo(Assembler* as, Condition cc, int target);
+// jumps to a not yet known offset, return the position to hand to `asmPatch`
+int asmJmp(Assembler* as);
+int asmJcc(Assembler* as, Condition cc);
+void asmPatch(Assembler* as, int position, int target);
+
+// copy the code into executable memory, return NULL if the OS refuses
+uint8_t* asmFinalize(Assembler* as);
+void asmFreeCode(uint8_t* code, size_t size);
+
+#endif
@@ -0,0 +1,115 @@
+#!/usr/bin/env bash
+# Run every Lox program in a directory several times, and compare against a saved baseline.
+# usage: bench.sh <clox> <clox_stats> <dir with .lox files> <baseline.json> [runs] [--save]
+#
+# For each program: the best wall time of RUNS runs, the time the GC paused it and its peak RSS in that
+# run (from `--gc-stats`), and the bytecode instructions it executes (one run of clox_stats with
+# `--opcode-stats`, the JIT off), and where the hardware counters can be read, the machine instructions the
+# interpreter executes per bytecode (one run of clox with `--no-jit --perf-counters`). With --save the results
+# become the new baseline, otherwise any program slower than the baseline by more than BENCH_TOLERANCE percent
+# (default 10), executing more instructions, or using more than 20% more memory is flagged, and the script
+# exits with 1. Without a baseline yet (a fresh checkout), the first run saves one.
+set -u
+
+if [ $# -lt 4 ]; then
+    echo "Usage: $0 <clox> <clox_stats> <lox dir> <baseline.json> [runs] [--save]" >&2
+    exit 64
+fi
+
+CLOX=$1
+CLOX_STATS=$2
+LOX_DIR=$3
+BASELINE=$4
+RUNS=${5:-5}
+SAVE=${6:-}
+TOLERANCE=${BENCH_TOLERANCE:-10}
+# timings only compare on the machine that took them, so a checkout starts without a baseline
+if [ ! -f "$BASELINE" ] && [ -z "$SAVE" ]; then
+    echo "no baseline at $BASELINE yet, saving this run as the baseline"
+    SAVE=--save
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+. "$(dirname "${BASH_SOURCE[0]}")/bench_lib.sh"
+
+# a number field of the one-line JSON object in $1, or empty
+field() {
+    sed -n "s/.*\"$2\": *\([0-9.e+-]*\).*/\1/p" <<< "$1"
+}
+
+# the baseline's line for program $1
+baseline_of() {
+    [ -f "$BASELINE" ] && grep "^  \"$1\":" "$BASELINE"
+}
+
+# the GC statistics of the fastest run (see `best_time`)
+keep_best_run() {
+    cp "$WORK/gc.json" "$WORK/best.json"
+}
+
+printf "%-20s %10s %10s %8s %14s %6s %9s %9s  %s\n" \
+    "program" "time (ms)" "base (ms)" "change" "instructions" "ipb" "gc (ms)" "rss (MB)" ""
+results=()
+regressions=0
+for program in "$LOX_DIR"/*.lox; do
+    name=$(basename "$program")
+
+    # best wall time, and the GC statistics of that run
+    best=$(best_time "$RUNS" "$CLOX" --gc-stats "$WORK/gc.json" "$program")
+    ms=$(awk -v t="$best" 'BEGIN { printf "%.3f", t / 1000 }')
+    gc=$(tr -d '\n' < "$WORK/best.json")
+    gc_ms=$(sed -n 's/.*"totalMs": *\([0-9.]*\).*/\1/p' <<< "$gc")
+    rss_kb=$(sed -n 's/.*"peakRssKb": *\([0-9]*\).*/\1/p' <<< "$gc")
+
+    "$CLOX_STATS" --opcode-stats "$WORK/ops.txt" "$program" > /dev/null 2>&1
+    instructions=$(sed -n 's/^== opcodes: \([0-9]*\) instructions ==$/\1/p' "$WORK/ops.txt")
+
+    ipb=""
+    if "$CLOX" --no-jit --perf-counters "$WORK/perf.txt" "$program" > /dev/null 2>&1; then
+        machine=$(sed -n 's/^instructions *\([0-9][0-9]*\).*/\1/p' "$WORK/perf.txt")
+        if [ -n "$machine" ] && [ -n "$instructions" ]; then
+            ipb=$(awk -v m="$machine" -v b="$instructions" 'BEGIN { if (b > 0) printf "%.2f", m / b }')
+        fi
+    fi
+
+    results+=("  \"$name\": {\"ms\": $ms, \"instructions\": ${instructions:-0}, \"ipb\": ${ipb:-0}, \"gcMs\": ${gc_ms:-0}, \"peakRssKb\": ${rss_kb:-0}}")
+
+    base_line=$(baseline_of "$name")
+    base_ms=$(field "$base_line" ms)
+    verdict=""
+    change="-"
+    if [ -n "$base_ms" ] && [ -z "$SAVE" ]; then
+        change=$(awk -v t="$ms" -v b="$base_ms" 'BEGIN { printf (b > 0 ? "%+.1f%%" : "-"), (t - b) * 100 / b }')
+        verdict=$(awk -v t="$ms" -v b="$base_ms" -v tol="$TOLERANCE" \
+                      -v i="${instructions:-0}" -v bi="$(field "$base_line" instructions)" \
+                      -v r="${rss_kb:-0}" -v br="$(field "$base_line" peakRssKb)" 'BEGIN {
+            out = ""
+            if (t > b * (1 + tol / 100)) out = out " slower"
+            if (bi > 0 && i > bi) out = out " more-instructions"
+            if (br > 0 && r > br * 1.2) out = out " more-memory"
+            print out
+        }')
+        if [ -n "$verdict" ]; then
+            verdict="REGRESSION:$verdict"
+            regressions=$((regressions + 1))
+        fi
+    fi
+    printf "%-20s %10.3f %10s %8s %14s %6s %9s %9s  %s\n" "$name" "$ms" "${base_ms:--}" "$change" \
+        "${instructions:--}" "${ipb:--}" "${gc_ms:--}" "$(awk -v k="${rss_kb:-0}" 'BEGIN { printf "%.1f", k / 1024 }')" "$verdict"
+done
+
+if [ -n "$SAVE" ]; then
+    {
+        echo "{"
+        for i in "${!results[@]}"; do
+            if [ "$i" -lt $(( ${#results[@]} - 1 )) ]; then echo "${results[$i]},"; else echo "${results[$i]}"; fi
+        done
+        echo "}"
+    } > "$BASELINE"
+    echo "baseline saved to $BASELINE"
+elif [ "$regressions" -gt 0 ]; then
+    echo "$regressions program(s) regressed against $BASELINE"
+    exit 1
+fi
@@ -0,0 +1,26 @@
+#!/usr/bin/env bash
+# Time a Lox program with more and more GC marking threads (see marker.c).
+# usage: bench_gc.sh <clox> <lox program> [runs] [thread counts...]
+set -u
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <clox> <lox program> [runs] [thread counts...]" >&2
+    exit 64
+fi
+
+CLOX=$1
+PROGRAM=$2
+RUNS=${3:-3}
+shift $(( $# < 3 ? $# : 3 ))
+THREADS=${*:-1 2 4 8}
+
+. "$(dirname "${BASH_SOURCE[0]}")/bench_lib.sh"
+
+printf "%-12s %14s %8s\n" "gc threads" "time (ms)" "speedup"
+base=""
+for threads in $THREADS; do
+    elapsed=$(best_time "$RUNS" "$CLOX" --gc-threads "$threads" "$PROGRAM")
+    if [ -z "$base" ]; then base=$elapsed; fi
+    speedup=$(awk -v b="$base" -v t="$elapsed" 'BEGIN { printf (t > 0 ? "%.2fx" : "-"), b / t }')
+    printf "%-12s %14.3f %8s\n" "$threads" "$(awk -v t="$elapsed" 'BEGIN { print t / 1000 }')" "$speedup"
+done
@@ -0,0 +1,23 @@
+# Helpers shared by the benchmark scripts (bench.sh, bench_gc.sh, compare_backends.sh), sourced by them.
+
+# best_time <runs> <command> [args...]
+# The best wall time of <runs> runs of the command in microseconds, the command's output is discarded.
+# A shell function `keep_best_run`, if defined, is called right after every run that is the fastest so far,
+# e.g. to keep the files that run wrote.
+best_time() {
+    local runs=$1
+    shift
+    local best=""
+    for _ in $(seq "$runs"); do
+        local start end elapsed
+        start=$(date +%s%N)
+        "$@" > /dev/null 2>&1
+        end=$(date +%s%N)
+        elapsed=$(( (end - start) / 1000 ))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+            if declare -F keep_best_run > /dev/null; then keep_best_run; fi
+        fi
+    done
+    echo "$best"
+}
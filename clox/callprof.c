@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "callprof.h"
+
+// Calls and time per function (`--call-profile`).
+// Every frame takes the clock when its function starts (`enterCall`) and again when it returns
+// (`leaveCall`). What's in between is the call's inclusive time, and that minus the time its callees
+// took (which they add to the frame below them as they return) its exclusive time. Only the outermost
+// of recursive calls adds to the inclusive time, so it isn't counted once per level. Natives have no
+// frame, their calls are timed around the C function (`profileCallValue`).
+//
+// All of it happens in the instrumented copy of the dispatch loop (see `execute` in vm.c), which runs
+// whenever the profile is on: a call only leaves its frame with `profileStart` 0, and the loop enters it
+// once it gets there. The plain loop pays nothing for the profile. A native reached some other way, e.g.
+// stored in a field and invoked, is charged to its caller.
+//
+// A generator counts a call each time it's resumed, and its time up to the next `yield`. A tail call
+// ends the caller there and then, the callee goes on in the same frame as if the caller's caller
+// called it. A suspended fiber's frames keep running as far as the clock goes, and the fiber's run is
+// charged to whoever resumed it as well. A collection is charged to the function that triggered it.
+// Calls are only inlined and compiled with the profiler off (see main.c), or they'd have no frame, or
+// skip the loop that times them.
+
+typedef struct {
+    const char* name;
+    int line; // of a function, 0: a native
+    CallStats* stats;
+} CallRow;
+
+typedef struct CallProfile {
+    const char* path;
+    uint64_t startClock;
+    struct timespec startTime;
+    CallStats freed; // of the functions freed since
+} CallProfile;
+
+static uint64_t nanoseconds(struct timespec* time) {
+    return (uint64_t)time->tv_sec * 1000000000 + (uint64_t)time->tv_nsec;
+}
+
+CallProfile* newCallProfile(const char* path) {
+    CallProfile* profile = (CallProfile*)calloc(1, sizeof(CallProfile));
+    if (profile == NULL) exit(1);
+    profile->path = path;
+    clock_gettime(CLOCK_MONOTONIC, &profile->startTime);
+    profile->startClock = callClock();
+    return profile;
+}
+
+// a call of the same function may be in progress in another fiber, only one further down this stack
+// makes it recursive: that one is usually right below
+static bool isOutermost(CallFrame* frame, ObjFunction* function) {
+    if (function->profile.depth == 0) return true;
+    for (CallFrame* below = frame - 1; below >= vm->frames; below--) {
+        if (below->closure->function == function) return false;
+    }
+    return true;
+}
+
+static void startFrame(CallFrame* frame, uint64_t now) {
+    ObjFunction* function = frame->closure->function;
+    frame->profileOutermost = isOutermost(frame, function);
+    frame->profileChildren = 0;
+    frame->profileStart = now;
+    function->profile.calls++;
+    function->profile.depth++;
+}
+
+void enterCall(CallFrame* frame) {
+    startFrame(frame, callClock());
+}
+
+// charge the time since `frame` entered to `stats`, and to the callees of the frame below
+static void chargeFrame(CallFrame* frame, CallStats* stats, uint64_t now) {
+    uint64_t elapsed = now - frame->profileStart;
+    stats->depth--;
+    if (frame->profileOutermost) stats->inclusive += elapsed;
+    stats->exclusive += elapsed > frame->profileChildren ? elapsed - frame->profileChildren : 0;
+    // the bottom frame of a fiber has its caller on another stack
+    if (frame > vm->frames) frame[-1].profileChildren += elapsed;
+}
+
+void leaveCall(CallFrame* frame) {
+    chargeFrame(frame, &frame->closure->function->profile, callClock());
+}
+
+void switchCall(CallFrame* frame, ObjFunction* previous, uint64_t previousStart) {
+    uint64_t now = callClock();
+    frame->profileStart = previousStart;
+    chargeFrame(frame, &previous->profile, now);
+    startFrame(frame, now);
+}
+
+// `native` was called at `start`, and just returned
+static void countNativeCall(ObjNative* native, uint64_t start) {
+    uint64_t elapsed = callClock() - start;
+    native->profile.calls++;
+    native->profile.inclusive += elapsed;
+    native->profile.exclusive += elapsed;
+    if (vm->frameCount > 0) vm->frames[vm->frameCount - 1].profileChildren += elapsed;
+}
+
+bool profileCallValue(Value callee, int argCount) {
+    if (!IS_NATIVE(callee)) return callValue(callee, argCount);
+    uint64_t start = callClock();
+    bool ok = callValue(callee, argCount);
+    countNativeCall((ObjNative*)AS_OBJ(callee), start);
+    return ok;
+}
+
+void freeCallStats(ObjFunction* function) {
+    CallStats* freed = &vm->callProfile->freed;
+    freed->calls += function->profile.calls;
+    freed->inclusive += function->profile.inclusive;
+    freed->exclusive += function->profile.exclusive;
+}
+
+static int compareRows(const void* a, const void* b) {
+    const CallRow* left = (const CallRow*)a;
+    const CallRow* right = (const CallRow*)b;
+    if (left->stats->inclusive != right->stats->inclusive) {
+        return left->stats->inclusive < right->stats->inclusive ? 1 : -1;
+    }
+    if (left->stats->exclusive != right->stats->exclusive) {
+        return left->stats->exclusive < right->stats->exclusive ? 1 : -1;
+    }
+    return 0;
+}
+
+// the name a native was defined as
+static const char* nativeName(ObjNative* native) {
+    for (int i = 0; i < vm->natives.capacity; i++) {
+        Entry* entry = &vm->natives.entries[i];
+        if (entry->key != NULL && IS_OBJ(entry->value) && AS_OBJ(entry->value) == (Obj*)native) {
+            return entry->key->chars;
+        }
+    }
+    return "<native>";
+}
+
+static void writeRow(FILE* file, const char* name, int line, CallStats* stats, double msPerTick,
+                     double totalMs) {
+    double inclusive = (double)stats->inclusive * msPerTick;
+    double exclusive = (double)stats->exclusive * msPerTick;
+    fprintf(file, "%12llu %12.3f %5.1f%% %12.3f %5.1f%% %12.3f  ", (unsigned long long)stats->calls,
+            inclusive, totalMs > 0 ? inclusive * 100 / totalMs : 0,
+            exclusive, totalMs > 0 ? exclusive * 100 / totalMs : 0,
+            stats->calls > 0 ? inclusive * 1000 / (double)stats->calls : 0);
+    if (line > 0) {
+        fprintf(file, "%s (line %d)\n", name, line);
+    } else if (line == 0) {
+        fprintf(file, "%s (native)\n", name);
+    } else {
+        fprintf(file, "%s\n", name);
+    }
+}
+
+void finishCallProfile() {
+    CallProfile* profile = vm->callProfile;
+    if (profile == NULL) return;
+
+    struct timespec endTime;
+    uint64_t endClock = callClock();
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    double totalMs = (double)(nanoseconds(&endTime) - nanoseconds(&profile->startTime)) / 1e6;
+#if defined(__x86_64__) || defined(__i386__)
+    // the counter ticks at whatever rate it does, measured against the monotonic clock meanwhile
+    double msPerTick = endClock > profile->startClock ? totalMs / (double)(endClock - profile->startClock) : 0;
+#else
+    (void)endClock;
+    double msPerTick = 1e-6;
+#endif
+
+    int count = 0;
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_FUNCTION && ((ObjFunction*)object)->profile.calls > 0) count++;
+        if (object->type == OBJ_NATIVE && ((ObjNative*)object)->profile.calls > 0) count++;
+    }
+    CallRow* rows = (CallRow*)malloc(sizeof(CallRow) * (count > 0 ? count : 1));
+    if (rows == NULL) exit(1);
+    count = 0;
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_FUNCTION) {
+            ObjFunction* function = (ObjFunction*)object;
+            if (function->profile.calls == 0) continue;
+            rows[count++] = (CallRow){function->name == NULL ? "script" : function->name->chars,
+                                      function->chunk.count > 0 ? function->chunk.lines[0] : 1, &function->profile};
+        } else if (object->type == OBJ_NATIVE) {
+            ObjNative* native = (ObjNative*)object;
+            if (native->profile.calls == 0) continue;
+            rows[count++] = (CallRow){nativeName(native), 0, &native->profile};
+        }
+    }
+    qsort(rows, count, sizeof(CallRow), compareRows);
+
+    FILE* file = strcmp(profile->path, "-") == 0 ? stderr : fopen(profile->path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write the call profile to \"%s\".\n", profile->path);
+    } else {
+        fprintf(file, "== calls: %.3f ms profiled ==\n", totalMs);
+        fprintf(file, "%12s %12s %6s %12s %6s %12s  %s\n",
+                "calls", "incl (ms)", "", "excl (ms)", "", "avg (us)", "function");
+        for (int i = 0; i < count && i < CALL_REPORT_ROWS; i++) {
+            writeRow(file, rows[i].name, rows[i].line, rows[i].stats, msPerTick, totalMs);
+        }
+        if (count > CALL_REPORT_ROWS) fprintf(file, "... %d more functions ...\n", count - CALL_REPORT_ROWS);
+        if (profile->freed.calls > 0) {
+            writeRow(file, "(freed functions)", -1, &profile->freed, msPerTick, totalMs);
+        }
+        if (file != stderr) fclose(file);
+    }
+
+    free(rows);
+    free(profile);
+    vm->callProfile = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef clox_callprof_h
+#define clox_callprof_h
+
+#include <time.h>
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// the report lists this many functions at most, the longest running first
+#define CALL_REPORT_ROWS 40
+
+struct CallProfile;
+
+// the time calls are measured in: the time stamp counter where there's one (converted to nanoseconds
+// for the report), nanoseconds of CLOCK_MONOTONIC otherwise
+static inline uint64_t callClock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// for `vm->callProfile`: time every call, reported in the file at `path` ("-": stderr) once the VM is freed
+struct CallProfile* newCallProfile(const char* path);
+// the instrumented loop got to `frame`, which a call or a resumption left with `profileStart` 0
+void enterCall(CallFrame* frame);
+// `frame`, still the topmost, returns or yields
+void leaveCall(CallFrame* frame);
+// a tail call replaced the function of `frame`, which was `previous` since `previousStart`
+void switchCall(CallFrame* frame, ObjFunction* previous, uint64_t previousStart);
+// `callValue`, timing the call if `callee` is a native
+bool profileCallValue(Value callee, int argCount);
+// `function` is being freed, its calls go to the "(freed functions)" row
+void freeCallStats(ObjFunction* function);
+// write out the report
+void finishCallProfile();
+
+#endif
@@ -10,12 +10,16 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->inlineSites = NULL;
+    chunk->inlineSiteCount = 0;
+    chunk->inlineSiteCapacity = 0;
 }
 
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(InlineSite, chunk->inlineSites, chunk->inlineSiteCapacity);
     // zero-out the fields, leaving the chunk in a well-defined empty state
     initChunk(chunk);
 }
@@ -40,4 +44,21 @@ int addConstant(Chunk* chunk, Value value) {
     pop();
     // return the index of appended constant
     return chunk->constants.count - 1;
+}
+
+void addInlineSite(Chunk* chunk, InlineSite site) {
+    if (chunk->inlineSiteCapacity < chunk->inlineSiteCount + 1) {
+        int oldCapacity = chunk->inlineSiteCapacity;
+        chunk->inlineSiteCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->inlineSites = GROW_ARRAY(InlineSite, chunk->inlineSites, oldCapacity, chunk->inlineSiteCapacity);
+    }
+    chunk->inlineSites[chunk->inlineSiteCount++] = site;
+}
+
+InlineSite* findInlineSite(Chunk* chunk, int offset) {
+    for (int i = 0; i < chunk->inlineSiteCount; i++) {
+        InlineSite* site = &chunk->inlineSites[i];
+        if (offset >= site->start && offset < site->end) return site;
+    }
+    return NULL;
 }
\ No newline at end of file
@@ -32,29 +32,73 @@ typedef enum {
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
-    OP_LOOP,
+    OP_LOOP, // jump back by the 16-bit operand, the third operand numbers the loop in its function (see trace.c)
     OP_CALL,
+    OP_TAIL_CALL, // `return f(...)`: call reusing the current CallFrame, always followed by OP_RETURN
     OP_INVOKE,
+    OP_TAIL_INVOKE, // `return object.method(...)`: OP_INVOKE reusing the current CallFrame, like OP_TAIL_CALL
     OP_SUPER_INVOKE,
+    OP_TAIL_SUPER_INVOKE, // `return super.method(...)`, the same way
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
+    OP_YIELD, // suspend the frame into its generator, handing the top of the stack to the generator's caller
     OP_CLASS,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+    // fused operand form (FUSED_OPERANDS): the loads of the operands are fused into the operator, which reads
+    // them straight from `frame->slots` (L) or the constant table (K), the result is still pushed onto the stack
+    OP_ADD_LL,
+    OP_SUBTRACT_LL,
+    OP_MULTIPLY_LL,
+    OP_DIVIDE_LL,
+    OP_LESS_LL,
+    OP_GREATER_LL,
+    OP_EQUAL_LL,
+    OP_ADD_LK,
+    OP_SUBTRACT_LK,
+    OP_MULTIPLY_LK,
+    OP_DIVIDE_LK,
+    OP_LESS_LK,
+    OP_GREATER_LK,
+    OP_EQUAL_LK,
+    OP_STORE_LOCAL, // OP_SET_LOCAL fused with the OP_POP after it
+    // inlined calls (see `inlineCall` in compiler.c)
+    OP_CALL_INLINE, // guard that the callee is the inlined function, otherwise call it and skip the inlined body
+    OP_INVOKE_INLINE, // the same for a method invocation
+    OP_PEEK, // push a copy of the value `operand` slots below the top (the inlined function's locals)
+    OP_INLINE_RETURN // drop `operand` slots below the top, keeping the top (the inlined function's result)
 } OpCode;
 
+#define OP_COUNT (OP_INLINE_RETURN + 1)
+// the number of every OP_LOOP past the first 255 of a function, those loops are never traced
+#define LOOP_UNNUMBERED UINT8_MAX
+
+// the copy of an inlined function's body, for the stack trace of an error inside it (see `inlineCall`)
+typedef struct {
+    int start; // offset of the copy's first instruction
+    int end; // just past its last one
+    int line; // of the call
+    Value function; // the ObjFunction copied, also among the chunk's constants
+} InlineSite;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
-    int* lines;
+    int* lines; // of each byte, the bytes of an inlined body keep the lines of the function they were copied from
     ValueArray constants;
+    InlineSite* inlineSites;
+    int inlineSiteCount;
+    int inlineSiteCapacity;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+void addInlineSite(Chunk* chunk, InlineSite site);
+// the inlined body `offset` is in, NULL if none
+InlineSite* findInlineSite(Chunk* chunk, int offset);
 
 #endif
\ No newline at end of file
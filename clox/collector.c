@@ -0,0 +1,400 @@
+#include "common.h"
+#include "collector.h"
+
+#ifdef CONCURRENT_GC
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "memory.h"
+
+// Concurrent collection (see CONCURRENT_GC).
+// A cycle takes two short pauses of the program, and leaves the rest to a collector thread of the VM:
+//   1. root scan (pause): the roots are marked gray and handed to the collector thread
+//   2. concurrent mark: the collector thread blackens objects while the program runs
+//   3. remark (pause): the roots are marked again, along with what the collector left over,
+//      and the (weak) string table drops unmarked strings
+//   4. concurrent sweep: the collector thread frees the unmarked objects while the program runs
+//
+// The program calls `collectConcurrently` on every allocation while a cycle is on, which moves
+// the cycle on as soon as the collector thread is done with its part. A program allocating
+// faster than the collector keeps up with waits for it once it has grown the heap twice over.
+//
+// Marking uses an incremental update (Dijkstra) write barrier: a reference stored into the heap
+// during the mark is grayed, so no object the collector is done with can end up the only way to
+// an unmarked one. Objects allocated during the mark start out white and survive by being reachable
+// at remark. The stacks aren't barriered, so they're marked at remark: the program's own, as a root,
+// and the ones kept in fibers and generators, which the collector thread leaves to the remark
+// since the program moves and reallocates them as it runs.
+//
+// The collector thread reads objects the program may be writing. Plain stores of pointers and Values
+// are single aligned words on the platforms this is built for (see common.h), and an object is
+// always filled before a reference to it is stored. Reallocated arrays are the ones to watch out for:
+// tables are resized under `tableLock`, function constants only grow while compiling, and
+// a collection while compiling finishes the running cycle first and collects the usual way.
+//
+// Sweeping starts from the newest object at remark: the program keeps linking new objects in front
+// of it, and the collector thread only ever unlinks objects after it, so it keeps that one around
+// until the next cycle.
+
+typedef enum {
+    CYCLE_NONE,
+    CYCLE_MARKING,
+    CYCLE_SWEEPING,
+} CyclePhase;
+
+typedef struct Collector {
+    VM* vm;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // work for the collector thread, or quitting
+    pthread_cond_t parked; // the collector thread is done with its part
+    bool working; // guarded by `lock`
+    atomic_bool busy; // the same, for the program to poll without the lock
+    atomic_bool stop; // the program can't wait for the mark to finish by itself
+    bool quit;
+
+    CyclePhase phase; // only the program changes it, while the collector thread is parked
+
+    // the collector thread's, while it marks
+    Obj** gray;
+    int grayCount;
+    int grayCapacity;
+    Obj** deferred; // fibers and generators, blackened at remark
+    int deferredCount;
+    int deferredCapacity;
+    Obj** taken; // swapped with `incoming` to take the batches over
+    int takenCapacity;
+
+    // the program's batch of objects caught by the write barrier
+    Obj** barrier;
+    int barrierCount;
+    int barrierCapacity;
+    // full batches handed over, guarded by `lock`
+    Obj** incoming;
+    int incomingCount;
+    int incomingCapacity;
+
+    pthread_mutex_t tableLock;
+
+    Obj* sweepFrom;
+    size_t freed; // bytes freed by the sweep, read by the program once the collector thread is parked
+    double workSeconds; // seconds the collector thread worked on the cycle, read the same way
+    double pausedSeconds; // seconds the program waited for the cycle
+} Collector;
+
+// the collector the calling thread marks or sweeps for
+static _Thread_local Collector* marking = NULL;
+static _Thread_local Collector* sweeping = NULL;
+
+// note: plain `realloc` like the gray stack, marking mustn't allocate from the heap it's marking
+static void appendGray(Obj*** stack, int* count, int* capacity, Obj* object) {
+    if (*capacity < *count + 1) {
+        *capacity = GROW_CAPACITY(*capacity);
+        *stack = (Obj**)realloc(*stack, sizeof(Obj*) * *capacity);
+        if (*stack == NULL) exit(1);
+    }
+    (*stack)[(*count)++] = object;
+}
+
+bool collectorGray(Obj* object) {
+    Collector* collector = marking;
+    if (collector == NULL) return false;
+    if (atomic_exchange_explicit(&object->isMarked, true, memory_order_relaxed)) return true;
+
+    appendGray(&collector->gray, &collector->grayCount, &collector->grayCapacity, object);
+    return true;
+}
+
+static void blackenConcurrently(Collector* collector, Obj* object) {
+    switch (object->type) {
+        case OBJ_FIBER:
+        case OBJ_GENERATOR:
+            appendGray(&collector->deferred, &collector->deferredCount, &collector->deferredCapacity, object);
+            break;
+        case OBJ_CLASS:
+        case OBJ_INSTANCE:
+            pthread_mutex_lock(&collector->tableLock);
+            blackenObject(object);
+            pthread_mutex_unlock(&collector->tableLock);
+            break;
+        default:
+            blackenObject(object);
+            break;
+    }
+}
+
+// mark until there's no gray object left, or the program asks to stop
+static void markConcurrently(Collector* collector) {
+    marking = collector;
+    for (;;) {
+        while (collector->grayCount > 0) {
+            if (atomic_load_explicit(&collector->stop, memory_order_relaxed)) {
+                marking = NULL;
+                return;
+            }
+            blackenConcurrently(collector, collector->gray[--collector->grayCount]);
+        }
+
+        // gray whatever the write barrier caught in the meantime
+        pthread_mutex_lock(&collector->lock);
+        Obj** taken = collector->incoming;
+        int count = collector->incomingCount;
+        int capacity = collector->incomingCapacity;
+        collector->incoming = collector->taken;
+        collector->incomingCount = 0;
+        collector->incomingCapacity = collector->takenCapacity;
+        collector->taken = taken;
+        collector->takenCapacity = capacity;
+        pthread_mutex_unlock(&collector->lock);
+        if (count == 0) break;
+        for (int i = 0; i < count; i++) collectorGray(taken[i]);
+    }
+    marking = NULL;
+}
+
+static void sweepConcurrently(Collector* collector) {
+    sweeping = collector;
+    Obj* previous = collector->sweepFrom;
+    if (previous != NULL) {
+        atomic_store_explicit(&previous->isMarked, false, memory_order_relaxed);
+        Obj* object = previous->next;
+        while (object != NULL) {
+            if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) {
+                atomic_store_explicit(&object->isMarked, false, memory_order_relaxed);
+                previous = object;
+                object = object->next;
+            } else {
+                Obj* unreached = object;
+                object = object->next;
+                previous->next = object;
+                freeObject(unreached);
+            }
+        }
+    }
+    sweeping = NULL;
+}
+
+bool collectorFree(void* pointer, size_t oldSize) {
+    Collector* collector = sweeping;
+    if (collector == NULL) return false;
+    collector->freed += oldSize;
+    free(pointer);
+    return true;
+}
+
+static void* collectorMain(void* arg) {
+    Collector* collector = (Collector*)arg;
+    vm = collector->vm;
+
+    pthread_mutex_lock(&collector->lock);
+    for (;;) {
+        while (!collector->working && !collector->quit) pthread_cond_wait(&collector->wake, &collector->lock);
+        if (collector->quit) break;
+        CyclePhase phase = collector->phase;
+        pthread_mutex_unlock(&collector->lock);
+
+        double start = gcClock();
+        if (phase == CYCLE_MARKING) {
+            markConcurrently(collector);
+        } else {
+            sweepConcurrently(collector);
+        }
+        double end = gcClock();
+        recordWork(phase == CYCLE_MARKING ? "mark" : "sweep", start, end);
+
+        pthread_mutex_lock(&collector->lock);
+        collector->workSeconds += end - start;
+        collector->working = false;
+        atomic_store_explicit(&collector->busy, false, memory_order_release);
+        pthread_cond_broadcast(&collector->parked);
+    }
+    pthread_mutex_unlock(&collector->lock);
+    return NULL;
+}
+
+static Collector* newCollector() {
+    Collector* collector = (Collector*)calloc(1, sizeof(Collector));
+    if (collector == NULL) exit(1);
+    collector->vm = vm;
+    pthread_mutex_init(&collector->lock, NULL);
+    pthread_cond_init(&collector->wake, NULL);
+    pthread_cond_init(&collector->parked, NULL);
+    pthread_mutex_init(&collector->tableLock, NULL);
+    if (pthread_create(&collector->thread, NULL, collectorMain, collector) != 0) {
+        fprintf(stderr, "Could not start the GC thread.\n");
+        exit(71);
+    }
+    return collector;
+}
+
+static void startWork(Collector* collector, CyclePhase phase) {
+    pthread_mutex_lock(&collector->lock);
+    collector->phase = phase;
+    collector->working = true;
+    atomic_store_explicit(&collector->busy, true, memory_order_relaxed);
+    pthread_cond_signal(&collector->wake);
+    pthread_mutex_unlock(&collector->lock);
+}
+
+static void waitParked(Collector* collector) {
+    pthread_mutex_lock(&collector->lock);
+    while (collector->working) pthread_cond_wait(&collector->parked, &collector->lock);
+    pthread_mutex_unlock(&collector->lock);
+}
+
+// pause 1
+static void scanRoots(Collector* collector) {
+    markRoots();
+
+    // the gray stack becomes the collector thread's
+    Obj** gray = collector->gray;
+    int capacity = collector->grayCapacity;
+    collector->gray = vm->grayStack;
+    collector->grayCount = vm->grayCount;
+    collector->grayCapacity = vm->grayCapacity;
+    vm->grayStack = gray;
+    vm->grayCount = 0;
+    vm->grayCapacity = capacity;
+    collector->deferredCount = 0;
+    atomic_store_explicit(&collector->stop, false, memory_order_relaxed);
+
+    vm->marking = true;
+    startWork(collector, CYCLE_MARKING);
+}
+
+// pause 2, the collector thread is parked
+static void remark(Collector* collector) {
+    // everything still gray is already marked
+    for (int i = 0; i < collector->grayCount; i++) {
+        appendGray(&vm->grayStack, &vm->grayCount, &vm->grayCapacity, collector->gray[i]);
+    }
+    collector->grayCount = 0;
+    for (int i = 0; i < collector->deferredCount; i++) {
+        blackenObject(collector->deferred[i]);
+    }
+    collector->deferredCount = 0;
+    for (int i = 0; i < collector->incomingCount; i++) markObject(collector->incoming[i]);
+    collector->incomingCount = 0;
+    for (int i = 0; i < collector->barrierCount; i++) markObject(collector->barrier[i]);
+    collector->barrierCount = 0;
+    vm->marking = false;
+
+    markRoots();
+    traceReferences();
+    tableRemoveWhite(&vm->strings);
+
+    collector->sweepFrom = vm->objects;
+    collector->freed = 0;
+    startWork(collector, CYCLE_SWEEPING);
+}
+
+static void finishSweep(Collector* collector) {
+    vm->bytesAllocated -= collector->freed;
+    vm->gcStats.concurrentCycles++;
+    vm->gcStats.bytesFreed += collector->freed;
+    collector->phase = CYCLE_NONE;
+    sizeHeap(collector->workSeconds + collector->pausedSeconds, collector->pausedSeconds);
+}
+
+void collectConcurrently() {
+    if (vm->collector == NULL) vm->collector = newCollector();
+    Collector* collector = vm->collector;
+
+    if (collector->phase == CYCLE_NONE) {
+        double start = gcClock();
+        collector->workSeconds = 0;
+        collector->pausedSeconds = 0;
+        scanRoots(collector);
+        double end = gcClock();
+        collector->pausedSeconds += end - start;
+        recordPause("root scan", start, end);
+        return;
+    }
+
+    // keep running, unless the heap got out of hand waiting for the collector thread
+    bool busy = atomic_load_explicit(&collector->busy, memory_order_acquire);
+    if (busy && vm->bytesAllocated <= vm->nextGC * vm->gcGrowth) return;
+    double start = gcClock();
+    if (busy) atomic_store_explicit(&collector->stop, true, memory_order_relaxed);
+    // the collector thread's writes happened before `busy` was cleared, take the lock to see them all
+    waitParked(collector);
+
+    bool marked = collector->phase == CYCLE_MARKING;
+    if (marked) remark(collector);
+    double end = gcClock();
+    collector->pausedSeconds += end - start;
+    recordPause(marked ? "remark" : "sweep wait", start, end);
+    if (!marked) finishSweep(collector);
+}
+
+void finishConcurrentCycle() {
+    Collector* collector = vm->collector;
+    if (collector == NULL || collector->phase == CYCLE_NONE) return;
+
+    double start = gcClock();
+    if (collector->phase == CYCLE_MARKING) {
+        atomic_store_explicit(&collector->stop, true, memory_order_relaxed);
+        waitParked(collector);
+        remark(collector);
+    }
+    waitParked(collector);
+    double end = gcClock();
+    collector->pausedSeconds += end - start;
+    recordPause("finish cycle", start, end);
+    finishSweep(collector);
+}
+
+void writeBarrier(Obj* object) {
+    if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) return;
+
+    Collector* collector = vm->collector;
+    appendGray(&collector->barrier, &collector->barrierCount, &collector->barrierCapacity, object);
+    if (collector->barrierCount < GC_BARRIER_BATCH) return;
+
+    pthread_mutex_lock(&collector->lock);
+    for (int i = 0; i < collector->barrierCount; i++) {
+        appendGray(&collector->incoming, &collector->incomingCount, &collector->incomingCapacity,
+                   collector->barrier[i]);
+    }
+    pthread_mutex_unlock(&collector->lock);
+    collector->barrierCount = 0;
+}
+
+void lockTables() {
+    if (vm->marking) pthread_mutex_lock(&vm->collector->tableLock);
+}
+
+void unlockTables() {
+    if (vm->marking) pthread_mutex_unlock(&vm->collector->tableLock);
+}
+
+void freeCollector() {
+    Collector* collector = vm->collector;
+    if (collector == NULL) return;
+    finishConcurrentCycle();
+
+    pthread_mutex_lock(&collector->lock);
+    collector->quit = true;
+    pthread_cond_signal(&collector->wake);
+    pthread_mutex_unlock(&collector->lock);
+    pthread_join(collector->thread, NULL);
+
+    pthread_mutex_destroy(&collector->lock);
+    pthread_cond_destroy(&collector->wake);
+    pthread_cond_destroy(&collector->parked);
+    pthread_mutex_destroy(&collector->tableLock);
+    free(collector->gray);
+    free(collector->deferred);
+    free(collector->barrier);
+    free(collector->incoming);
+    free(collector->taken);
+    free(collector);
+    vm->collector = NULL;
+}
+
+#endif
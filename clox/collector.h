@@ -0,0 +1,56 @@
+#ifndef clox_collector_h
+#define clox_collector_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// the program hands what its write barrier caught over to the collector thread this many objects at a time
+#define GC_BARRIER_BATCH 256
+
+struct Collector;
+
+#ifdef CONCURRENT_GC
+// a reference to the heap object `value` is being stored into the heap (a field, a table, a closed upvalue)
+// while the collector thread marks: it mustn't end up only behind objects the collector is already done with
+#define WRITE_BARRIER(value) \
+    do { \
+        if (vm->marking && IS_OBJ(value)) writeBarrier(AS_OBJ(value)); \
+    } while (false)
+#else
+#define WRITE_BARRIER(value) do { } while (false)
+#endif
+
+#ifdef CONCURRENT_GC
+// a field the collector thread reads while the program may be writing it (see collector.c): release stores and
+// acquire loads, so an object published through the field is seen initialized, the same plain moves on x86-64,
+// yet not a data race to the C memory model (and ThreadSanitizer)
+// note: the builtins behind `atomic_load_explicit`, which also take the fields that aren't declared _Atomic
+#define SHARED_LOAD(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#define SHARED_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#else
+#define SHARED_LOAD(field) (field)
+#define SHARED_STORE(field, value) ((field) = (value))
+#endif
+
+// `collectGarbage` with `vm->concurrentGC` on: start a cycle, or move the running one on to its next step
+void collectConcurrently();
+// bring the running cycle (if any) to its end, the program waits for whatever is left
+void finishConcurrentCycle();
+void writeBarrier(Obj* object);
+// the collector thread marking: gray `object` on its own stack (see `markerGray`), false on any other thread
+bool collectorGray(Obj* object);
+// the collector thread sweeping: `reallocate` frees the object without touching the program's `bytesAllocated`
+bool collectorFree(void* pointer, size_t oldSize);
+// the program resizing a table the collector thread might be reading
+#ifdef CONCURRENT_GC
+void lockTables();
+void unlockTables();
+#else
+#define lockTables() do { } while (false)
+#define unlockTables() do { } while (false)
+#endif
+// stop and join the collector thread, once the VM is freed
+void freeCollector();
+
+#endif
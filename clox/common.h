@@ -6,12 +6,80 @@
 #include <stdint.h>
 
 #define NAN_BOXING
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// fuse loads of locals and constants into the binary operator using them (see OP_ADD_LL)
+// the `clox_fused` CMake target is always built with this enabled
+//#define FUSED_OPERANDS
+// compile hot functions to x86-64 machine code (see jit.c), `--no-jit` turns it off at runtime
+#define BASELINE_JIT
+// record and compile traces of hot loops in interpreted code (see trace.c), needs BASELINE_JIT
+#define TRACING_JIT
+// event loop for fibers waiting on timers, files and sockets (see scheduler.c), needs epoll
+#define ASYNC_IO
+// identifiers and string literals can be interned once per process instead of once per VM (see intern.c),
+// a host turns it on with `sharedStrings`
+#define SHARED_STRINGS
+// mark big heaps with several threads while the program waits (see marker.c), `--gc-threads` sets how many
+#define PARALLEL_MARK
+// mark and sweep on a background thread while the program runs (see collector.c), `--concurrent-gc` turns it on
+// relies on aligned 8-byte loads and stores being atomic, Values included (NaN boxing), and on stores becoming
+// visible in order (x86-64)
+#define CONCURRENT_GC
+// keep instances in blocks of their own and slide them together once those are mostly empty (see compactor.c),
+// `--compact` turns it on
+#define COMPACTING_GC
+// sample the Lox call stack on a SIGPROF timer into folded stacks for flame graphs (see cpuprof.c),
+// `--cpu-profile` turns it on
+#define CPU_PROFILER
+// count the instructions `run` executes, by opcode, pair of opcodes and function (see opstats.c),
+// `--opcode-stats` turns it on, the `clox_stats` CMake target is always built with this enabled
+//#define OPCODE_STATS
+// read cycles, instructions, branch and cache misses from perf_event_open around `interpret` (see perfcount.c),
+// `--perf-counters` turns it on
+#define PERF_COUNTERS
 
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
 
+// the JIT emits x86-64 code for NaN-boxed values and needs mmap/mprotect
+#if defined(BASELINE_JIT) && \
+    !(defined(__x86_64__) && defined(NAN_BOXING) && (defined(__unix__) || defined(__APPLE__)))
+#undef BASELINE_JIT
+#endif
+#ifndef BASELINE_JIT
+#undef TRACING_JIT
+#endif
+#if defined(ASYNC_IO) && !defined(__linux__)
+#undef ASYNC_IO
+#endif
+#if defined(PARALLEL_MARK) && !(defined(__unix__) || defined(__APPLE__))
+#undef PARALLEL_MARK
+#endif
+#if defined(CONCURRENT_GC) && !(defined(__x86_64__) && defined(NAN_BOXING) && (defined(__unix__) || defined(__APPLE__)))
+#undef CONCURRENT_GC
+#endif
+#if defined(COMPACTING_GC) && !(defined(__unix__) || defined(__APPLE__))
+#undef COMPACTING_GC
+#endif
+#if defined(CPU_PROFILER) && !(defined(__unix__) || defined(__APPLE__))
+#undef CPU_PROFILER
+#endif
+#if defined(PERF_COUNTERS) && !defined(__linux__)
+#undef PERF_COUNTERS
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// have the compiler copy a function into each caller, so a constant argument specializes every copy
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+// keep a function out of its callers, e.g. a copy of the dispatch loop that rarely runs (see `run`)
+#if defined(__GNUC__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,344 @@
+#include "common.h"
+#include "compactor.h"
+
+#ifdef COMPACTING_GC
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "memory.h"
+#include "scheduler.h"
+#include "vm.h"
+
+// Compaction of instances (see COMPACTING_GC).
+// Instances are most of a long-running program's objects, and the ones it allocates together and
+// uses together. With `vm->compactGC` on they don't come from `malloc` one by one: they take slots in
+// blocks of their own, and a freed instance leaves a hole in its block that the next one fills.
+//
+// Once the holes make up most of the blocks (see COMPACT_THRESHOLD), the next safepoint slides every
+// instance down into the lowest free slot, keeping them in the order of the blocks (Lisp 2 style):
+//   1. forwarding: the n-th live slot is going to move to the n-th slot of the blocks
+//   2. fix up: every reference to an instance is pointed to where it's going to be, the stacks
+//      (the VM's, the fibers' and the generators'), tables, upvalues, bound methods and the object list
+//   3. move: the instances are copied down, in order, so none lands on one still to be moved
+//   4. release: the blocks left empty are unmapped, the memory goes back to the system
+//
+// Nothing else moves: classes, closures and functions stay where they are, so CallFrames, upvalues
+// and compiled code (which only ever refers to those) are left alone. An instance moves along with
+// the pointer to its field table, the table itself stays put.
+//
+// A safepoint is between two instructions of `run`, where every instance the program can reach
+// is behind one of the roots: the interpreter keeps no instance in a local variable there, run
+// isn't reentered, and compiled code has handed back to the interpreter.
+// The collector thread of CONCURRENT_GC frees instances while the program runs, `--compact`
+// can't be combined with it.
+
+typedef struct InstanceBlock {
+    struct InstanceBlock* next;
+    int index; // position in the list of blocks
+    int used; // slots holding an instance
+} InstanceBlock;
+
+// the slots follow the header, each with a flag in `live` telling whether it holds an instance
+#define INSTANCE_BLOCK_SLOTS \
+    ((int)((INSTANCE_BLOCK_SIZE - sizeof(InstanceBlock)) / (sizeof(ObjInstance) + 1)))
+#define BLOCK_SLOTS_OFFSET \
+    ((sizeof(InstanceBlock) + INSTANCE_BLOCK_SLOTS + _Alignof(ObjInstance) - 1) / _Alignof(ObjInstance) * _Alignof(ObjInstance))
+
+_Static_assert(BLOCK_SLOTS_OFFSET + INSTANCE_BLOCK_SLOTS * sizeof(ObjInstance) <= INSTANCE_BLOCK_SIZE,
+               "the slots of an instance block don't fit");
+
+#define BLOCK_OF(instance) ((InstanceBlock*)((uintptr_t)(instance) & ~(uintptr_t)(INSTANCE_BLOCK_SIZE - 1)))
+
+typedef struct Compactor {
+    InstanceBlock* blocks;
+    InstanceBlock* last;
+    int blockCount;
+    int instanceCount;
+    ObjInstance* freeSlots; // linked through `obj.next`
+    ObjInstance** forward; // during a compaction: where the instance in each slot of the blocks goes
+} Compactor;
+
+static inline bool* liveFlags(InstanceBlock* block) {
+    return (bool*)(block + 1);
+}
+
+static inline ObjInstance* blockSlots(InstanceBlock* block) {
+    return (ObjInstance*)((char*)block + BLOCK_SLOTS_OFFSET);
+}
+
+static Compactor* getCompactor() {
+    if (vm->compactor != NULL) return vm->compactor;
+
+    Compactor* compactor = (Compactor*)calloc(1, sizeof(Compactor));
+    if (compactor == NULL) exit(1);
+    vm->compactor = compactor;
+    return compactor;
+}
+
+// mmap only promises page alignment: map twice the size and unmap whatever sticks out of an aligned block
+static InstanceBlock* mapBlock() {
+    size_t size = INSTANCE_BLOCK_SIZE;
+    char* mapped = (char*)mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) exit(1);
+    char* aligned = (char*)(((uintptr_t)mapped + size - 1) & ~(uintptr_t)(size - 1));
+    if (aligned > mapped) munmap(mapped, aligned - mapped);
+    if (aligned + size < mapped + size * 2) munmap(aligned + size, mapped + size * 2 - (aligned + size));
+    return (InstanceBlock*)aligned;
+}
+
+// the free slots of `block` from `first` on, put in front of the free list lowest first
+static void freeSlotsFrom(Compactor* compactor, InstanceBlock* block, int first) {
+    ObjInstance* slots = blockSlots(block);
+    for (int i = INSTANCE_BLOCK_SLOTS - 1; i >= first; i--) {
+        slots[i].obj.next = (Obj*)compactor->freeSlots;
+        compactor->freeSlots = &slots[i];
+    }
+}
+
+static void addBlock(Compactor* compactor) {
+    InstanceBlock* block = mapBlock();
+    block->next = NULL;
+    block->index = compactor->blockCount++;
+    block->used = 0;
+    memset(liveFlags(block), 0, INSTANCE_BLOCK_SLOTS);
+    if (compactor->last != NULL) {
+        compactor->last->next = block;
+    } else {
+        compactor->blocks = block;
+    }
+    compactor->last = block;
+    freeSlotsFrom(compactor, block, 0);
+}
+
+ObjInstance* allocateInstance() {
+    vm->bytesAllocated += sizeof(ObjInstance);
+    collectIfDue();
+
+    Compactor* compactor = getCompactor();
+    if (compactor->freeSlots == NULL) addBlock(compactor);
+    ObjInstance* instance = compactor->freeSlots;
+    compactor->freeSlots = (ObjInstance*)instance->obj.next;
+
+    InstanceBlock* block = BLOCK_OF(instance);
+    liveFlags(block)[instance - blockSlots(block)] = true;
+    block->used++;
+    compactor->instanceCount++;
+    return instance;
+}
+
+void freeInstance(ObjInstance* instance) {
+    vm->bytesAllocated -= sizeof(ObjInstance);
+
+    Compactor* compactor = vm->compactor;
+    InstanceBlock* block = BLOCK_OF(instance);
+    liveFlags(block)[instance - blockSlots(block)] = false;
+    block->used--;
+    compactor->instanceCount--;
+    instance->obj.next = (Obj*)compactor->freeSlots;
+    compactor->freeSlots = instance;
+}
+
+void checkFragmentation() {
+    Compactor* compactor = vm->compactor;
+    if (compactor == NULL || compactor->blockCount < 2) return;
+    // at most half the slots used and two blocks or more: a compaction releases a block at least
+    if ((long)compactor->instanceCount * 100 < (long)compactor->blockCount * INSTANCE_BLOCK_SLOTS * COMPACT_THRESHOLD) {
+        vm->interrupts |= INTERRUPT_COMPACT;
+    }
+}
+
+static Obj* forwardObject(Obj* object) {
+    if (object == NULL || object->type != OBJ_INSTANCE) return object;
+    InstanceBlock* block = BLOCK_OF(object);
+    int slot = (int)((ObjInstance*)object - blockSlots(block));
+    return (Obj*)vm->compactor->forward[block->index * INSTANCE_BLOCK_SLOTS + slot];
+}
+
+void forwardValue(Value* value) {
+    if (IS_OBJ(*value)) *value = OBJ_VAL(forwardObject(AS_OBJ(*value)));
+}
+
+static void forwardValues(Value* start, Value* end) {
+    for (Value* value = start; value < end; value++) {
+        forwardValue(value);
+    }
+}
+
+static void forwardTable(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        forwardValue(&table->entries[i].value);
+    }
+}
+
+// the references `object` holds, mirroring `blackenObject`: only the ones that can be an instance
+static void forwardReferences(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD:
+            forwardValue(&((ObjBoundMethod*)object)->receiver);
+            break;
+        case OBJ_CLASS:
+            forwardTable(&((ObjClass*)object)->methods);
+            break;
+        case OBJ_FIBER: {
+            // its own stack while suspended, its resumer's while running, every stack is in exactly one place
+            ObjFiber* fiber = (ObjFiber*)object;
+            forwardValues(fiber->stack, fiber->stackTop);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ValueArray* constants = &((ObjFunction*)object)->chunk.constants;
+            forwardValues(constants->values, constants->values + constants->count);
+            break;
+        }
+        case OBJ_GENERATOR: {
+            ObjGenerator* generator = (ObjGenerator*)object;
+            forwardValues(generator->slots, generator->slots + generator->slotCount);
+            break;
+        }
+        case OBJ_INSTANCE:
+            forwardTable(&((ObjInstance*)object)->fields);
+            break;
+        case OBJ_UPVALUE:
+            // an open upvalue points into a stack, which is fixed up by itself
+            forwardValue(&((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_CLOSURE:
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+// 1. the n-th live slot goes to the n-th slot
+static void computeForwarding(Compactor* compactor) {
+    compactor->forward = (ObjInstance**)malloc(sizeof(ObjInstance*) * compactor->blockCount * INSTANCE_BLOCK_SLOTS);
+    if (compactor->forward == NULL) exit(1);
+
+    InstanceBlock* target = compactor->blocks;
+    int targetSlot = 0;
+    for (InstanceBlock* block = compactor->blocks; block != NULL; block = block->next) {
+        bool* live = liveFlags(block);
+        for (int i = 0; i < INSTANCE_BLOCK_SLOTS; i++) {
+            if (!live[i]) continue;
+            compactor->forward[block->index * INSTANCE_BLOCK_SLOTS + i] = &blockSlots(target)[targetSlot];
+            if (++targetSlot == INSTANCE_BLOCK_SLOTS) {
+                target = target->next;
+                targetSlot = 0;
+            }
+        }
+    }
+}
+
+// 2. every reference to an instance, while all of them are still where they were
+static void fixReferences() {
+    forwardValues(vm->stack, vm->stackTop);
+    forwardTable(&vm->globals);
+    forwardTable(&vm->natives);
+#ifdef ASYNC_IO
+    forwardScheduler();
+#endif
+
+    // the list goes through the instances too: follow the old links, store the new ones
+    Obj* object = vm->objects;
+    vm->objects = forwardObject(vm->objects);
+    while (object != NULL) {
+        forwardReferences(object);
+        Obj* next = object->next;
+        object->next = forwardObject(next);
+        object = next;
+    }
+}
+
+// 3. and 4. every instance goes to a lower slot than any it hasn't been moved out of yet
+static void moveInstances(Compactor* compactor) {
+    for (InstanceBlock* block = compactor->blocks; block != NULL; block = block->next) {
+        bool* live = liveFlags(block);
+        ObjInstance* slots = blockSlots(block);
+        for (int i = 0; i < INSTANCE_BLOCK_SLOTS; i++) {
+            if (!live[i]) continue;
+            ObjInstance* target = compactor->forward[block->index * INSTANCE_BLOCK_SLOTS + i];
+            if (target == &slots[i]) continue;
+            memcpy(target, &slots[i], sizeof(ObjInstance));
+            live[i] = false;
+            liveFlags(BLOCK_OF(target))[target - blockSlots(BLOCK_OF(target))] = true;
+        }
+    }
+    free(compactor->forward);
+    compactor->forward = NULL;
+
+    // the instances now fill the first blocks, the last of them maybe partly
+    int keep = (compactor->instanceCount + INSTANCE_BLOCK_SLOTS - 1) / INSTANCE_BLOCK_SLOTS;
+    if (keep == 0) keep = 1;
+    int remaining = compactor->instanceCount;
+    InstanceBlock* last = compactor->blocks;
+    for (int i = 1; i < keep; i++) {
+        last->used = INSTANCE_BLOCK_SLOTS;
+        remaining -= INSTANCE_BLOCK_SLOTS;
+        last = last->next;
+    }
+    last->used = remaining;
+
+    InstanceBlock* block = last->next;
+    while (block != NULL) {
+        InstanceBlock* next = block->next;
+        munmap(block, INSTANCE_BLOCK_SIZE);
+        block = next;
+    }
+    last->next = NULL;
+    compactor->last = last;
+    compactor->blockCount = keep;
+
+    compactor->freeSlots = NULL;
+    freeSlotsFrom(compactor, last, last->used);
+}
+
+void compactHeap() {
+    vm->interrupts &= ~INTERRUPT_COMPACT;
+    Compactor* compactor = vm->compactor;
+    if (compactor == NULL) return;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compact begin\n");
+    int before = compactor->blockCount;
+#endif
+    double start = gcClock();
+
+    computeForwarding(compactor);
+    fixReferences();
+    moveInstances(compactor);
+#ifdef __GLIBC__
+    // the field tables and everything else the last collection freed are still `malloc`ed memory,
+    // hand its free pages back as well (glibc keeps them otherwise)
+    malloc_trim(0);
+#endif
+    vm->gcStats.compactions++;
+    recordPause("compact", start, gcClock());
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compact end\n");
+    printf("   %d instances, released %d of %d blocks\n",
+           compactor->instanceCount, before - compactor->blockCount, before);
+#endif
+}
+
+void freeCompactor() {
+    Compactor* compactor = vm->compactor;
+    if (compactor == NULL) return;
+
+    InstanceBlock* block = compactor->blocks;
+    while (block != NULL) {
+        InstanceBlock* next = block->next;
+        munmap(block, INSTANCE_BLOCK_SIZE);
+        block = next;
+    }
+    free(compactor);
+    vm->compactor = NULL;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef clox_compactor_h
+#define clox_compactor_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// instances live in blocks of this many bytes (a power of two), aligned to their size,
+// so an instance finds its block by masking its address
+#define INSTANCE_BLOCK_SIZE (64 * 1024)
+// a collection asks for a compaction once fewer than this percent of the blocks' slots hold an instance
+#define COMPACT_THRESHOLD 50
+
+struct Compactor;
+
+// `newInstance` with `vm->compactGC` on: take a slot from the blocks, counted like any other allocation
+ObjInstance* allocateInstance();
+// `freeObject` hands the slot back
+void freeInstance(ObjInstance* instance);
+// after a collection: the blocks are empty enough to be worth a compaction at the next safepoint
+void checkFragmentation();
+// slide every instance towards the first block, fix up every reference to one, and unmap the blocks left empty
+// only safe while no C code holds an instance in a local variable, `run` calls it between two instructions
+void compactHeap();
+// during `compactHeap`: point `value` to where its instance is going to be
+void forwardValue(Value* value);
+// unmap the blocks, once the VM is freed (after its objects)
+void freeCompactor();
+
+#endif
@@ -0,0 +1,26 @@
+#!/usr/bin/env bash
+# Time the stack VM and the fused operand VM side by side on every Lox program in a directory.
+# usage: compare_backends.sh <stack clox> <fused clox> <dir with .lox files> [runs]
+set -u
+
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 <stack clox> <fused clox> <lox dir> [runs]" >&2
+    exit 64
+fi
+
+STACK_VM=$1
+FUSED_VM=$2
+LOX_DIR=$3
+RUNS=${4:-5}
+
+. "$(dirname "${BASH_SOURCE[0]}")/bench_lib.sh"
+
+printf "%-28s %14s %14s %8s\n" "program" "stack (ms)" "fused (ms)" "speedup"
+for program in "$LOX_DIR"/*.lox; do
+    stack=$(best_time "$RUNS" "$STACK_VM" "$program")
+    fused=$(best_time "$RUNS" "$FUSED_VM" "$program")
+    speedup=$(awk -v s="$stack" -v r="$fused" 'BEGIN { printf (r > 0 ? "%.2fx" : "-"), s / r }')
+    printf "%-28s %14.3f %14.3f %8s\n" "$(basename "$program")" \
+        "$(awk -v t="$stack" 'BEGIN { print t / 1000 }')" \
+        "$(awk -v t="$fused" 'BEGIN { print t / 1000 }')" "$speedup"
+done
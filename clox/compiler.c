@@ -4,13 +4,10 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "debug.h"
 #include "memory.h"
 #include "scanner.h"
 
-#ifdef DEBUG_PRINT_CODE
-#include "debug.h"
-#endif
-
 typedef struct {
     Token current;
     Token previous;
@@ -72,6 +69,15 @@ typedef struct Compiler {
     int localCount; // how many locals are in scope (array slots in use)
     Upvalue upvalues[UINT8_COUNT]; // upvalue array (for capturing variables in closure)
     int scopeDepth; // number of blocks surrounding current bit of code
+
+    // bookkeeping for the fused form peephole (FUSED_OPERANDS)
+    // the bytecode alone can't tell an opcode from an operand, so remember where the candidates start
+    int loads[2]; // offsets of the last two OP_GET_LOCAL / OP_CONSTANT instructions (older first)
+    int lastSetLocal; // offset of the last OP_SET_LOCAL instruction
+    int lastTarget; // highest offset any forward jump lands on, nothing before it can be fused across
+
+    int lastGetGlobal; // offset of the last OP_GET_GLOBAL instruction, to spot calls of a global function
+    int lastCall; // offset of the last OP_CALL, OP_INVOKE or OP_SUPER_INVOKE, to spot calls in tail position
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -79,9 +85,23 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL; // current, innermost class being compiled
+// a function or method compiled so far, which calls can be inlined into (see `inlineCall`)
+typedef struct {
+    ObjString* name; // the global the function is declared as, or the method name
+    ObjFunction* function; // NULL if it can't be inlined, or several methods share the name
+    bool isMethod;
+} InlineCandidate;
+
+// a function body longer than this (in bytes of bytecode) is never inlined
+#define INLINE_MAX_SIZE 32
+
+// per thread, so VMs on different threads can compile at the same time
+// a compilation runs from start to end within one call of `interpret`, on the thread of its VM
+_Thread_local Parser parser;
+_Thread_local Compiler* current = NULL;
+_Thread_local ClassCompiler* currentClass = NULL; // current, innermost class being compiled
+_Thread_local InlineCandidate inlineCandidates[UINT8_COUNT];
+_Thread_local int inlineCandidateCount = 0;
 
 static Chunk* currentChunk() {
     return &current->function->chunk;
@@ -164,12 +184,15 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
 static void emitLoop(int loopStart) {
     emitByte(OP_LOOP);
 
-    // +2: take care of the operands
-    int offset = currentChunk()->count - loopStart + 2;
+    // +3: take care of the operands
+    int offset = currentChunk()->count - loopStart + 3;
     if (offset > UINT16_MAX) error ("Loop body too large.");
 
     emitByte((offset >> 8) & 0xff);
     emitByte(offset & 0xff);
+    // the tracing JIT keeps the loop's counters under this number
+    ObjFunction* function = current->function;
+    emitByte(function->loopCount < LOOP_UNNUMBERED ? (uint8_t)function->loopCount++ : LOOP_UNNUMBERED);
 }
 
 // emit a bytecode instruction and write a placeholder operand for jump offset
@@ -203,13 +226,57 @@ static uint8_t makeConstant(Value value) {
     return (uint8_t)constant;
 }
 
+// remember the offset of a just emitted OP_GET_LOCAL / OP_CONSTANT for the fused form peephole
+static void recordLoad() {
+    current->loads[0] = current->loads[1];
+    current->loads[1] = currentChunk()->count - 2;
+}
+
 static void emitConstant(Value value) {
     emitBytes(OP_CONSTANT, makeConstant(value));
+    recordLoad();
+}
+
+#ifdef FUSED_OPERANDS
+// fuse `OP_GET_LOCAL a; OP_GET_LOCAL b; op` into `op_LL a b` (and `OP_GET_LOCAL a; OP_CONSTANT k; op` into `op_LK a k`)
+// called right after the right operand is compiled, before the stack form `op` would be emitted
+// return false if the operands are not a matching pair, the caller then emits the stack form
+static bool emitFusedBinary(OpCode opLL, OpCode opLK) {
+    Chunk* chunk = currentChunk();
+    int start = chunk->count - 4;
+    // both operands must be the last two instructions, and no jump may land between them
+    if (current->loads[1] != chunk->count - 2 || current->loads[0] != start) return false;
+    if (current->lastTarget > start || chunk->code[start] != OP_GET_LOCAL) return false;
+
+    uint8_t second = chunk->code[start + 2];
+    chunk->code[start] = second == OP_GET_LOCAL ? opLL : opLK;
+    chunk->code[start + 2] = chunk->code[start + 3];
+    chunk->count--;
+    // the fused instruction is not a load any more
+    current->loads[0] = -1;
+    current->loads[1] = -1;
+    return true;
+}
+#endif
+
+// discard the value of the expression just compiled
+static void emitPop() {
+#ifdef FUSED_OPERANDS
+    // `OP_SET_LOCAL slot; OP_POP` -> `OP_STORE_LOCAL slot`
+    int offset = currentChunk()->count - 2;
+    if (current->lastSetLocal == offset && current->lastTarget <= offset) {
+        currentChunk()->code[offset] = OP_STORE_LOCAL;
+        current->lastSetLocal = -1;
+        return;
+    }
+#endif
+    emitByte(OP_POP);
 }
 
 static void patchJump(int offset) {
     // -2 to adjust for the bytecode for the jump offset itself.
     int jump = currentChunk()->count - offset - 2;
+    current->lastTarget = currentChunk()->count;
 
     if (jump > UINT16_MAX) {
         error("Too much code to jump over.");
@@ -226,13 +293,19 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->loads[0] = -1;
+    compiler->loads[1] = -1;
+    compiler->lastSetLocal = -1;
+    compiler->lastTarget = 0;
+    compiler->lastGetGlobal = -1;
+    compiler->lastCall = -1;
     // note: NULL the `function` field and assign it later: garbage collection-related paranoia
     compiler->function = newFunction();
     current = compiler;
     // function object outlives the compiler and persists until runtime
     // yet the lexeme points to the original source code string, which might be freed after compiling
     if (type != TYPE_SCRIPT) {
-        current->function->name = copyString(parser.previous.start, parser.previous.length);
+        current->function->name = internString(parser.previous.start, parser.previous.length);
     }
 
     // compiler implicitly claims stack slot 0 for VM's internal use (storing the function being called)
@@ -250,16 +323,161 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     }
 }
 
+// the most stack slots a call of `function` uses, so `call` can make room for all of them up front
+// follows every path through the bytecode: the stack is as deep at a jump target as where the jump is
+static int maxStackDepth(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    // -1: the offset wasn't reached yet
+    int* depths = (int*)malloc(sizeof(int) * chunk->count);
+    // reached offsets still to be walked
+    int* pending = (int*)malloc(sizeof(int) * chunk->count);
+    if (depths == NULL || pending == NULL) exit(1);
+    for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+
+    int pendingCount = 0;
+    int maxDepth = function->arity + 1;
+#define REACH(target, depth) \
+    do { \
+        if (depths[target] < 0) { \
+            depths[target] = (depth); \
+            pending[pendingCount++] = (target); \
+        } \
+    } while (false)
+
+    REACH(0, maxDepth);
+    while (pendingCount > 0) {
+        int offset = pending[--pendingCount];
+        uint8_t* ip = &chunk->code[offset];
+        int depth = depths[offset];
+        int length = 1;
+        int effect = 0;
+        bool fallsThrough = true;
+
+        switch (*ip) {
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                effect = 1;
+                break;
+            case OP_POP:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_PRINT:
+            case OP_CLOSE_UPVALUE:
+            case OP_INHERIT:
+            case OP_YIELD: // resumed with the value gone, see `resumeGenerator`
+                effect = -1;
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+                break;
+            case OP_CONSTANT:
+            case OP_GET_LOCAL:
+            case OP_GET_GLOBAL:
+            case OP_GET_UPVALUE:
+            case OP_CLASS:
+            case OP_PEEK:
+                effect = 1;
+                length = 2;
+                break;
+            case OP_SET_LOCAL:
+            case OP_SET_GLOBAL:
+            case OP_SET_UPVALUE:
+            case OP_GET_PROPERTY:
+                length = 2;
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_SET_PROPERTY:
+            case OP_GET_SUPER:
+            case OP_METHOD:
+            case OP_STORE_LOCAL:
+                effect = -1;
+                length = 2;
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL:
+            case OP_INLINE_RETURN:
+                effect = -ip[1];
+                length = 2;
+                break;
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE:
+                effect = -ip[2];
+                length = 3;
+                break;
+            case OP_SUPER_INVOKE:
+            case OP_TAIL_SUPER_INVOKE:
+                effect = -ip[2] - 1;
+                length = 3;
+                break;
+            case OP_ADD_LL:
+            case OP_SUBTRACT_LL:
+            case OP_MULTIPLY_LL:
+            case OP_DIVIDE_LL:
+            case OP_LESS_LL:
+            case OP_GREATER_LL:
+            case OP_EQUAL_LL:
+            case OP_ADD_LK:
+            case OP_SUBTRACT_LK:
+            case OP_MULTIPLY_LK:
+            case OP_DIVIDE_LK:
+            case OP_LESS_LK:
+            case OP_GREATER_LK:
+            case OP_EQUAL_LK:
+                effect = 1;
+                length = 3;
+                break;
+            case OP_CLOSURE:
+                effect = 1;
+                length = 2 + 2 * AS_FUNCTION(chunk->constants.values[ip[1]])->upvalueCount;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                length = 3;
+                REACH(offset + length + ((ip[1] << 8) | ip[2]), depth);
+                fallsThrough = *ip == OP_JUMP_IF_FALSE;
+                break;
+            case OP_LOOP:
+                // back to a loop header, which was reached already
+                fallsThrough = false;
+                break;
+            case OP_CALL_INLINE:
+            case OP_INVOKE_INLINE: {
+                // the guard fails: the call is made and lands behind the inlined body
+                int argCount = *ip == OP_CALL_INLINE ? ip[1] : ip[2];
+                length = *ip == OP_CALL_INLINE ? 5 : 6;
+                REACH(offset + length + ((ip[length - 2] << 8) | ip[length - 1]), depth - argCount);
+                break;
+            }
+            case OP_RETURN:
+                fallsThrough = false;
+                break;
+        }
+
+        if (depth + effect > maxDepth) maxDepth = depth + effect;
+        if (fallsThrough && offset + length < chunk->count) REACH(offset + length, depth + effect);
+    }
+#undef REACH
+
+    free(depths);
+    free(pending);
+    return maxDepth;
+}
+
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+    if (!parser.hadError) function->maxSlots = maxStackDepth(function);
 
-#ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
+    if (vm->printCode && !parser.hadError) {
         disassembleChunk(currentChunk(),
                          function->name != NULL ? function->name->chars : "<script>");
     }
-#endif
 
     current = current->enclosing;
     return function;
@@ -301,7 +519,7 @@ static Token syntheticToken(const char* text);
 // takes the given token and adds its lexeme to the chunk's constant table as a string
 // returns the index of that constant in the constant table
 static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    return makeConstant(OBJ_VAL(internString(name->start, name->length)));
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -483,6 +701,29 @@ static void binary(bool canAssign) {
     // because the binary operators are left-associative.
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+#ifdef FUSED_OPERANDS
+    // `a != b`, `a >= b` and `a <= b` keep their trailing OP_NOT
+    switch (operatorType) {
+        case TOKEN_BANG_EQUAL:
+            if (emitFusedBinary(OP_EQUAL_LL, OP_EQUAL_LK)) { emitByte(OP_NOT); return; }
+            break;
+        case TOKEN_EQUAL_EQUAL:   if (emitFusedBinary(OP_EQUAL_LL, OP_EQUAL_LK)) return; break;
+        case TOKEN_GREATER:       if (emitFusedBinary(OP_GREATER_LL, OP_GREATER_LK)) return; break;
+        case TOKEN_GREATER_EQUAL:
+            if (emitFusedBinary(OP_LESS_LL, OP_LESS_LK)) { emitByte(OP_NOT); return; }
+            break;
+        case TOKEN_LESS:          if (emitFusedBinary(OP_LESS_LL, OP_LESS_LK)) return; break;
+        case TOKEN_LESS_EQUAL:
+            if (emitFusedBinary(OP_GREATER_LL, OP_GREATER_LK)) { emitByte(OP_NOT); return; }
+            break;
+        case TOKEN_PLUS:          if (emitFusedBinary(OP_ADD_LL, OP_ADD_LK)) return; break;
+        case TOKEN_MINUS:         if (emitFusedBinary(OP_SUBTRACT_LL, OP_SUBTRACT_LK)) return; break;
+        case TOKEN_STAR:          if (emitFusedBinary(OP_MULTIPLY_LL, OP_MULTIPLY_LK)) return; break;
+        case TOKEN_SLASH:         if (emitFusedBinary(OP_DIVIDE_LL, OP_DIVIDE_LK)) return; break;
+        default: return; // Unreachable.
+    }
+#endif
+
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
@@ -498,8 +739,226 @@ static void binary(bool canAssign) {
     }
 }
 
+// Inlining: a call of a small function is replaced by a copy of its body, saving the CallFrame.
+// Only functions whose body is a single `return <expression>;` (straight-line code without locals
+// being assigned, closures or control flow) qualify. Their bytecode is copied, and since the callee
+// and arguments are sitting right below the copy on the caller's stack, accesses to the function's
+// locals become OP_PEEK. A guard in front of the copy checks the callee at runtime, since globals
+// can be rebound (and a method name can mean a different method in another class): if it isn't
+// the inlined function, the call is done the normal way and the copy is skipped.
+// The copy keeps the lines of the function it came from, and the chunk records where it is, so a
+// runtime error inside it shows the frame the call would have had (see `runtimeError`).
+
+// the bytes emitted since offset `from` came from `line` of an inlined function
+static void setLines(int from, int line) {
+    Chunk* chunk = currentChunk();
+    for (int i = from; i < chunk->count; i++) chunk->lines[i] = line;
+}
+
+// walk the body of `function`, copying it into the current chunk if `emit` is set
+// return false if the function can't be inlined
+static bool inlineBody(ObjFunction* function, bool emit) {
+    Chunk* chunk = &function->chunk;
+    Value* constants = chunk->constants.values;
+    int depth = function->arity + 1; // stack slots in use above (and including) the callee
+
+    for (int offset = 0; offset < chunk->count && offset < INLINE_MAX_SIZE; ) {
+        uint8_t* ip = &chunk->code[offset];
+        // OP_PEEK can reach 255 slots down at most
+        if (depth > UINT8_MAX) return false;
+        // the copy keeps the line of the instruction it was copied from, for runtime errors inside it
+        int copied = currentChunk()->count;
+        int line = chunk->lines[offset];
+
+        switch (*ip) {
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                if (emit) emitByte(*ip);
+                depth++;
+                offset += 1;
+                break;
+            case OP_POP:
+                if (emit) emitByte(*ip);
+                depth--;
+                offset += 1;
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+                if (emit) emitByte(*ip);
+                offset += 1;
+                break;
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                if (emit) emitByte(*ip);
+                depth--;
+                offset += 1;
+                break;
+            case OP_GET_LOCAL:
+                if (emit) emitBytes(OP_PEEK, (uint8_t)(depth - 1 - ip[1]));
+                depth++;
+                offset += 2;
+                break;
+            case OP_CONSTANT:
+            case OP_GET_GLOBAL:
+            case OP_GET_PROPERTY:
+                // a recursive function calls itself through its global
+                if (*ip == OP_GET_GLOBAL && AS_STRING(constants[ip[1]]) == function->name) return false;
+                if (emit) emitBytes(*ip, makeConstant(constants[ip[1]]));
+                if (*ip != OP_GET_PROPERTY) depth++;
+                offset += 2;
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                // the inlined body doesn't return by itself, so there's no frame to reuse
+                if (emit) emitBytes(OP_CALL, ip[1]);
+                depth -= ip[1];
+                offset += 2;
+                break;
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE:
+                // and a recursive method invokes its own name
+                if (AS_STRING(constants[ip[1]]) == function->name) return false;
+                if (emit) {
+                    emitBytes(OP_INVOKE, makeConstant(constants[ip[1]]));
+                    emitByte(ip[2]);
+                }
+                depth -= ip[2];
+                offset += 3;
+                break;
+#ifdef FUSED_OPERANDS
+            case OP_ADD_LL:
+            case OP_SUBTRACT_LL:
+            case OP_MULTIPLY_LL:
+            case OP_DIVIDE_LL:
+            case OP_LESS_LL:
+            case OP_GREATER_LL:
+            case OP_EQUAL_LL:
+            case OP_ADD_LK:
+            case OP_SUBTRACT_LK:
+            case OP_MULTIPLY_LK:
+            case OP_DIVIDE_LK:
+            case OP_LESS_LK:
+            case OP_GREATER_LK:
+            case OP_EQUAL_LK: {
+                // back to the stack form, the operands aren't in the caller's locals
+                static const OpCode stackForms[] = {
+                    OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE, OP_LESS, OP_GREATER, OP_EQUAL
+                };
+                bool constant = *ip >= OP_ADD_LK;
+                if (emit) {
+                    emitBytes(OP_PEEK, (uint8_t)(depth - 1 - ip[1]));
+                    if (constant) {
+                        emitBytes(OP_CONSTANT, makeConstant(constants[ip[2]]));
+                    } else {
+                        emitBytes(OP_PEEK, (uint8_t)(depth - ip[2]));
+                    }
+                    emitByte(stackForms[*ip - (constant ? OP_ADD_LK : OP_ADD_LL)]);
+                }
+                depth++;
+                offset += 3;
+                break;
+            }
+#endif
+            case OP_RETURN:
+                if (emit) {
+                    emitBytes(OP_INLINE_RETURN, (uint8_t)(depth - 1));
+                    setLines(copied, line);
+                }
+                return true;
+            default:
+                // control flow, assignments, closures, upvalues, ...
+                return false;
+        }
+        if (emit) setLines(copied, line);
+    }
+    return false;
+}
+
+static void registerInlineCandidate(ObjFunction* function, bool isMethod) {
+    // calling a generator function doesn't run its body, so there's nothing to inline
+    bool inlineable = function->upvalueCount == 0 && !function->isGenerator && inlineBody(function, false);
+
+    for (int i = 0; i < inlineCandidateCount; i++) {
+        InlineCandidate* candidate = &inlineCandidates[i];
+        if (candidate->name != function->name || candidate->isMethod != isMethod) continue;
+
+        if (isMethod) {
+            // more than one method with this name: a call site can't know which one it gets
+            candidate->function = NULL;
+        } else {
+            // a redeclared global function: calls after it most likely get the new one
+            candidate->function = inlineable ? function : NULL;
+        }
+        return;
+    }
+
+    if (inlineCandidateCount == UINT8_COUNT) return;
+    InlineCandidate* candidate = &inlineCandidates[inlineCandidateCount++];
+    candidate->name = function->name;
+    candidate->function = inlineable ? function : NULL;
+    candidate->isMethod = isMethod;
+}
+
+static ObjFunction* findInlineCandidate(ObjString* name, bool isMethod, int argCount) {
+    if (!vm->inlineEnabled) return NULL;
+
+    for (int i = 0; i < inlineCandidateCount; i++) {
+        InlineCandidate* candidate = &inlineCandidates[i];
+        if (candidate->name == name && candidate->isMethod == isMethod) {
+            // a call with the wrong number of arguments has to fail at runtime, leave it alone
+            if (candidate->function == NULL || candidate->function->arity != argCount) return NULL;
+            return candidate->function;
+        }
+    }
+    return NULL;
+}
+
+// emit the guard (OP_CALL_INLINE or OP_INVOKE_INLINE) and a copy of the function's body
+// `name` is the method name constant of OP_INVOKE_INLINE
+static bool inlineCall(OpCode op, uint8_t name, ObjFunction* function, uint8_t argCount) {
+    // the copy brings its constants along
+    if (currentChunk()->constants.count + function->chunk.constants.count >= UINT8_MAX) return false;
+
+    int start = currentChunk()->count;
+    emitByte(op);
+    if (op == OP_INVOKE_INLINE) emitByte(name);
+    emitBytes(argCount, makeConstant(OBJ_VAL(function)));
+    // where the body ends, for when the guard fails
+    int skip = currentChunk()->count;
+    emitBytes(0xff, 0xff);
+
+    int body = currentChunk()->count;
+    inlineBody(function, true);
+    addInlineSite(currentChunk(), (InlineSite){body, currentChunk()->count, currentChunk()->lines[start],
+                                               OBJ_VAL(function)});
+    patchJump(skip);
+
+    if (vm->inlineReport) {
+        fprintf(stderr, "[line %d] inlined %s %s() (%d bytes)\n", parser.previous.line,
+                op == OP_INVOKE_INLINE ? "method" : "function", function->name->chars,
+                currentChunk()->count - start);
+    }
+    return true;
+}
+
 static void call(bool canAssign) {
+    // a global function is called if the callee was loaded by the last instruction before the arguments
+    int calleeEnd = currentChunk()->count;
     uint8_t argCount = argumentList();
+
+    if (current->lastGetGlobal == calleeEnd - 2) {
+        Chunk* chunk = currentChunk();
+        ObjString* name = AS_STRING(chunk->constants.values[chunk->code[calleeEnd - 1]]);
+        ObjFunction* function = findInlineCandidate(name, false, argCount);
+        if (function != NULL && inlineCall(OP_CALL_INLINE, 0, function, argCount)) return;
+    }
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
@@ -514,6 +973,10 @@ static void dot(bool canAssign) {
         // common operation: access the method and immediate call it
         // thus can be optimized using a single superinstruction and skip the allocation of ObjBoundMethod
         uint8_t argCount = argumentList();
+        ObjFunction* function = findInlineCandidate(AS_STRING(currentChunk()->constants.values[name]),
+                                                    true, argCount);
+        if (function != NULL && inlineCall(OP_INVOKE_INLINE, name, function, argCount)) return;
+        current->lastCall = currentChunk()->count;
         emitBytes(OP_INVOKE, name); // index of the property name in the constant table
         emitByte(argCount);
     } else {
@@ -569,6 +1032,10 @@ static void function(FunctionType type) {
     block();
 
     ObjFunction* function = endCompiler();
+    // functions declared at the top level are globals, their calls may be inlined (and so may methods')
+    if (type == TYPE_METHOD || (type == TYPE_FUNCTION && current->type == TYPE_SCRIPT && current->scopeDepth == 0)) {
+        registerInlineCandidate(function, type == TYPE_METHOD);
+    }
     emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
     // capture info for each upvalue in the closure
@@ -683,7 +1150,7 @@ static void varDeclaration() {
 static void expressionStatement() {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+    emitPop();
 }
 
 static void forStatement() {
@@ -719,7 +1186,7 @@ static void forStatement() {
         int bodyJump = emitJump(OP_JUMP);
         int incrementStart = currentChunk()->count;
         expression();
-        emitByte(OP_POP);
+        emitPop();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         // after increment is executed, jump back to condition
@@ -792,10 +1259,42 @@ static void returnStatement() {
         // returning within nested blocks is as straightforward as returning from the end of function body
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // `return f(...)`: nothing is left to do in this function after the call,
+        // so the callee can take over the CallFrame instead of pushing another one
+        // OP_RETURN stays behind it for callees which don't (natives and classes)
+        Chunk* chunk = currentChunk();
+        if (current->lastCall >= 0) {
+            uint8_t* call = &chunk->code[current->lastCall];
+            if (*call == OP_CALL && current->lastCall == chunk->count - 2) {
+                *call = OP_TAIL_CALL;
+            } else if (*call == OP_INVOKE && current->lastCall == chunk->count - 3) {
+                *call = OP_TAIL_INVOKE;
+            } else if (*call == OP_SUPER_INVOKE && current->lastCall == chunk->count - 3) {
+                *call = OP_TAIL_SUPER_INVOKE;
+            }
+        }
         emitByte(OP_RETURN);
     }
 }
 
+// `yield value;` hands the value to the caller, and makes the function a generator
+static void yieldStatement() {
+    if (current->type == TYPE_SCRIPT) {
+        error("Can't yield from top-level code.");
+    } else if (current->type == TYPE_INITIALIZER) {
+        error("Can't yield from an initializer.");
+    }
+
+    if (match(TOKEN_SEMICOLON)) {
+        emitByte(OP_NIL);
+    } else {
+        expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after yield value.");
+    }
+    emitByte(OP_YIELD);
+    current->function->isGenerator = true;
+}
+
 static void whileStatement() {
     int loopStart = currentChunk()->count;
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
@@ -831,6 +1330,7 @@ static void synchronize() {
             case TOKEN_WHILE:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
+            case TOKEN_YIELD:
                 return;
 
             default:
@@ -868,6 +1368,8 @@ static void statement() {
         returnStatement();
     } else if (match(TOKEN_WHILE)) {
         whileStatement();
+    } else if (match(TOKEN_YIELD)) {
+        yieldStatement();
     } else if (match(TOKEN_LEFT_BRACE)) {
         beginScope();
         block();
@@ -912,7 +1414,7 @@ static void string(bool canAssign) {
 
     // note: as this is an interpreter, parsing, code-gen and vm share the same heap
     // therefore a pointer into heap is enough
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
+    emitConstant(OBJ_VAL(internString(parser.previous.start + 1,
                                     parser.previous.length - 2)));
 }
 
@@ -937,8 +1439,11 @@ static void namedVariable(Token name, bool canAssign) {
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
         emitBytes(setOp, (uint8_t)arg);
+        if (setOp == OP_SET_LOCAL) current->lastSetLocal = currentChunk()->count - 2;
     } else {
         emitBytes(getOp, (uint8_t)arg);
+        if (getOp == OP_GET_LOCAL) recordLoad();
+        if (getOp == OP_GET_GLOBAL) current->lastGetGlobal = currentChunk()->count - 2;
     }
 }
 
@@ -971,6 +1476,7 @@ static void super_(bool canAssign) {
         // fast path: lookup a super method and immediately invoke it
         uint8_t argCount = argumentList(); // put the arguments in the correct position on stack
         namedVariable(syntheticToken("super"), false); // the superclass where the method is resolved
+        current->lastCall = currentChunk()->count;
         emitBytes(OP_SUPER_INVOKE, name); // the name of the method to access
         emitByte(argCount);
     } else {
@@ -1044,6 +1550,7 @@ ParseRule rules[] = {
     [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE},
     [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_YIELD]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
@@ -1096,6 +1603,7 @@ ObjFunction* compile(const char* source) {
 
     parser.hadError = false;
     parser.panicMode = false;
+    inlineCandidateCount = 0;
 
     advance();
 
@@ -1106,13 +1614,23 @@ ObjFunction* compile(const char* source) {
 
     consume(TOKEN_EOF, "Expect end of expression.");
     ObjFunction* function = endCompiler();
+    // the candidates belong to this VM's heap, the next VM on the thread mustn't mark them
+    inlineCandidateCount = 0;
     return parser.hadError ? NULL : function;
 }
 
+bool isCompiling() {
+    return current != NULL;
+}
+
 void markCompilerRoots() {
     Compiler* compiler = current;
     while (compiler != NULL) {
         markObject((Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
+
+    for (int i = 0; i < inlineCandidateCount; i++) {
+        markObject((Obj*)inlineCandidates[i].function);
+    }
 }
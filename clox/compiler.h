@@ -6,5 +6,6 @@
 
 ObjFunction* compile(const char* source);
 void markCompilerRoots();
+bool isCompiling();
 
 #endif
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpuprof.h"
+#include "memory.h"
+
+#ifdef CPU_PROFILER
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+
+// Sampling CPU profiler (`--cpu-profile`).
+// An ITIMER_PROF timer sends SIGPROF every 1/hz second of CPU time the process uses. The handler walks
+// `vm->frames` from the topmost frame down, taking each frame's function and current line, and counts
+// the stack in a table set aside up front: a signal handler can't allocate. The table is written out
+// in the folded format of flamegraph.pl and speedscope, one line per stack, outermost frame first:
+//     script:12;makeTree:4;init:2 37
+//
+// SIGPROF goes to whichever thread is running, the ones marking and sweeping included. Those pass it on
+// to the program's thread, so the collector's CPU time is charged to the stack that's waiting on it (or,
+// with `--concurrent-gc`, to whatever the program runs meanwhile).
+//
+// The handler only reads the frames: the VM fills in a frame before counting it, and sets `framesMoving`
+// while it reallocates or swaps them, a sample landing then is dropped. Code compiled by the JIT only
+// brings `frame->ip` up to date when it calls back into the VM, so the line of such a frame can lag behind.
+// The functions counted are roots until the profile is written, so none is freed while its name is needed.
+
+typedef struct {
+    ObjFunction* function;
+    int line;
+} ProfileFrame;
+
+typedef struct {
+    uint32_t hash;
+    int depth; // 0: empty
+    int first; // in `frames`, outermost first
+    long samples;
+} ProfileStack;
+
+typedef struct CpuProfile {
+    const char* path;
+    VM* vm;
+    pthread_t thread; // the program's
+    ProfileStack stacks[CPU_PROFILE_STACKS];
+    int stackCount;
+    ProfileFrame* frames;
+    int frameCount;
+    long samples;
+    long dropped; // no room left, or the frames were moving
+} CpuProfile;
+
+// the handler can't rely on `vm`: the GC threads set it too
+static CpuProfile* volatile active = NULL;
+
+static uint32_t hashFrames(ProfileFrame* frames, int depth) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < depth; i++) {
+        hash ^= (uint32_t)((uintptr_t)frames[i].function >> 4);
+        hash *= 16777619;
+        hash ^= (uint32_t)frames[i].line;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// field by field, the padding of a frame is never set
+static bool sameFrames(ProfileFrame* a, ProfileFrame* b, int depth) {
+    for (int i = 0; i < depth; i++) {
+        if (a[i].function != b[i].function || a[i].line != b[i].line) return false;
+    }
+    return true;
+}
+
+static void countStack(CpuProfile* profile, ProfileFrame* frames, int depth) {
+    uint32_t hash = hashFrames(frames, depth);
+    uint32_t index = hash & (CPU_PROFILE_STACKS - 1);
+    for (;;) {
+        ProfileStack* stack = &profile->stacks[index];
+        if (stack->depth == 0) break;
+        if (stack->hash == hash && stack->depth == depth && sameFrames(&profile->frames[stack->first], frames, depth)) {
+            stack->samples++;
+            return;
+        }
+        index = (index + 1) & (CPU_PROFILE_STACKS - 1);
+    }
+
+    // a new stack, the table stays at most 3/4 full
+    if (profile->stackCount + 1 > CPU_PROFILE_STACKS * 3 / 4 || profile->frameCount + depth > CPU_PROFILE_FRAMES) {
+        profile->dropped++;
+        return;
+    }
+    ProfileStack* stack = &profile->stacks[index];
+    memcpy(&profile->frames[profile->frameCount], frames, sizeof(ProfileFrame) * depth);
+    stack->hash = hash;
+    stack->first = profile->frameCount;
+    stack->samples = 1;
+    profile->frameCount += depth;
+    profile->stackCount++;
+    // the depth last: markCpuProfile may be walking the table right under the handler
+    atomic_signal_fence(memory_order_release);
+    stack->depth = depth;
+}
+
+static void takeSample(int signal) {
+    (void)signal;
+    CpuProfile* profile = active;
+    if (profile == NULL) return;
+    if (!pthread_equal(pthread_self(), profile->thread)) {
+        pthread_kill(profile->thread, SIGPROF);
+        return;
+    }
+
+    VM* sampled = profile->vm;
+    profile->samples++;
+    if (sampled->framesMoving) {
+        profile->dropped++;
+        return;
+    }
+
+    ProfileFrame frames[CPU_PROFILE_DEPTH + 1];
+    int count = sampled->frameCount;
+    int depth = 0;
+    if (count == 0) {
+        // compiling, or the event loop waiting on its fibers
+        frames[depth++] = (ProfileFrame){NULL, 0};
+    } else {
+        // the innermost frames, with a frame of no function standing in for the ones left out
+        int bottom = count > CPU_PROFILE_DEPTH ? count - CPU_PROFILE_DEPTH : 0;
+        if (bottom > 0) frames[depth++] = (ProfileFrame){NULL, -1};
+        for (int i = bottom; i < count; i++) {
+            CallFrame* frame = &sampled->frames[i];
+            ObjFunction* function = frame->closure->function;
+            // ip already points past the instruction running (none yet: the call itself)
+            size_t instruction = frame->ip - function->chunk.code;
+            frames[depth++] = (ProfileFrame){function, function->chunk.lines[instruction > 0 ? instruction - 1 : 0]};
+        }
+    }
+    countStack(profile, frames, depth);
+}
+
+bool startCpuProfile(VM* instance, const char* path, int hz) {
+    if (active != NULL || hz < 1 || hz > 1000000) return false;
+
+    CpuProfile* profile = (CpuProfile*)calloc(1, sizeof(CpuProfile));
+    if (profile == NULL) exit(1);
+    profile->frames = (ProfileFrame*)malloc(sizeof(ProfileFrame) * CPU_PROFILE_FRAMES);
+    if (profile->frames == NULL) exit(1);
+    profile->path = path;
+    profile->vm = instance;
+    profile->thread = pthread_self();
+    instance->cpuProfile = profile;
+    active = profile;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = takeSample;
+    // blocking calls go on after a sample, the event loop copes with an early return of epoll_wait
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    if (sigaction(SIGPROF, &action, NULL) != 0 || setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        active = NULL;
+        instance->cpuProfile = NULL;
+        free(profile->frames);
+        free(profile);
+        return false;
+    }
+    return true;
+}
+
+void markCpuProfile() {
+    CpuProfile* profile = vm->cpuProfile;
+    if (profile == NULL) return;
+
+    for (int i = 0; i < CPU_PROFILE_STACKS; i++) {
+        ProfileStack* stack = &profile->stacks[i];
+        for (int j = 0; j < stack->depth; j++) {
+            markObject((Obj*)profile->frames[stack->first + j].function);
+        }
+    }
+}
+
+static void writeFrame(FILE* file, ProfileFrame* frame) {
+    if (frame->function == NULL) {
+        fputs(frame->line < 0 ? "..." : "(no frame)", file);
+    } else if (frame->function->name == NULL) {
+        fprintf(file, "script:%d", frame->line);
+    } else {
+        fprintf(file, "%s:%d", frame->function->name->chars, frame->line);
+    }
+}
+
+void finishCpuProfile() {
+    CpuProfile* profile = vm->cpuProfile;
+    if (profile == NULL) return;
+
+    // no more samples from here on, the handler stays: a signal already on its way finds no profile
+    struct itimerval off;
+    memset(&off, 0, sizeof(off));
+    setitimer(ITIMER_PROF, &off, NULL);
+    active = NULL;
+
+    FILE* file = strcmp(profile->path, "-") == 0 ? stderr : fopen(profile->path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write the CPU profile to \"%s\".\n", profile->path);
+    } else {
+        for (int i = 0; i < CPU_PROFILE_STACKS; i++) {
+            ProfileStack* stack = &profile->stacks[i];
+            if (stack->depth == 0) continue;
+            for (int j = 0; j < stack->depth; j++) {
+                if (j > 0) fputc(';', file);
+                writeFrame(file, &profile->frames[stack->first + j]);
+            }
+            fprintf(file, " %ld\n", stack->samples);
+        }
+        if (file != stderr) fclose(file);
+    }
+    if (profile->dropped > 0) {
+        fprintf(stderr, "CPU profile: %ld of %ld samples dropped.\n", profile->dropped, profile->samples);
+    }
+
+    vm->cpuProfile = NULL;
+    free(profile->frames);
+    free(profile);
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef clox_cpuprof_h
+#define clox_cpuprof_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// samples per second of CPU time the program (and its GC threads) use
+#define CPU_PROFILE_HZ 99
+// distinct call stacks kept, a power of two (samples of any stack beyond them are dropped)
+#define CPU_PROFILE_STACKS 8192
+// frames of all those stacks together
+#define CPU_PROFILE_FRAMES (256 * 1024)
+// a deeper stack only keeps its innermost frames
+#define CPU_PROFILE_DEPTH 256
+
+struct CpuProfile;
+
+// start sampling `instance`, run by the calling thread, `hz` times a second of CPU time, the folded stacks
+// are written to the file at `path` ("-": stderr) once it's freed, false if the timer can't be set
+// only one VM per process can be profiled at a time
+bool startCpuProfile(VM* instance, const char* path, int hz);
+// the functions of the sampled stacks stay alive until the profile is written
+void markCpuProfile();
+// stop the timer and write out the stacks
+void finishCpuProfile();
+
+#endif
@@ -4,6 +4,74 @@
 #include "object.h"
 #include "value.h"
 
+// by OpCode, for the opcode statistics (see opstats.c)
+static const char* opcodeNames[OP_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_TAIL_INVOKE] = "OP_TAIL_INVOKE",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_TAIL_SUPER_INVOKE] = "OP_TAIL_SUPER_INVOKE",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_YIELD] = "OP_YIELD",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_ADD_LL] = "OP_ADD_LL",
+    [OP_SUBTRACT_LL] = "OP_SUBTRACT_LL",
+    [OP_MULTIPLY_LL] = "OP_MULTIPLY_LL",
+    [OP_DIVIDE_LL] = "OP_DIVIDE_LL",
+    [OP_LESS_LL] = "OP_LESS_LL",
+    [OP_GREATER_LL] = "OP_GREATER_LL",
+    [OP_EQUAL_LL] = "OP_EQUAL_LL",
+    [OP_ADD_LK] = "OP_ADD_LK",
+    [OP_SUBTRACT_LK] = "OP_SUBTRACT_LK",
+    [OP_MULTIPLY_LK] = "OP_MULTIPLY_LK",
+    [OP_DIVIDE_LK] = "OP_DIVIDE_LK",
+    [OP_LESS_LK] = "OP_LESS_LK",
+    [OP_GREATER_LK] = "OP_GREATER_LK",
+    [OP_EQUAL_LK] = "OP_EQUAL_LK",
+    [OP_STORE_LOCAL] = "OP_STORE_LOCAL",
+    [OP_CALL_INLINE] = "OP_CALL_INLINE",
+    [OP_INVOKE_INLINE] = "OP_INVOKE_INLINE",
+    [OP_PEEK] = "OP_PEEK",
+    [OP_INLINE_RETURN] = "OP_INLINE_RETURN",
+};
+
+const char* opcodeName(uint8_t opcode) {
+    return opcode < OP_COUNT ? opcodeNames[opcode] : "OP_UNKNOWN";
+}
+
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
 
@@ -44,6 +112,41 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+// fused form: a local slot and a second local slot (or constant) as operands
+static int fusedInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t other = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, slot, other);
+    return offset + 3;
+}
+
+static int fusedConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+// guard of an inlined call: call operands, the inlined function and where its body ends
+static int inlineInstruction(const char* name, Chunk* chunk, int offset) {
+    int operands;
+    if (chunk->code[offset] == OP_INVOKE_INLINE) {
+        printf("%-16s (%d args) %4d '", name, chunk->code[offset + 2], chunk->code[offset + 1]);
+        printValue(chunk->constants.values[chunk->code[offset + 1]]);
+        printf("' ");
+        operands = offset + 3;
+    } else {
+        printf("%-16s (%d args) ", name, chunk->code[offset + 1]);
+        operands = offset + 2;
+    }
+    printValue(chunk->constants.values[chunk->code[operands]]);
+    uint16_t skip = (uint16_t)(chunk->code[operands + 1] << 8 | chunk->code[operands + 2]);
+    printf(" -> %d\n", operands + 3 + skip);
+    return operands + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
@@ -52,6 +155,14 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+// OP_LOOP: a jump backwards, and the number of the loop
+static int loopInstruction(Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    printf("%-16s %4d -> %d #%d\n", "OP_LOOP", offset, offset + 4 - jump, chunk->code[offset + 3]);
+    return offset + 4;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
 
@@ -119,13 +230,19 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
-            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+            return loopInstruction(chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_TAIL_INVOKE:
+            return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_TAIL_SUPER_INVOKE:
+            return invokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -147,12 +264,52 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_YIELD:
+            return simpleInstruction("OP_YIELD", offset);
         case OP_CLASS:
             return constantInstruction("OP_CLASS", chunk, offset);
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_ADD_LL:
+            return fusedInstruction("OP_ADD_LL", chunk, offset);
+        case OP_SUBTRACT_LL:
+            return fusedInstruction("OP_SUBTRACT_LL", chunk, offset);
+        case OP_MULTIPLY_LL:
+            return fusedInstruction("OP_MULTIPLY_LL", chunk, offset);
+        case OP_DIVIDE_LL:
+            return fusedInstruction("OP_DIVIDE_LL", chunk, offset);
+        case OP_LESS_LL:
+            return fusedInstruction("OP_LESS_LL", chunk, offset);
+        case OP_GREATER_LL:
+            return fusedInstruction("OP_GREATER_LL", chunk, offset);
+        case OP_EQUAL_LL:
+            return fusedInstruction("OP_EQUAL_LL", chunk, offset);
+        case OP_ADD_LK:
+            return fusedConstantInstruction("OP_ADD_LK", chunk, offset);
+        case OP_SUBTRACT_LK:
+            return fusedConstantInstruction("OP_SUBTRACT_LK", chunk, offset);
+        case OP_MULTIPLY_LK:
+            return fusedConstantInstruction("OP_MULTIPLY_LK", chunk, offset);
+        case OP_DIVIDE_LK:
+            return fusedConstantInstruction("OP_DIVIDE_LK", chunk, offset);
+        case OP_LESS_LK:
+            return fusedConstantInstruction("OP_LESS_LK", chunk, offset);
+        case OP_GREATER_LK:
+            return fusedConstantInstruction("OP_GREATER_LK", chunk, offset);
+        case OP_EQUAL_LK:
+            return fusedConstantInstruction("OP_EQUAL_LK", chunk, offset);
+        case OP_STORE_LOCAL:
+            return byteInstruction("OP_STORE_LOCAL", chunk, offset);
+        case OP_CALL_INLINE:
+            return inlineInstruction("OP_CALL_INLINE", chunk, offset);
+        case OP_INVOKE_INLINE:
+            return inlineInstruction("OP_INVOKE_INLINE", chunk, offset);
+        case OP_PEEK:
+            return byteInstruction("OP_PEEK", chunk, offset);
+        case OP_INLINE_RETURN:
+            return byteInstruction("OP_INLINE_RETURN", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -5,5 +5,7 @@
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+// "OP_CONSTANT" and so on
+const char* opcodeName(uint8_t opcode);
 
 #endif
\ No newline at end of file
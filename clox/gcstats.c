@@ -0,0 +1,206 @@
+#include <string.h>
+
+#include "gcstats.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef SHARED_STRINGS
+#include "intern.h"
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+// Counters and trace events of the collector.
+// The counters are plain increments on the paths that already do the work (allocating an object,
+// freeing one, ending a pause), so they're always kept. gcStats() hands them to the program,
+// `--gc-stats` writes them as JSON when the VM is freed.
+//
+// `--gc-trace` writes every pause of the program, and every stretch the collector thread of
+// CONCURRENT_GC works by itself, as a complete ("X") event of the Chrome trace event format, along with
+// a counter ("C") event of the heap size after each pause. The program is thread 1, the collector thread 2,
+// load the file in chrome://tracing or ui.perfetto.dev. Both threads write their own events:
+// stdio locks the file around each of them.
+
+#define TRACE_PROGRAM 1
+#define TRACE_COLLECTOR 2
+
+// by ObjType, for gcStats() fields and the JSON
+static const char* typeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_BOUND_METHOD] = "boundMethods",
+    [OBJ_CLASS] = "classes",
+    [OBJ_CLOSURE] = "closures",
+    [OBJ_FIBER] = "fibers",
+    [OBJ_FUNCTION] = "functions",
+    [OBJ_GENERATOR] = "generators",
+    [OBJ_INSTANCE] = "instances",
+    [OBJ_NATIVE] = "natives",
+    [OBJ_STRING] = "strings",
+    [OBJ_UPVALUE] = "upvalues",
+};
+
+void initGcStats(GcStats* stats) {
+    memset(stats, 0, sizeof(GcStats));
+    stats->start = gcClock();
+}
+
+bool openGcTrace(GcStats* stats, const char* path) {
+    stats->trace = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (stats->trace == NULL) return false;
+    fprintf(stats->trace, "[\n");
+    return true;
+}
+
+static void traceEvent(const char* what, int thread, double start, double end) {
+    GcStats* stats = &vm->gcStats;
+    fprintf(stats->trace, "{\"name\":\"%s\",\"cat\":\"gc\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d},\n",
+            what, (start - stats->start) * 1e6, (end - start) * 1e6, thread);
+}
+
+void recordPause(const char* what, double start, double end) {
+    GcStats* stats = &vm->gcStats;
+    double pause = end - start;
+    stats->pauseCount++;
+    stats->pauseTotal += pause;
+    if (pause > stats->pauseMax) stats->pauseMax = pause;
+
+    int bucket = 0;
+    for (double limit = 1e-6; pause >= limit && bucket < GC_PAUSE_BUCKETS - 1; limit *= 2) bucket++;
+    stats->pauseHistogram[bucket]++;
+
+    if (stats->trace != NULL) {
+        traceEvent(what, TRACE_PROGRAM, start, end);
+        fprintf(stats->trace, "{\"name\":\"heap\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"args\":{\"bytes\":%zu}},\n",
+                (end - stats->start) * 1e6, vm->bytesAllocated);
+    }
+}
+
+void recordWork(const char* what, double start, double end) {
+    if (vm->gcStats.trace != NULL) traceEvent(what, TRACE_COLLECTOR, start, end);
+}
+
+static size_t liveObjects(ObjType type) {
+    return vm->gcStats.allocated[type] - vm->gcStats.freed[type];
+}
+
+static int internedStrings() {
+    int count = 0;
+    for (int i = 0; i < vm->strings.capacity; i++) {
+        if (vm->strings.entries[i].key != NULL) count++;
+    }
+    return count;
+}
+
+// the instance is on the stack while its fields are set, setting one allocates
+static void setField(ObjInstance* instance, const char* name, double value) {
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    tableSet(&instance->fields, AS_STRING(vm->stackTop[-1]), NUMBER_VAL(value));
+    pop();
+}
+
+Value gcStatsNative(int argCount, Value* args) {
+    if (argCount != 0) return nativeError("gcStats() takes no arguments but got %d.", argCount);
+    GcStats* stats = &vm->gcStats;
+
+    push(OBJ_VAL(newClass(copyString("GcStats", 7))));
+    ObjInstance* instance = newInstance(AS_CLASS(vm->stackTop[-1]));
+    push(OBJ_VAL(instance));
+    setField(instance, "collections", stats->collections);
+    setField(instance, "concurrentCycles", stats->concurrentCycles);
+    setField(instance, "compactions", stats->compactions);
+    setField(instance, "pauses", stats->pauseCount);
+    setField(instance, "pauseTotalMs", stats->pauseTotal * 1000);
+    setField(instance, "pauseMaxMs", stats->pauseMax * 1000);
+    setField(instance, "bytesFreed", (double)stats->bytesFreed);
+    setField(instance, "heapBytes", (double)vm->bytesAllocated);
+    setField(instance, "nextGC", (double)vm->nextGC);
+    setField(instance, "internedStrings", internedStrings());
+#ifdef SHARED_STRINGS
+    setField(instance, "sharedStrings", sharedStrings ? sharedStringCount() : 0);
+#endif
+    // the live objects of each type
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        setField(instance, typeNames[type], (double)liveObjects((ObjType)type));
+    }
+
+    pop();
+    pop();
+    return OBJ_VAL(instance);
+}
+
+// the most memory the process ever had resident, in kilobytes (0: unknown)
+static long peakRss() {
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // bytes there
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+static void writeStats(FILE* file) {
+    GcStats* stats = &vm->gcStats;
+    fprintf(file, "{\n");
+    fprintf(file, "  \"collections\": %d,\n", stats->collections);
+    fprintf(file, "  \"concurrentCycles\": %d,\n", stats->concurrentCycles);
+    fprintf(file, "  \"compactions\": %d,\n", stats->compactions);
+    fprintf(file, "  \"pauses\": {\"count\": %d, \"totalMs\": %.3f, \"maxMs\": %.3f, \"histogramUs\": [",
+            stats->pauseCount, stats->pauseTotal * 1000, stats->pauseMax * 1000);
+    // only up to the longest bucket that has a pause
+    int last = GC_PAUSE_BUCKETS - 1;
+    while (last > 0 && stats->pauseHistogram[last] == 0) last--;
+    for (int i = 0; i <= last; i++) {
+        if (i == GC_PAUSE_BUCKETS - 1) {
+            fprintf(file, "%s{\"upTo\": null, \"count\": %d}", i > 0 ? ", " : "", stats->pauseHistogram[i]);
+        } else {
+            fprintf(file, "%s{\"upTo\": %ld, \"count\": %d}", i > 0 ? ", " : "", 1L << i, stats->pauseHistogram[i]);
+        }
+    }
+    fprintf(file, "]},\n");
+    fprintf(file, "  \"bytesFreed\": %zu,\n", stats->bytesFreed);
+    fprintf(file, "  \"heapBytes\": %zu,\n", vm->bytesAllocated);
+    fprintf(file, "  \"nextGC\": %zu,\n", vm->nextGC);
+    fprintf(file, "  \"peakRssKb\": %ld,\n", peakRss());
+    fprintf(file, "  \"internedStrings\": %d,\n", internedStrings());
+#ifdef SHARED_STRINGS
+    fprintf(file, "  \"sharedStrings\": %d,\n", sharedStrings ? sharedStringCount() : 0);
+#endif
+    fprintf(file, "  \"objects\": {\n");
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        fprintf(file, "    \"%s\": {\"allocated\": %zu, \"freed\": %zu, \"live\": %zu}%s\n",
+                typeNames[type], stats->allocated[type], stats->freed[type], liveObjects((ObjType)type),
+                type < OBJ_TYPE_COUNT - 1 ? "," : "");
+    }
+    fprintf(file, "  }\n");
+    fprintf(file, "}\n");
+}
+
+void finishGcStats() {
+    GcStats* stats = &vm->gcStats;
+    if (stats->dumpPath != NULL) {
+        FILE* file = strcmp(stats->dumpPath, "-") == 0 ? stderr : fopen(stats->dumpPath, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Could not write GC statistics to \"%s\".\n", stats->dumpPath);
+        } else {
+            writeStats(file);
+            if (file != stderr) fclose(file);
+        }
+        stats->dumpPath = NULL;
+    }
+
+    if (stats->trace != NULL) {
+        // the thread names last, so every event before them can end in a comma
+        fprintf(stats->trace, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"program\"}},\n",
+                TRACE_PROGRAM);
+        fprintf(stats->trace, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"collector\"}}\n]\n",
+                TRACE_COLLECTOR);
+        if (stats->trace != stderr) fclose(stats->trace);
+        stats->trace = NULL;
+    }
+}
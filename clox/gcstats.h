@@ -0,0 +1,43 @@
+#ifndef clox_gcstats_h
+#define clox_gcstats_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// pauses are counted by powers of two microseconds: under 1, under 2, under 4, ..., the last bucket takes the rest
+#define GC_PAUSE_BUCKETS 24
+
+// counters of a VM's collector, cheap enough to be always kept
+typedef struct {
+    int collections; // stop-the-world ones
+    int concurrentCycles;
+    int compactions;
+    int pauseCount;
+    double pauseTotal; // seconds the program waited for the collector
+    double pauseMax;
+    int pauseHistogram[GC_PAUSE_BUCKETS];
+    size_t bytesFreed;
+    size_t allocated[OBJ_TYPE_COUNT]; // objects of each type allocated so far
+    size_t freed[OBJ_TYPE_COUNT];
+
+    double start; // when the VM was created, the trace counts its timestamps from here
+    FILE* trace; // every collection goes here as a Chrome trace event (`--gc-trace`), NULL: no trace
+    const char* dumpPath; // the counters are written here as JSON once the VM is freed (`--gc-stats`), "-": stderr
+} GcStats;
+
+void initGcStats(GcStats* stats);
+// start the trace of `stats` in the file at `path` ("-": stderr), false if it can't be opened
+bool openGcTrace(GcStats* stats, const char* path);
+// the program waited for the collector from `start` to `end` (see `gcClock`) to do `what`
+void recordPause(const char* what, double start, double end);
+// the collector thread worked on `what` from `start` to `end`, while the program ran
+void recordWork(const char* what, double start, double end);
+// gcStats(): the counters, as fields of an instance
+Value gcStatsNative(int argCount, Value* args);
+// write out the counters and close the trace, once the collector is done for good
+void finishGcStats();
+
+#endif
@@ -0,0 +1,289 @@
+// Batch host: runs many Lox scripts across worker threads, every script in a VM of its own.
+// usage: clox_host [-j threads] [--no-jit] [--no-inline] [--no-shared-strings] script.lox...
+//
+// Scripts are dealt out round-robin to one deque per worker. A worker takes its next script
+// from the bottom of its own deque, and once that runs dry it steals from the top of the others',
+// so a worker stuck with a few long scripts doesn't hold up the whole batch.
+//
+// The VMs share one pool of interned identifiers and string literals (see intern.c),
+// so the names every script uses are only allocated once.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "intern.h"
+#include "vm.h"
+
+#define HOST_MAX_WORKERS 256
+
+typedef struct {
+    const char* path;
+    InterpretResult result;
+    bool unreadable; // the file couldn't be read, it never ran
+    double seconds; // wall time from creating its VM to freeing it
+    int worker; // which worker ran it
+} Script;
+
+// the scripts waiting for one worker, its owner works at the bottom and thieves at the top
+typedef struct {
+    pthread_mutex_t lock;
+    Script** scripts;
+    int top;
+    int bottom; // one past the last waiting script
+} Deque;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    Deque deque;
+    int ran;
+    int stolen; // scripts among `ran` taken from other workers' deques
+} Worker;
+
+// flags applied to every VM of the batch
+static bool jitEnabled = true;
+static bool inlineEnabled = true;
+
+static Worker* workers;
+static int workerCount;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static Script* popBottom(Deque* deque) {
+    Script* script = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) script = deque->scripts[--deque->bottom];
+    pthread_mutex_unlock(&deque->lock);
+    return script;
+}
+
+static Script* stealTop(Deque* deque) {
+    Script* script = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) script = deque->scripts[deque->top++];
+    pthread_mutex_unlock(&deque->lock);
+    return script;
+}
+
+// no script is added once the workers are started, so all deques being empty means we're done
+static Script* nextScript(Worker* worker) {
+    Script* script = popBottom(&worker->deque);
+    if (script != NULL) return script;
+
+    // start with the next worker, so thieves don't all pile onto the first deque
+    for (int i = 1; i < workerCount; i++) {
+        Worker* victim = &workers[(worker->id + i) % workerCount];
+        script = stealTop(&victim->deque);
+        if (script != NULL) {
+            worker->stolen++;
+            return script;
+        }
+    }
+    return NULL;
+}
+
+// NULL if the file can't be read, unlike `readFile` in main.c one bad script mustn't end the batch
+static char* readScript(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(fileSize + 1);
+    if (buffer == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    buffer[bytesRead] = '\0';
+
+    fclose(file);
+    return buffer;
+}
+
+static void runScript(Worker* worker, Script* script) {
+    script->worker = worker->id;
+    char* source = readScript(script->path);
+    if (source == NULL) {
+        fprintf(stderr, "Could not read file \"%s\".\n", script->path);
+        script->unreadable = true;
+        return;
+    }
+
+    double start = now();
+    // a fresh VM for every script, so scripts can't see each other's globals
+    VM* instance = newVM();
+    instance->jitEnabled = jitEnabled;
+    instance->inlineEnabled = inlineEnabled;
+    // the workers already keep every core busy, marking threads would only get in their way
+    instance->gcThreads = 1;
+    script->result = interpret(instance, source);
+    freeVM(instance);
+    script->seconds = now() - start;
+
+    free(source);
+}
+
+static void* workerMain(void* arg) {
+    Worker* worker = (Worker*)arg;
+    Script* script;
+    while ((script = nextScript(worker)) != NULL) {
+        runScript(worker, script);
+        worker->ran++;
+    }
+    return NULL;
+}
+
+static int compareSeconds(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// `sorted` in ascending order, nearest-rank percentile
+static double percentile(double* sorted, int count, double p) {
+    int rank = (int)(p / 100 * count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+static void printStats(Script* scripts, int scriptCount, double elapsed) {
+    int ok = 0, compileErrors = 0, runtimeErrors = 0, unreadable = 0;
+    double* latencies = (double*)malloc(sizeof(double) * scriptCount);
+    if (latencies == NULL) exit(1);
+    int ran = 0;
+    double total = 0;
+    for (int i = 0; i < scriptCount; i++) {
+        Script* script = &scripts[i];
+        if (script->unreadable) {
+            unreadable++;
+            continue;
+        }
+        switch (script->result) {
+            case INTERPRET_OK: ok++; break;
+            case INTERPRET_COMPILE_ERROR: compileErrors++; break;
+            case INTERPRET_RUNTIME_ERROR: runtimeErrors++; break;
+        }
+        latencies[ran++] = script->seconds;
+        total += script->seconds;
+    }
+    qsort(latencies, ran, sizeof(double), compareSeconds);
+
+    fprintf(stderr, "\n%d scripts on %d workers in %.3f s (%.1f scripts/s)\n",
+            scriptCount, workerCount, elapsed, elapsed > 0 ? scriptCount / elapsed : 0);
+    fprintf(stderr, "ok %d, compile errors %d, runtime errors %d, unreadable %d\n",
+            ok, compileErrors, runtimeErrors, unreadable);
+    if (ran > 0) {
+        fprintf(stderr, "latency (ms): min %.3f  mean %.3f  p50 %.3f  p95 %.3f  p99 %.3f  max %.3f\n",
+                latencies[0] * 1000, total / ran * 1000,
+                percentile(latencies, ran, 50) * 1000, percentile(latencies, ran, 95) * 1000,
+                percentile(latencies, ran, 99) * 1000, latencies[ran - 1] * 1000);
+    }
+
+#ifdef SHARED_STRINGS
+    if (sharedStrings) fprintf(stderr, "shared strings: %d\n", sharedStringCount());
+#endif
+
+    fprintf(stderr, "%-8s %8s %8s %12s\n", "worker", "ran", "stolen", "busy (ms)");
+    for (int i = 0; i < workerCount; i++) {
+        double busy = 0;
+        for (int j = 0; j < scriptCount; j++) {
+            if (scripts[j].worker == i) busy += scripts[j].seconds;
+        }
+        fprintf(stderr, "%-8d %8d %8d %12.3f\n", i, workers[i].ran, workers[i].stolen, busy * 1000);
+    }
+    free(latencies);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox_host [-j threads] [--no-jit] [--no-inline] [--no-shared-strings] script.lox...\n");
+    exit(64);
+}
+
+int main(int argc, const char* argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workerCount = cpus > 0 ? (int)cpus : 1;
+
+#ifdef SHARED_STRINGS
+    sharedStrings = true;
+#endif
+    Script* scripts = (Script*)calloc(argc, sizeof(Script));
+    if (scripts == NULL) exit(1);
+    int scriptCount = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0) {
+            if (++i == argc) usage();
+            workerCount = atoi(argv[i]);
+            if (workerCount < 1 || workerCount > HOST_MAX_WORKERS) usage();
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+            jitEnabled = false;
+        } else if (strcmp(argv[i], "--no-inline") == 0) {
+            inlineEnabled = false;
+        } else if (strcmp(argv[i], "--no-shared-strings") == 0) {
+#ifdef SHARED_STRINGS
+            sharedStrings = false;
+#endif
+        } else if (argv[i][0] != '-') {
+            scripts[scriptCount++].path = argv[i];
+        } else {
+            usage();
+        }
+    }
+    if (scriptCount == 0) usage();
+    if (workerCount > scriptCount) workerCount = scriptCount;
+
+    workers = (Worker*)calloc(workerCount, sizeof(Worker));
+    if (workers == NULL) exit(1);
+    for (int i = 0; i < workerCount; i++) {
+        Worker* worker = &workers[i];
+        worker->id = i;
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        // every deque gets room for its whole share up front, it never grows
+        worker->deque.scripts = (Script**)malloc(sizeof(Script*) * (scriptCount / workerCount + 1));
+        if (worker->deque.scripts == NULL) exit(1);
+    }
+    for (int i = 0; i < scriptCount; i++) {
+        Deque* deque = &workers[i % workerCount].deque;
+        deque->scripts[deque->bottom++] = &scripts[i];
+    }
+
+    double start = now();
+    for (int i = 0; i < workerCount; i++) {
+        if (pthread_create(&workers[i].thread, NULL, workerMain, &workers[i]) != 0) {
+            fprintf(stderr, "Could not start worker %d.\n", i);
+            exit(71);
+        }
+    }
+    for (int i = 0; i < workerCount; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = now() - start;
+
+    printStats(scripts, scriptCount, elapsed);
+
+    bool failed = false;
+    for (int i = 0; i < scriptCount; i++) {
+        if (scripts[i].unreadable || scripts[i].result != INTERPRET_OK) failed = true;
+    }
+    for (int i = 0; i < workerCount; i++) {
+        pthread_mutex_destroy(&workers[i].deque.lock);
+        free(workers[i].deque.scripts);
+    }
+    free(workers);
+    free(scripts);
+#ifdef SHARED_STRINGS
+    freeSharedStrings();
+#endif
+    return failed ? 70 : 0;
+}
@@ -0,0 +1,141 @@
+#include "common.h"
+#include "intern.h"
+
+#ifdef SHARED_STRINGS
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The process-wide pool of interned strings shared by all VMs (see SHARED_STRINGS).
+//
+// Lookups take no lock: the pool is an open-addressing table of atomic pointers, and a slot,
+// once filled, never changes. Insertions are serialized by a mutex. Growing publishes a new
+// table; readers still probing the old one find everything it had, and the old table is only
+// freed along with the pool. A reader missing a string added meanwhile takes the lock and looks again.
+//
+// A shared string belongs to no VM: it's not on any `objects` list, doesn't count towards any
+// `bytesAllocated`, and stays marked for good, so a collection never traces, frees or writes it.
+
+#define SHARED_STRINGS_MAX_LOAD 0.75
+
+typedef struct SharedTable {
+    struct SharedTable* retired; // the smaller tables it replaced
+    int capacity; // always a power of 2
+    _Atomic(ObjString*) entries[];
+} SharedTable;
+
+bool sharedStrings = false;
+
+static _Atomic(SharedTable*) pool = NULL;
+// the rest is only touched under the lock
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static int poolCount = 0;
+
+static ObjString* probe(SharedTable* table, const char* chars, int length, uint32_t hash) {
+    uint32_t index = hash & (table->capacity - 1);
+    for (;;) {
+        ObjString* string = atomic_load_explicit(&table->entries[index], memory_order_acquire);
+        if (string == NULL) return NULL;
+        if (string->hash == hash && string->length == length && memcmp(string->chars, chars, length) == 0) {
+            return string;
+        }
+        index = (index + 1) & (table->capacity - 1);
+    }
+}
+
+// `string` isn't in `table` yet
+static void insert(SharedTable* table, ObjString* string) {
+    uint32_t index = string->hash & (table->capacity - 1);
+    while (atomic_load_explicit(&table->entries[index], memory_order_relaxed) != NULL) {
+        index = (index + 1) & (table->capacity - 1);
+    }
+    // release: a reader seeing the pointer sees the string's fields too
+    atomic_store_explicit(&table->entries[index], string, memory_order_release);
+}
+
+static SharedTable* newTable(int capacity) {
+    SharedTable* table = (SharedTable*)calloc(1, sizeof(SharedTable) + sizeof(ObjString*) * capacity);
+    if (table == NULL) exit(1);
+    table->capacity = capacity;
+    return table;
+}
+
+static SharedTable* grow(SharedTable* table) {
+    SharedTable* grown = newTable(table == NULL ? SHARED_STRINGS_INITIAL : table->capacity * 2);
+    if (table != NULL) {
+        for (int i = 0; i < table->capacity; i++) {
+            ObjString* string = atomic_load_explicit(&table->entries[i], memory_order_relaxed);
+            if (string != NULL) insert(grown, string);
+        }
+    }
+    grown->retired = table;
+    atomic_store_explicit(&pool, grown, memory_order_release);
+    return grown;
+}
+
+ObjString* findSharedString(const char* chars, int length, uint32_t hash) {
+    SharedTable* table = atomic_load_explicit(&pool, memory_order_acquire);
+    if (table == NULL) return NULL;
+    return probe(table, chars, length, hash);
+}
+
+ObjString* internSharedString(const char* chars, int length, uint32_t hash) {
+    ObjString* string = findSharedString(chars, length, hash);
+    if (string != NULL) return string;
+
+    pthread_mutex_lock(&poolLock);
+    SharedTable* table = atomic_load_explicit(&pool, memory_order_relaxed);
+    // another VM may have added it since
+    if (table != NULL) string = probe(table, chars, length, hash);
+    if (string == NULL) {
+        if (table == NULL || poolCount + 1 > table->capacity * SHARED_STRINGS_MAX_LOAD) table = grow(table);
+
+        // plain `malloc`, it's nobody's garbage
+        string = (ObjString*)malloc(sizeof(ObjString));
+        char* heapChars = (char*)malloc(length + 1);
+        if (string == NULL || heapChars == NULL) exit(1);
+        memcpy(heapChars, chars, length);
+        heapChars[length] = '\0';
+        string->obj.type = OBJ_STRING;
+        atomic_init(&string->obj.isMarked, true);
+        string->obj.next = NULL;
+        string->length = length;
+        string->chars = heapChars;
+        string->hash = hash;
+
+        insert(table, string);
+        poolCount++;
+    }
+    pthread_mutex_unlock(&poolLock);
+    return string;
+}
+
+int sharedStringCount() {
+    pthread_mutex_lock(&poolLock);
+    int count = poolCount;
+    pthread_mutex_unlock(&poolLock);
+    return count;
+}
+
+void freeSharedStrings() {
+    SharedTable* table = atomic_load_explicit(&pool, memory_order_relaxed);
+    if (table != NULL) {
+        for (int i = 0; i < table->capacity; i++) {
+            ObjString* string = atomic_load_explicit(&table->entries[i], memory_order_relaxed);
+            if (string == NULL) continue;
+            free(string->chars);
+            free(string);
+        }
+    }
+    while (table != NULL) {
+        SharedTable* retired = table->retired;
+        free(table);
+        table = retired;
+    }
+    atomic_store_explicit(&pool, NULL, memory_order_relaxed);
+    poolCount = 0;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include "common.h"
+#include "object.h"
+
+// the process-wide pool starts out this big, and doubles whenever it's 3/4 full
+#define SHARED_STRINGS_INITIAL 1024
+
+// set before the first VM is created: identifiers and string literals go into the process-wide pool
+// instead of each VM's own `strings`, a host running many VMs then keeps only one copy of them
+extern bool sharedStrings;
+
+// lock-free, NULL if the pool doesn't have the string (yet)
+ObjString* findSharedString(const char* chars, int length, uint32_t hash);
+// find the string, or add it under the pool's lock
+ObjString* internSharedString(const char* chars, int length, uint32_t hash);
+int sharedStringCount();
+// only once no VM is left
+void freeSharedStrings();
+
+#endif
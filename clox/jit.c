@@ -0,0 +1,1077 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "jit.h"
+
+#ifdef BASELINE_JIT
+
+#include "assembler.h"
+#include "collector.h"
+#include "memory.h"
+#include "perfmap.h"
+#include "trace.h"
+
+// Baseline JIT: every bytecode instruction is translated into a fixed template of machine code.
+// Simple instructions (locals, constants, number arithmetic, jumps) are done inline,
+// everything else calls a C helper which reuses the interpreter's own slow paths.
+// Whenever a call pushes or a return pops a CallFrame, the compiled code returns to `run()`,
+// which continues with the new topmost frame (in compiled code again, if it has some).
+
+// register assignment inside compiled code
+// all of them are callee-saved, so they survive the calls into the C helpers
+#define STACK_TOP RBX // cached `vm->stackTop`, written back before and reloaded after every helper call
+#define SLOTS     R12 // frame->slots
+#define FRAME     R13 // the CallFrame being executed
+#define CONSTANTS R14 // the function's constant table
+#define VM_STATE  R15 // the VM owning the function
+
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+// deepest stack a trace keeps type information for
+#define TRACE_MAX_DEPTH (UINT8_COUNT * 2)
+
+// signature of the entry sequence at the start of every compiled function
+typedef JitStatus (*JitEntry)(CallFrame* frame, uint8_t* target);
+
+// result of the call helpers
+typedef enum {
+    CALL_FAILED,
+    CALL_RETURNED, // callee was a native (or a class without initializer), its result is already on the stack
+    CALL_PUSHED_FRAME, // callee is a Lox function, the interpreter takes over
+    CALL_INLINED, // the guard of an inlined call held, go on with the inlined body
+} CallResult;
+
+// where the operands of a binary instruction come from
+typedef enum {
+    OPERANDS_STACK, // the two topmost stack slots
+    OPERANDS_LL, // two local slots
+    OPERANDS_LK, // a local slot and a constant
+} OperandForm;
+
+// a forward jump to a bytecode offset whose native code isn't emitted yet
+typedef struct {
+    int position; // offset of the rel32 operand
+    int target; // bytecode offset it jumps to
+} JumpPatch;
+
+typedef struct {
+    Assembler as;
+    ObjFunction* function;
+    uint32_t* entries;
+    JumpPatch* jumps;
+    int jumpCount;
+    int jumpCapacity;
+    int epilogue; // native offset of the shared return sequence
+    int errorExit; // `return JIT_RUNTIME_ERROR;`
+    int frameExit; // `return JIT_FRAME_CHANGED;`
+
+    // only used when compiling traces
+    Trace* trace;
+    int traceStart; // native offset of the first instruction of the loop
+    int sideExit; // `return JIT_INTERPRET;` with the resume ip in rax
+    JumpPatch* exits; // guards leaving the trace, `target` is the bytecode offset to resume at
+    int exitCount;
+    int exitCapacity;
+    int depth; // stack slots in use, relative to frame->slots
+    bool numbers[TRACE_MAX_DEPTH]; // which of them are known to hold a number
+} JitCompiler;
+
+// helpers called from compiled code
+// vm->stackTop and frame->ip are up to date whenever they run, just like in `run()`
+
+static Value peek(int distance) {
+    return vm->stackTop[-1 - distance];
+}
+
+static ObjString* readString(CallFrame* frame, int constant) {
+    return AS_STRING(frame->closure->function->chunk.constants.values[constant]);
+}
+
+static bool jitGetGlobal(CallFrame* frame, int constant) {
+    return getGlobal(readString(frame, constant));
+}
+
+static bool jitDefineGlobal(CallFrame* frame, int constant) {
+    tableSet(&vm->globals, readString(frame, constant), peek(0));
+    pop();
+    return true;
+}
+
+static bool jitSetGlobal(CallFrame* frame, int constant) {
+    return setGlobal(readString(frame, constant));
+}
+
+static bool jitGetProperty(CallFrame* frame, int constant) {
+    return getProperty(readString(frame, constant));
+}
+
+#ifdef CONCURRENT_GC
+static void jitWriteBarrier(Value value) {
+    WRITE_BARRIER(value);
+}
+#endif
+
+static bool jitSetProperty(CallFrame* frame, int constant) {
+    return setProperty(readString(frame, constant));
+}
+
+static bool jitGetSuper(CallFrame* frame, int constant) {
+    ObjString* name = readString(frame, constant);
+    ObjClass* superclass = AS_CLASS(pop());
+    return bindMethod(superclass, name);
+}
+
+// OP_ADD once the operands turned out not to be two numbers
+static bool jitAdd() {
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        concatenate();
+        return true;
+    }
+    runtimeError("Operands must be two numbers or two strings.");
+    return false;
+}
+
+static bool jitNumberOperands() {
+    runtimeError("Operands must be numbers.");
+    return false;
+}
+
+static bool jitNumberOperand() {
+    runtimeError("Operand must be a number.");
+    return false;
+}
+
+static bool jitPrint() {
+    printValue(pop());
+    printf("\n");
+    return true;
+}
+
+// the callee returned if the same frame is still on top
+// a Lox callee pushed a frame, and `resume` or `suspend` switched to the frames of another fiber
+static CallResult callResult(CallFrame* frames, int frameCount) {
+    return vm->frames == frames && vm->frameCount == frameCount ? CALL_RETURNED : CALL_PUSHED_FRAME;
+}
+
+static CallResult jitCall(int argCount) {
+    CallFrame* frames = vm->frames;
+    int frameCount = vm->frameCount;
+    if (!callValue(peek(argCount), argCount)) return CALL_FAILED;
+    return callResult(frames, frameCount);
+}
+
+// after a tail call: a Lox callee restarted the frame at its own code, which the interpreter has to pick up
+// like a new frame
+static CallResult tailCallResult(CallFrame* frames, int frameCount, uint8_t* ip) {
+    CallResult result = callResult(frames, frameCount);
+    return result == CALL_RETURNED && frames[frameCount - 1].ip == ip ? CALL_RETURNED : CALL_PUSHED_FRAME;
+}
+
+static CallResult jitTailCall(int argCount) {
+    CallFrame* frames = vm->frames;
+    int frameCount = vm->frameCount;
+    uint8_t* ip = frames[frameCount - 1].ip;
+    if (!tailCall(peek(argCount), argCount)) return CALL_FAILED;
+    return tailCallResult(frames, frameCount, ip);
+}
+
+// OP_INVOKE and OP_TAIL_INVOKE
+static CallResult jitInvoke(CallFrame* frame, int constant, int argCount, bool tail) {
+    CallFrame* frames = vm->frames;
+    int frameCount = vm->frameCount;
+    uint8_t* ip = frame->ip;
+    if (!invoke(readString(frame, constant), argCount, tail)) return CALL_FAILED;
+    return tail ? tailCallResult(frames, frameCount, ip) : callResult(frames, frameCount);
+}
+
+// OP_SUPER_INVOKE and OP_TAIL_SUPER_INVOKE
+static CallResult jitSuperInvoke(CallFrame* frame, int constant, int argCount, bool tail) {
+    ObjString* method = readString(frame, constant);
+    ObjClass* superclass = AS_CLASS(pop());
+    if (!invokeFromClass(superclass, method, argCount, tail)) return CALL_FAILED;
+    return CALL_PUSHED_FRAME;
+}
+
+// OP_CALL_INLINE and OP_INVOKE_INLINE, `ip` points at the instruction
+static CallResult jitCallInline(CallFrame* frame, uint8_t* ip) {
+    if (inlineGuardHolds(frame, ip)) return CALL_INLINED;
+
+    // call it for real, returning past the inlined body
+    bool isInvoke = *ip == OP_INVOKE_INLINE;
+    int argCount = isInvoke ? ip[2] : ip[1];
+    uint8_t* skip = ip + (isInvoke ? 4 : 3);
+    frame->ip = skip + 2 + (uint16_t)(skip[0] << 8 | skip[1]);
+
+    CallFrame* frames = vm->frames;
+    int frameCount = vm->frameCount;
+    if (isInvoke) {
+        if (!invoke(readString(frame, ip[1]), argCount, false)) return CALL_FAILED;
+    } else {
+        if (!callValue(peek(argCount), argCount)) return CALL_FAILED;
+    }
+    return callResult(frames, frameCount);
+}
+
+// `operands` points right after the OP_CLOSURE opcode
+static bool jitClosure(CallFrame* frame, uint8_t* operands) {
+    ObjFunction* function = AS_FUNCTION(frame->closure->function->chunk.constants.values[*operands++]);
+    ObjClosure* closure = newClosure(function);
+    push(OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = *operands++;
+        uint8_t index = *operands++;
+        if (isLocal) {
+            SHARED_STORE(closure->upvalues[i], captureUpvalue(frame->slots + index));
+        } else {
+            SHARED_STORE(closure->upvalues[i], frame->closure->upvalues[index]);
+        }
+    }
+    return true;
+}
+
+static bool jitCloseUpvalue() {
+    closeUpvalues(vm->stackTop - 1);
+    pop();
+    return true;
+}
+
+static JitStatus jitReturn(CallFrame* frame) {
+    Value result = pop();
+    closeUpvalues(frame->slots);
+    vm->frameCount--;
+    if (vm->frameCount == 0) {
+        pop();
+        if (vm->fiber == NULL) return JIT_FINISHED;
+        leaveFiber(FIBER_DONE);
+    } else {
+        vm->stackTop = frame->slots;
+    }
+    push(result);
+    return JIT_FRAME_CHANGED;
+}
+
+static bool jitClass(CallFrame* frame, int constant) {
+    push(OBJ_VAL(newClass(readString(frame, constant))));
+    return true;
+}
+
+static bool jitInherit() {
+    Value superclass = peek(1);
+    if (!IS_CLASS(superclass)) {
+        runtimeError("Superclass must be a class.");
+        return false;
+    }
+    ObjClass* subclass = AS_CLASS(peek(0));
+    tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+    pop(); // Subclass.
+    return true;
+}
+
+static bool jitMethod(CallFrame* frame, int constant) {
+    defineMethod(readString(frame, constant));
+    return true;
+}
+
+// templates
+
+static void emitPush(Assembler* as, Register value) {
+    asmStore(as, STACK_TOP, 0, value);
+    asmAddImm(as, STACK_TOP, VALUE_SIZE);
+}
+
+// call a C helper with the interpreter state in memory up to date
+// `nextIp` is where the interpreter resumes (and what runtime errors are reported against)
+// arguments must already be in rdi, rsi and rdx, the result is left in rax
+static void emitHelperCall(JitCompiler* jc, void* helper, uint8_t* nextIp) {
+    Assembler* as = &jc->as;
+    asmStore(as, VM_STATE, offsetof(VM, stackTop), STACK_TOP);
+    asmMovImm(as, RAX, (uint64_t)(uintptr_t)nextIp);
+    asmStore(as, FRAME, offsetof(CallFrame, ip), RAX);
+    asmCall(as, helper);
+    asmLoad(as, STACK_TOP, VM_STATE, offsetof(VM, stackTop));
+}
+
+// helpers returning false have already reported a runtime error
+static void emitErrorCheck(JitCompiler* jc) {
+    asmTestAl(&jc->as);
+    asmJccTo(&jc->as, CC_E, jc->errorExit);
+}
+
+static void emitCallResultCheck(JitCompiler* jc) {
+    asmCmp32Imm(&jc->as, RAX, CALL_RETURNED);
+    asmJccTo(&jc->as, CC_B, jc->errorExit);
+    asmJccTo(&jc->as, CC_A, jc->frameExit);
+}
+
+static void addPatch(JumpPatch** patches, int* count, int* capacity, int position, int target) {
+    if (*capacity < *count + 1) {
+        *capacity = GROW_CAPACITY(*capacity);
+        *patches = (JumpPatch*)realloc(*patches, sizeof(JumpPatch) * *capacity);
+        if (*patches == NULL) exit(1);
+    }
+    (*patches)[*count].position = position;
+    (*patches)[*count].target = target;
+    (*count)++;
+}
+
+static void emitJumpTo(JitCompiler* jc, int position, int target) {
+    addPatch(&jc->jumps, &jc->jumpCount, &jc->jumpCapacity, position, target);
+}
+
+// make the jump at `position` leave the trace, the interpreter goes on at bytecode offset `target`
+static void emitSideExit(JitCompiler* jc, int position, int target) {
+    addPatch(&jc->exits, &jc->exitCount, &jc->exitCapacity, position, target);
+}
+
+// turn the flag in `al` into a Lox boolean in rax
+static void emitBoolFromAl(Assembler* as) {
+    asmMovzxAl(as);
+    // FALSE_VAL and TRUE_VAL only differ in the lowest bit
+    asmMovImm(as, RCX, FALSE_VAL);
+    asmAdd(as, RAX, RCX);
+}
+
+// set `al` if rax holds a falsey value (nil or false)
+static void emitFalseyTest(Assembler* as) {
+    // NIL_VAL and FALSE_VAL are adjacent bit patterns, so one unsigned compare covers both
+    asmMovImm(as, RCX, NIL_VAL);
+    asmSub(as, RAX, RCX);
+    asmCmpImm(as, RAX, 1);
+}
+
+static void loadOperands(Assembler* as, OperandForm form, int a, int b) {
+    switch (form) {
+        case OPERANDS_STACK:
+            asmLoad(as, RAX, STACK_TOP, -2 * VALUE_SIZE);
+            asmLoad(as, RCX, STACK_TOP, -VALUE_SIZE);
+            break;
+        case OPERANDS_LL:
+            asmLoad(as, RAX, SLOTS, a * VALUE_SIZE);
+            asmLoad(as, RCX, SLOTS, b * VALUE_SIZE);
+            break;
+        case OPERANDS_LK:
+            asmLoad(as, RAX, SLOTS, a * VALUE_SIZE);
+            asmLoad(as, RCX, CONSTANTS, b * VALUE_SIZE);
+            break;
+    }
+}
+
+// the stack form replaces its two operands with the result, the fused form pushes it
+static void storeResult(Assembler* as, OperandForm form) {
+    if (form == OPERANDS_STACK) {
+        asmStore(as, STACK_TOP, -2 * VALUE_SIZE, RAX);
+        asmSubImm(as, STACK_TOP, VALUE_SIZE);
+    } else {
+        emitPush(as, RAX);
+    }
+}
+
+// put fused form operands onto the stack, so the stack form slow paths can deal with them
+static void spillOperands(Assembler* as, OperandForm form) {
+    if (form == OPERANDS_STACK) return;
+    asmStore(as, STACK_TOP, 0, RAX);
+    asmStore(as, STACK_TOP, VALUE_SIZE, RCX);
+    asmAddImm(as, STACK_TOP, 2 * VALUE_SIZE);
+}
+
+// jump to the patch positions unless both rax and rcx hold numbers
+static void emitNumberGuard(Assembler* as, int patches[2]) {
+    asmMovImm(as, RDX, QNAN);
+    asmMov(as, RSI, RAX);
+    asmAnd(as, RSI, RDX);
+    asmCmp(as, RSI, RDX);
+    patches[0] = asmJcc(as, CC_E);
+    asmMov(as, RSI, RCX);
+    asmAnd(as, RSI, RDX);
+    asmCmp(as, RSI, RDX);
+    patches[1] = asmJcc(as, CC_E);
+}
+
+// OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE, OP_LESS, OP_GREATER and their fused forms
+// the number operation itself, on the operands in rax and rcx, leaving its result in rax
+static void emitNumberOp(Assembler* as, OpCode op) {
+    asmMovqToXmm(as, XMM0, RAX);
+    asmMovqToXmm(as, XMM1, RCX);
+    switch (op) {
+        case OP_ADD:      asmSse(as, SSE_ADD, XMM0, XMM1); break;
+        case OP_SUBTRACT: asmSse(as, SSE_SUB, XMM0, XMM1); break;
+        case OP_MULTIPLY: asmSse(as, SSE_MUL, XMM0, XMM1); break;
+        case OP_DIVIDE:   asmSse(as, SSE_DIV, XMM0, XMM1); break;
+        case OP_GREATER:
+            // `seta` is false for unordered operands, so NaN compares false just like in C
+            asmUcomisd(as, XMM0, XMM1);
+            asmSetccAl(as, CC_A);
+            break;
+        case OP_LESS:
+            asmUcomisd(as, XMM1, XMM0);
+            asmSetccAl(as, CC_A);
+            break;
+        default: return; // Unreachable.
+    }
+    if (op == OP_GREATER || op == OP_LESS) {
+        emitBoolFromAl(as);
+    } else {
+        asmMovqFromXmm(as, RAX, XMM0);
+    }
+}
+
+static void emitArithmetic(JitCompiler* jc, OpCode op, OperandForm form, int a, int b, uint8_t* nextIp) {
+    Assembler* as = &jc->as;
+    loadOperands(as, form, a, b);
+
+    int slowPath[2];
+    emitNumberGuard(as, slowPath);
+
+    emitNumberOp(as, op);
+    storeResult(as, form);
+    int done = asmJmp(as);
+
+    asmPatch(as, slowPath[0], as->count);
+    asmPatch(as, slowPath[1], as->count);
+    spillOperands(as, form);
+    emitHelperCall(jc, op == OP_ADD ? (void*)jitAdd : (void*)jitNumberOperands, nextIp);
+    emitErrorCheck(jc);
+    asmPatch(as, done, as->count);
+}
+
+static void emitEqual(JitCompiler* jc, OperandForm form, int a, int b) {
+    Assembler* as = &jc->as;
+    loadOperands(as, form, a, b);
+    // valuesEqual neither allocates nor fails, no need to sync the interpreter state
+    asmMov(as, RDI, RAX);
+    asmMov(as, RSI, RCX);
+    asmCall(as, (void*)valuesEqual);
+    emitBoolFromAl(as);
+    storeResult(as, form);
+}
+
+// the fused forms are declared in the order ADD, SUBTRACT, MULTIPLY, DIVIDE, LESS, GREATER, EQUAL
+static OpCode stackForm(int index) {
+    static const OpCode forms[] = {OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE, OP_LESS, OP_GREATER, OP_EQUAL};
+    return forms[index];
+}
+
+static void emitPrologue(JitCompiler* jc) {
+    Assembler* as = &jc->as;
+    asmPush(as, RBP);
+    asmMov(as, RBP, RSP);
+    asmPush(as, RBX);
+    asmPush(as, R12);
+    asmPush(as, R13);
+    asmPush(as, R14);
+    asmPush(as, R15);
+    // keep rsp 16-byte aligned for the helper calls
+    asmSubImm(as, RSP, 8);
+
+    asmMov(as, FRAME, RDI);
+    asmMovImm(as, VM_STATE, (uint64_t)(uintptr_t)vm);
+    asmLoad(as, STACK_TOP, VM_STATE, offsetof(VM, stackTop));
+    asmLoad(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    asmMovImm(as, CONSTANTS, (uint64_t)(uintptr_t)jc->function->chunk.constants.values);
+    // continue at the instruction the frame's ip is at
+    asmJmpReg(as, RSI);
+
+    jc->epilogue = as->count;
+    asmAddImm(as, RSP, 8);
+    asmPop(as, R15);
+    asmPop(as, R14);
+    asmPop(as, R13);
+    asmPop(as, R12);
+    asmPop(as, RBX);
+    asmPop(as, RBP);
+    asmRet(as);
+
+    jc->errorExit = as->count;
+    asmMovImm(as, RAX, JIT_RUNTIME_ERROR);
+    asmJmpTo(as, jc->epilogue);
+
+    jc->frameExit = as->count;
+    asmMovImm(as, RAX, JIT_FRAME_CHANGED);
+    asmJmpTo(as, jc->epilogue);
+}
+
+// emit the template for the instruction at `offset`, return the offset of the next one (-1: can't compile)
+static int emitInstruction(JitCompiler* jc, int offset) {
+    Assembler* as = &jc->as;
+    Chunk* chunk = &jc->function->chunk;
+    uint8_t* code = chunk->code;
+    uint8_t instruction = code[offset];
+
+    switch (instruction) {
+        case OP_CONSTANT:
+            asmLoad(as, RAX, CONSTANTS, code[offset + 1] * VALUE_SIZE);
+            emitPush(as, RAX);
+            return offset + 2;
+        case OP_NIL:
+            asmMovImm(as, RAX, NIL_VAL);
+            emitPush(as, RAX);
+            return offset + 1;
+        case OP_TRUE:
+            asmMovImm(as, RAX, TRUE_VAL);
+            emitPush(as, RAX);
+            return offset + 1;
+        case OP_FALSE:
+            asmMovImm(as, RAX, FALSE_VAL);
+            emitPush(as, RAX);
+            return offset + 1;
+        case OP_POP:
+            asmSubImm(as, STACK_TOP, VALUE_SIZE);
+            return offset + 1;
+        case OP_GET_LOCAL:
+            asmLoad(as, RAX, SLOTS, code[offset + 1] * VALUE_SIZE);
+            emitPush(as, RAX);
+            return offset + 2;
+        case OP_SET_LOCAL:
+            asmLoad(as, RAX, STACK_TOP, -VALUE_SIZE);
+            asmStore(as, SLOTS, code[offset + 1] * VALUE_SIZE, RAX);
+            return offset + 2;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_CLASS:
+        case OP_METHOD: {
+            void* helper = NULL;
+            switch (instruction) {
+                case OP_GET_GLOBAL:    helper = (void*)jitGetGlobal; break;
+                case OP_DEFINE_GLOBAL: helper = (void*)jitDefineGlobal; break;
+                case OP_SET_GLOBAL:    helper = (void*)jitSetGlobal; break;
+                case OP_GET_PROPERTY:  helper = (void*)jitGetProperty; break;
+                case OP_SET_PROPERTY:  helper = (void*)jitSetProperty; break;
+                case OP_GET_SUPER:     helper = (void*)jitGetSuper; break;
+                case OP_CLASS:         helper = (void*)jitClass; break;
+                case OP_METHOD:        helper = (void*)jitMethod; break;
+            }
+            asmMov(as, RDI, FRAME);
+            asmMovImm(as, RSI, code[offset + 1]);
+            emitHelperCall(jc, helper, code + offset + 2);
+            emitErrorCheck(jc);
+            return offset + 2;
+        }
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            // frame->closure->upvalues[slot]->location
+            asmLoad(as, RAX, FRAME, offsetof(CallFrame, closure));
+            asmLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues));
+            asmLoad(as, RAX, RAX, code[offset + 1] * (int32_t)sizeof(ObjUpvalue*));
+            asmLoad(as, RAX, RAX, offsetof(ObjUpvalue, location));
+            if (instruction == OP_GET_UPVALUE) {
+                asmLoad(as, RAX, RAX, 0);
+                emitPush(as, RAX);
+            } else {
+                asmLoad(as, RCX, STACK_TOP, -VALUE_SIZE);
+                asmStore(as, RAX, 0, RCX);
+#ifdef CONCURRENT_GC
+                // a closed upvalue is on the heap
+                asmMov(as, RDI, RCX);
+                emitHelperCall(jc, (void*)jitWriteBarrier, code + offset + 2);
+#endif
+            }
+            return offset + 2;
+        case OP_EQUAL:
+            emitEqual(jc, OPERANDS_STACK, 0, 0);
+            return offset + 1;
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            emitArithmetic(jc, instruction, OPERANDS_STACK, 0, 0, code + offset + 1);
+            return offset + 1;
+        case OP_NOT:
+            asmLoad(as, RAX, STACK_TOP, -VALUE_SIZE);
+            emitFalseyTest(as);
+            asmSetccAl(as, CC_BE);
+            emitBoolFromAl(as);
+            asmStore(as, STACK_TOP, -VALUE_SIZE, RAX);
+            return offset + 1;
+        case OP_NEGATE: {
+            asmLoad(as, RAX, STACK_TOP, -VALUE_SIZE);
+            asmMov(as, RCX, RAX);
+            int slowPath[2];
+            emitNumberGuard(as, slowPath);
+            asmFlipSign(as, RAX);
+            asmStore(as, STACK_TOP, -VALUE_SIZE, RAX);
+            int done = asmJmp(as);
+            asmPatch(as, slowPath[0], as->count);
+            asmPatch(as, slowPath[1], as->count);
+            emitHelperCall(jc, (void*)jitNumberOperand, code + offset + 1);
+            asmJmpTo(as, jc->errorExit);
+            asmPatch(as, done, as->count);
+            return offset + 1;
+        }
+        case OP_PRINT:
+            emitHelperCall(jc, (void*)jitPrint, code + offset + 1);
+            return offset + 1;
+        case OP_JUMP: {
+            uint16_t jump = (uint16_t)(code[offset + 1] << 8 | code[offset + 2]);
+            emitJumpTo(jc, asmJmp(as), offset + 3 + jump);
+            return offset + 3;
+        }
+        case OP_JUMP_IF_FALSE: {
+            uint16_t jump = (uint16_t)(code[offset + 1] << 8 | code[offset + 2]);
+            asmLoad(as, RAX, STACK_TOP, -VALUE_SIZE);
+            emitFalseyTest(as);
+            emitJumpTo(jc, asmJcc(as, CC_BE), offset + 3 + jump);
+            return offset + 3;
+        }
+        case OP_LOOP: {
+            uint16_t jump = (uint16_t)(code[offset + 1] << 8 | code[offset + 2]);
+            emitJumpTo(jc, asmJmp(as), offset + 4 - jump);
+            return offset + 4;
+        }
+        case OP_CALL:
+            asmMovImm(as, RDI, code[offset + 1]);
+            emitHelperCall(jc, (void*)jitCall, code + offset + 2);
+            emitCallResultCheck(jc);
+            return offset + 2;
+        case OP_TAIL_CALL:
+            asmMovImm(as, RDI, code[offset + 1]);
+            emitHelperCall(jc, (void*)jitTailCall, code + offset + 2);
+            emitCallResultCheck(jc);
+            return offset + 2;
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE: {
+            bool super = instruction == OP_SUPER_INVOKE || instruction == OP_TAIL_SUPER_INVOKE;
+            asmMov(as, RDI, FRAME);
+            asmMovImm(as, RSI, code[offset + 1]);
+            asmMovImm(as, RDX, code[offset + 2]);
+            asmMovImm(as, RCX, instruction == OP_TAIL_INVOKE || instruction == OP_TAIL_SUPER_INVOKE);
+            emitHelperCall(jc, super ? (void*)jitSuperInvoke : (void*)jitInvoke, code + offset + 3);
+            emitCallResultCheck(jc);
+            return offset + 3;
+        }
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[code[offset + 1]]);
+            int next = offset + 2 + 2 * function->upvalueCount;
+            asmMov(as, RDI, FRAME);
+            asmMovImm(as, RSI, (uint64_t)(uintptr_t)(code + offset + 1));
+            emitHelperCall(jc, (void*)jitClosure, code + next);
+            return next;
+        }
+        case OP_CLOSE_UPVALUE:
+            emitHelperCall(jc, (void*)jitCloseUpvalue, code + offset + 1);
+            return offset + 1;
+        case OP_RETURN:
+            // the helper's JitStatus goes straight back to `run()`
+            asmMov(as, RDI, FRAME);
+            emitHelperCall(jc, (void*)jitReturn, code + offset + 1);
+            asmJmpTo(as, jc->epilogue);
+            return offset + 1;
+        case OP_INHERIT:
+            emitHelperCall(jc, (void*)jitInherit, code + offset + 1);
+            emitErrorCheck(jc);
+            return offset + 1;
+        case OP_ADD_LL:
+        case OP_SUBTRACT_LL:
+        case OP_MULTIPLY_LL:
+        case OP_DIVIDE_LL:
+        case OP_LESS_LL:
+        case OP_GREATER_LL:
+            emitArithmetic(jc, stackForm(instruction - OP_ADD_LL), OPERANDS_LL,
+                           code[offset + 1], code[offset + 2], code + offset + 3);
+            return offset + 3;
+        case OP_ADD_LK:
+        case OP_SUBTRACT_LK:
+        case OP_MULTIPLY_LK:
+        case OP_DIVIDE_LK:
+        case OP_LESS_LK:
+        case OP_GREATER_LK:
+            emitArithmetic(jc, stackForm(instruction - OP_ADD_LK), OPERANDS_LK,
+                           code[offset + 1], code[offset + 2], code + offset + 3);
+            return offset + 3;
+        case OP_EQUAL_LL:
+            emitEqual(jc, OPERANDS_LL, code[offset + 1], code[offset + 2]);
+            return offset + 3;
+        case OP_EQUAL_LK:
+            emitEqual(jc, OPERANDS_LK, code[offset + 1], code[offset + 2]);
+            return offset + 3;
+        case OP_STORE_LOCAL:
+            asmSubImm(as, STACK_TOP, VALUE_SIZE);
+            asmLoad(as, RAX, STACK_TOP, 0);
+            asmStore(as, SLOTS, code[offset + 1] * VALUE_SIZE, RAX);
+            return offset + 2;
+        case OP_CALL_INLINE:
+        case OP_INVOKE_INLINE: {
+            int skip = offset + (instruction == OP_INVOKE_INLINE ? 4 : 3);
+            int body = skip + 2;
+            int end = body + (uint16_t)(code[skip] << 8 | code[skip + 1]);
+            asmMov(as, RDI, FRAME);
+            asmMovImm(as, RSI, (uint64_t)(uintptr_t)(code + offset));
+            emitHelperCall(jc, (void*)jitCallInline, code + body);
+            asmCmp32Imm(as, RAX, CALL_RETURNED);
+            asmJccTo(as, CC_B, jc->errorExit);
+            emitJumpTo(jc, asmJcc(as, CC_E), end);
+            asmCmp32Imm(as, RAX, CALL_PUSHED_FRAME);
+            asmJccTo(as, CC_E, jc->frameExit);
+            // CALL_INLINED: fall into the body
+            return body;
+        }
+        case OP_PEEK:
+            asmLoad(as, RAX, STACK_TOP, -(code[offset + 1] + 1) * VALUE_SIZE);
+            emitPush(as, RAX);
+            return offset + 2;
+        case OP_INLINE_RETURN:
+            asmLoad(as, RAX, STACK_TOP, -VALUE_SIZE);
+            asmSubImm(as, STACK_TOP, code[offset + 1] * VALUE_SIZE);
+            asmStore(as, STACK_TOP, -VALUE_SIZE, RAX);
+            return offset + 2;
+        default:
+            return -1;
+    }
+}
+
+static void initJitCompiler(JitCompiler* jc, ObjFunction* function) {
+    initAssembler(&jc->as);
+    jc->function = function;
+    jc->entries = NULL;
+    jc->jumps = NULL;
+    jc->jumpCount = 0;
+    jc->jumpCapacity = 0;
+    jc->trace = NULL;
+    jc->exits = NULL;
+    jc->exitCount = 0;
+    jc->exitCapacity = 0;
+    jc->depth = 0;
+}
+
+static JitCode* newJitCode(JitCompiler* jc, uint8_t* code) {
+    JitCode* jit = (JitCode*)malloc(sizeof(JitCode));
+    if (jit == NULL) exit(1);
+    jit->code = code;
+    jit->size = (size_t)jc->as.count;
+    jit->entries = jc->entries;
+    perfMapCode(code, jit->size, jc->function, jc->trace != NULL ? jc->trace->header : -1);
+    freeAssembler(&jc->as);
+    return jit;
+}
+
+bool jitCompile(ObjFunction* function) {
+    // whether it works out or not, never try again
+    function->callCount = -1;
+
+    JitCompiler jc;
+    initJitCompiler(&jc, function);
+    jc.entries = (uint32_t*)malloc(sizeof(uint32_t) * (function->chunk.count + 1));
+    if (jc.entries == NULL) return false;
+
+    emitPrologue(&jc);
+
+    bool supported = true;
+    for (int offset = 0; offset < function->chunk.count;) {
+        jc.entries[offset] = (uint32_t)jc.as.count;
+        offset = emitInstruction(&jc, offset);
+        if (offset < 0) {
+            supported = false;
+            break;
+        }
+    }
+
+    uint8_t* code = NULL;
+    if (supported) {
+        for (int i = 0; i < jc.jumpCount; i++) {
+            asmPatch(&jc.as, jc.jumps[i].position, (int)jc.entries[jc.jumps[i].target]);
+        }
+        code = asmFinalize(&jc.as);
+    }
+
+    free(jc.jumps);
+    if (code == NULL) {
+        free(jc.entries);
+        freeAssembler(&jc.as);
+        return false;
+    }
+
+    function->jit = newJitCode(&jc, code);
+    return true;
+}
+
+JitStatus jitExecute(CallFrame* frame) {
+    JitCode* jit = frame->closure->function->jit;
+    uint32_t target = jit->entries[frame->ip - frame->closure->function->chunk.code];
+    JitEntry entry = (JitEntry)(uintptr_t)jit->code;
+    return entry(frame, jit->code + target);
+}
+
+#ifdef TRACING_JIT
+
+// trace compilation
+// a trace is the straight-line sequence of instructions one iteration of a loop executed while it was recorded
+// branches become guards which leave the trace (side exit) when they go the other way,
+// and number operations are specialized on the types seen, with guards only where the type isn't known yet
+// all values stay in the VM stack like in the baseline templates, so a side exit only has to store the ip
+
+static bool tracePush(JitCompiler* jc, bool number) {
+    if (jc->depth == TRACE_MAX_DEPTH) return false;
+    jc->numbers[jc->depth++] = number;
+    return true;
+}
+
+// side exit unless `value` holds a number, the interpreter then redoes the instruction at `offset`
+static void emitNumberCheck(JitCompiler* jc, Register value, int offset) {
+    Assembler* as = &jc->as;
+    asmMovImm(as, RDX, QNAN);
+    asmMov(as, RSI, value);
+    asmAnd(as, RSI, RDX);
+    asmCmp(as, RSI, RDX);
+    emitSideExit(jc, asmJcc(as, CC_E), offset);
+}
+
+// a number operation whose operands were numbers while recording
+static void emitTraceNumberOp(JitCompiler* jc, OpCode op, OperandForm form, int a, int b, int offset) {
+    Assembler* as = &jc->as;
+    bool* known = jc->numbers;
+    bool knownA = form == OPERANDS_STACK ? known[jc->depth - 2] : known[a];
+    bool knownB;
+    switch (form) {
+        case OPERANDS_STACK: knownB = known[jc->depth - 1]; break;
+        case OPERANDS_LL:    knownB = known[b]; break;
+        default:             knownB = true; break; // a constant never changes its type
+    }
+
+    loadOperands(as, form, a, b);
+    if (!knownA) emitNumberCheck(jc, RAX, offset);
+    if (!knownB) emitNumberCheck(jc, RCX, offset);
+    emitNumberOp(as, op);
+    storeResult(as, form);
+
+    // past the guards, the locals are known to be numbers until they're assigned again
+    if (form != OPERANDS_STACK) known[a] = true;
+    if (form == OPERANDS_LL) known[b] = true;
+}
+
+// keep track of the stack (and what's known about it) for instructions compiled by their baseline template
+static bool traceStackEffect(JitCompiler* jc, uint8_t* ip) {
+    bool* known = jc->numbers;
+    switch (*ip) {
+        case OP_CONSTANT:
+            return tracePush(jc, IS_NUMBER(jc->function->chunk.constants.values[ip[1]]));
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_EQUAL_LL:
+        case OP_EQUAL_LK:
+        case OP_ADD_LL:
+        case OP_SUBTRACT_LL:
+        case OP_MULTIPLY_LL:
+        case OP_DIVIDE_LL:
+        case OP_LESS_LL:
+        case OP_GREATER_LL:
+        case OP_ADD_LK:
+        case OP_SUBTRACT_LK:
+        case OP_MULTIPLY_LK:
+        case OP_DIVIDE_LK:
+        case OP_LESS_LK:
+        case OP_GREATER_LK:
+            return tracePush(jc, false);
+        case OP_GET_LOCAL:
+            return tracePush(jc, known[ip[1]]);
+        case OP_PEEK:
+            return tracePush(jc, known[jc->depth - 1 - ip[1]]);
+        case OP_INLINE_RETURN: {
+            bool result = known[jc->depth - 1];
+            jc->depth -= ip[1];
+            known[jc->depth - 1] = result;
+            return true;
+        }
+        case OP_SET_LOCAL:
+            known[ip[1]] = known[jc->depth - 1];
+            return true;
+        case OP_STORE_LOCAL:
+            known[ip[1]] = known[jc->depth - 1];
+            jc->depth--;
+            return true;
+        case OP_SET_GLOBAL:
+            return true;
+        case OP_SET_UPVALUE:
+            // the upvalue may point right into this frame
+            for (int i = 0; i < jc->depth; i++) known[i] = false;
+            return true;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+            jc->depth--;
+            return true;
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE:
+            known[jc->depth - 1] = false;
+            return true;
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            jc->depth--;
+            known[jc->depth - 1] = false;
+            return true;
+        default:
+            // calls, returns and class definitions never make it into a trace
+            return false;
+    }
+}
+
+static bool emitTraceStep(JitCompiler* jc, TraceStep* step) {
+    Assembler* as = &jc->as;
+    uint8_t* code = jc->function->chunk.code;
+    int offset = step->offset;
+    uint8_t instruction = code[offset];
+    bool numbers = (step->observed & OBSERVED_NUMBERS) != 0;
+
+    switch (instruction) {
+        case OP_JUMP:
+            // the trace simply goes on with the next recorded instruction
+            return true;
+        case OP_JUMP_IF_FALSE: {
+            uint16_t jump = (uint16_t)(code[offset + 1] << 8 | code[offset + 2]);
+            asmLoad(as, RAX, STACK_TOP, -VALUE_SIZE);
+            emitFalseyTest(as);
+            if (step->observed & OBSERVED_FALSEY) {
+                emitSideExit(jc, asmJcc(as, CC_A), offset + 3);
+            } else {
+                emitSideExit(jc, asmJcc(as, CC_BE), offset + 3 + jump);
+            }
+            return true;
+        }
+        case OP_LOOP: {
+            uint16_t jump = (uint16_t)(code[offset + 1] << 8 | code[offset + 2]);
+            // the back-edges of a `for` loop's body and increment are two steps of the same iteration
+            if (offset + 4 - jump != jc->trace->header) return true;
+
+            // the back-edge closing the trace
+            asmMovImm(as, RAX, (uint64_t)(uintptr_t)&jc->trace->iterations);
+            asmIncrement(as, RAX, 0);
+            asmJmpTo(as, jc->traceStart);
+            return true;
+        }
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            if (!numbers) break;
+            emitTraceNumberOp(jc, instruction, OPERANDS_STACK, 0, 0, offset);
+            jc->depth--;
+            jc->numbers[jc->depth - 1] = instruction != OP_GREATER && instruction != OP_LESS;
+            return true;
+        case OP_ADD_LL:
+        case OP_SUBTRACT_LL:
+        case OP_MULTIPLY_LL:
+        case OP_DIVIDE_LL:
+        case OP_LESS_LL:
+        case OP_GREATER_LL:
+        case OP_ADD_LK:
+        case OP_SUBTRACT_LK:
+        case OP_MULTIPLY_LK:
+        case OP_DIVIDE_LK:
+        case OP_LESS_LK:
+        case OP_GREATER_LK: {
+            if (!numbers) break;
+            bool ll = instruction <= OP_GREATER_LL;
+            OpCode op = stackForm(instruction - (ll ? OP_ADD_LL : OP_ADD_LK));
+            emitTraceNumberOp(jc, op, ll ? OPERANDS_LL : OPERANDS_LK, code[offset + 1], code[offset + 2], offset);
+            return tracePush(jc, op != OP_GREATER && op != OP_LESS);
+        }
+        case OP_CALL_INLINE:
+        case OP_INVOKE_INLINE:
+            // the trace went on into the inlined body, leave it if the guard doesn't hold any more
+            asmMov(as, RDI, FRAME);
+            asmMovImm(as, RSI, (uint64_t)(uintptr_t)(code + offset));
+            emitHelperCall(jc, (void*)inlineGuardHolds, code + offset);
+            asmTestAl(as);
+            emitSideExit(jc, asmJcc(as, CC_E), offset);
+            return true;
+        case OP_NEGATE:
+            if (!numbers) break;
+            asmLoad(as, RAX, STACK_TOP, -VALUE_SIZE);
+            if (!jc->numbers[jc->depth - 1]) emitNumberCheck(jc, RAX, offset);
+            asmFlipSign(as, RAX);
+            asmStore(as, STACK_TOP, -VALUE_SIZE, RAX);
+            jc->numbers[jc->depth - 1] = true;
+            return true;
+    }
+
+    // everything else is compiled by its baseline template
+    if (!traceStackEffect(jc, code + offset)) return false;
+    return emitInstruction(jc, offset) >= 0;
+}
+
+JitCode* jitCompileTrace(ObjFunction* function, Trace* trace) {
+    if (trace->entryDepth > TRACE_MAX_DEPTH) return NULL;
+
+    JitCompiler jc;
+    initJitCompiler(&jc, function);
+    jc.trace = trace;
+    jc.depth = trace->entryDepth;
+    for (int i = 0; i < jc.depth; i++) jc.numbers[i] = false;
+
+    emitPrologue(&jc);
+    jc.sideExit = jc.as.count;
+    asmStore(&jc.as, FRAME, offsetof(CallFrame, ip), RAX);
+    asmStore(&jc.as, VM_STATE, offsetof(VM, stackTop), STACK_TOP);
+    asmMovImm(&jc.as, RAX, JIT_INTERPRET);
+    asmJmpTo(&jc.as, jc.epilogue);
+
+    jc.traceStart = jc.as.count;
+    bool supported = true;
+    for (int i = 0; i < trace->length; i++) {
+        if (!emitTraceStep(&jc, &trace->steps[i])) {
+            supported = false;
+            break;
+        }
+    }
+
+    uint8_t* code = NULL;
+    if (supported) {
+        // one stub per side exit, loading the ip the interpreter resumes at
+        for (int i = 0; i < jc.exitCount; i++) {
+            asmPatch(&jc.as, jc.exits[i].position, jc.as.count);
+            asmMovImm(&jc.as, RAX, (uint64_t)(uintptr_t)(function->chunk.code + jc.exits[i].target));
+            asmJmpTo(&jc.as, jc.sideExit);
+        }
+        code = asmFinalize(&jc.as);
+    }
+
+    free(jc.jumps);
+    free(jc.exits);
+    if (code == NULL) {
+        freeAssembler(&jc.as);
+        return NULL;
+    }
+
+    // a trace has a single entry point
+    jc.entries = (uint32_t*)malloc(sizeof(uint32_t));
+    if (jc.entries == NULL) exit(1);
+    jc.entries[0] = (uint32_t)jc.traceStart;
+    return newJitCode(&jc, code);
+}
+
+JitStatus jitExecuteTrace(CallFrame* frame, JitCode* code) {
+    JitEntry entry = (JitEntry)(uintptr_t)code->code;
+    return entry(frame, code->code + code->entries[0]);
+}
+
+#endif
+
+void jitFree(JitCode* jit) {
+    if (jit == NULL) return;
+    asmFreeCode(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// a function is compiled to machine code once it has been called this many times
+#define JIT_HOT_CALLS 100
+
+// native code compiled from a function's chunk
+typedef struct JitCode {
+    uint8_t* code; // executable memory, starts with the entry sequence shared by all instructions
+    size_t size;
+    uint32_t* entries; // native offset of every instruction, indexed by its bytecode offset
+} JitCode;
+
+// why compiled code handed control back to `run()`
+typedef enum {
+    JIT_FRAME_CHANGED, // a call pushed or a return popped a CallFrame, go on with the topmost one
+    JIT_RUNTIME_ERROR, // a runtime error has been reported
+    JIT_FINISHED, // the outermost CallFrame returned
+    JIT_INTERPRET, // a trace left through a side exit, go on interpreting at frame->ip
+} JitStatus;
+
+struct Trace;
+
+bool jitCompile(ObjFunction* function);
+JitStatus jitExecute(CallFrame* frame);
+// compile a recorded loop trace, NULL if it can't be
+JitCode* jitCompileTrace(ObjFunction* function, struct Trace* trace);
+JitStatus jitExecuteTrace(CallFrame* frame, JitCode* code);
+void jitFree(JitCode* code);
+
+#endif
@@ -3,11 +3,19 @@
 #include <string.h>
 
 #include "common.h"
+#include "allocprof.h"
+#include "callprof.h"
 #include "chunk.h"
+#include "cpuprof.h"
 #include "debug.h"
+#include "marker.h"
+#include "memory.h"
+#include "opstats.h"
+#include "perfcount.h"
+#include "perfmap.h"
 #include "vm.h"
 
-static void repl() {
+static void repl(VM* vm) {
     char line[1024];
     for (;;) {
         printf("> ");
@@ -17,7 +25,7 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        interpret(vm, line);
     }
 }
 
@@ -49,29 +57,194 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
+static InterpretResult runFile(VM* vm, const char* path) {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    InterpretResult result = interpret(vm, source);
     free(source);
+    return result;
+}
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+// a number of bytes, optionally followed by k, m or g
+static size_t parseBytes(const char* text) {
+    char* end;
+    double bytes = strtod(text, &end);
+    switch (*end) {
+        case 'k': case 'K': bytes *= 1024; end++; break;
+        case 'm': case 'M': bytes *= 1024 * 1024; end++; break;
+        case 'g': case 'G': bytes *= 1024 * 1024 * 1024; end++; break;
+    }
+    if (end == text || *end != '\0' || bytes < 0) {
+        fprintf(stderr, "Not a number of bytes: \"%s\".\n", text);
+        exit(64);
+    }
+    return (size_t)bytes;
 }
 
+int main(int argc, const char* argv[]) {
+    VM* vm = newVM();
+
+    const char* path = NULL;
+    const char* allocPath = NULL;
+    size_t allocSample = ALLOC_SAMPLE_BYTES;
+    const char* callPath = NULL;
+    const char* cpuPath = NULL;
+    int cpuHz = CPU_PROFILE_HZ;
+    const char* perfPath = NULL;
+    const char* opcodePath = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-jit") == 0) {
+            vm->jitEnabled = false;
+        } else if (strcmp(argv[i], "--print-code") == 0) {
+            vm->printCode = true;
+        } else if (strcmp(argv[i], "--trace-execution") == 0) {
+            // compiled code runs without the dispatch loop that does the tracing
+            vm->traceExecution = true;
+            vm->jitEnabled = false;
+        } else if (strcmp(argv[i], "--perf-map") == 0) {
+#ifdef BASELINE_JIT
+            if (!openPerfMap()) {
+                perror("Could not create the perf map");
+                exit(74);
+            }
+#else
+            fprintf(stderr, "--perf-map needs the JIT, which isn't supported on this platform.\n");
+            exit(64);
+#endif
+        } else if (strcmp(argv[i], "--trace-stats") == 0) {
+            vm->traceStats = true;
+        } else if (strcmp(argv[i], "--no-inline") == 0) {
+            vm->inlineEnabled = false;
+        } else if (strcmp(argv[i], "--inline-report") == 0) {
+            vm->inlineReport = true;
+        } else if (strcmp(argv[i], "--concurrent-gc") == 0) {
+            vm->concurrentGC = true;
+        } else if (strcmp(argv[i], "--compact") == 0) {
+            vm->compactGC = true;
+        } else if (strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc) {
+            vm->gcThreads = atoi(argv[++i]);
+            if (vm->gcThreads < 1 || vm->gcThreads > GC_MAX_THREADS) {
+                fprintf(stderr, "--gc-threads takes 1 to %d.\n", GC_MAX_THREADS);
+                exit(64);
+            }
+        } else if (strcmp(argv[i], "--gc-grow") == 0 && i + 1 < argc) {
+            vm->gcGrowFactor = vm->gcGrowth = atof(argv[++i]);
+            if (vm->gcGrowFactor <= 1 || vm->gcGrowFactor > GC_HEAP_GROW_MAX) {
+                fprintf(stderr, "--gc-grow takes a factor above 1 and at most %d.\n", GC_HEAP_GROW_MAX);
+                exit(64);
+            }
+        } else if (strcmp(argv[i], "--gc-target") == 0 && i + 1 < argc) {
+            vm->gcTarget = atof(argv[++i]);
+            if (vm->gcTarget < 0 || vm->gcTarget >= 100) {
+                fprintf(stderr, "--gc-target takes a percentage from 0 to below 100.\n");
+                exit(64);
+            }
+        } else if (strcmp(argv[i], "--gc-min-heap") == 0 && i + 1 < argc) {
+            vm->gcMinHeap = parseBytes(argv[++i]);
+        } else if (strcmp(argv[i], "--gc-max-heap") == 0 && i + 1 < argc) {
+            vm->gcMaxHeap = parseBytes(argv[++i]);
+        } else if (strcmp(argv[i], "--gc-stats") == 0 && i + 1 < argc) {
+            vm->gcStats.dumpPath = argv[++i];
+        } else if (strcmp(argv[i], "--gc-trace") == 0 && i + 1 < argc) {
+            if (!openGcTrace(&vm->gcStats, argv[++i])) {
+                fprintf(stderr, "Could not open \"%s\".\n", argv[i]);
+                exit(74);
+            }
+        } else if (strcmp(argv[i], "--alloc-profile") == 0 && i + 1 < argc) {
+            allocPath = argv[++i];
+        } else if (strcmp(argv[i], "--alloc-sample") == 0 && i + 1 < argc) {
+            allocSample = parseBytes(argv[++i]);
+            if (allocSample < 1) {
+                fprintf(stderr, "--alloc-sample takes 1 byte or more.\n");
+                exit(64);
+            }
+        } else if (strcmp(argv[i], "--call-profile") == 0 && i + 1 < argc) {
+            callPath = argv[++i];
+        } else if (strcmp(argv[i], "--cpu-profile") == 0 && i + 1 < argc) {
+            cpuPath = argv[++i];
+        } else if (strcmp(argv[i], "--cpu-profile-hz") == 0 && i + 1 < argc) {
+            cpuHz = atoi(argv[++i]);
+            if (cpuHz < 1 || cpuHz > 10000) {
+                fprintf(stderr, "--cpu-profile-hz takes 1 to 10000 samples a second.\n");
+                exit(64);
+            }
+        } else if (strcmp(argv[i], "--perf-counters") == 0 && i + 1 < argc) {
+            perfPath = argv[++i];
+        } else if (strcmp(argv[i], "--opcode-stats") == 0 && i + 1 < argc) {
+            opcodePath = argv[++i];
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "Usage: clox [--print-code] [--trace-execution] [--no-jit] [--perf-map] [--trace-stats] [--no-inline]\n"
+                            "            [--inline-report] [--gc-threads n] [--concurrent-gc] [--compact] [--gc-grow factor]\n"
+                            "            [--gc-target percent] [--gc-min-heap bytes] [--gc-max-heap bytes] [--gc-stats file]\n"
+                            "            [--gc-trace file] [--alloc-profile file] [--alloc-sample bytes] [--call-profile file]\n"
+                            "            [--cpu-profile file] [--cpu-profile-hz n] [--perf-counters file] [--opcode-stats file] [path]\n");
+            exit(64);
+        }
+    }
 
+    // the collector thread frees instances while the program runs, the blocks of a compacting VM aren't thread-safe
+    if (vm->concurrentGC && vm->compactGC) {
+        fprintf(stderr, "--compact can't be combined with --concurrent-gc.\n");
+        exit(64);
+    }
 
-int main(int argc, const char* argv[]) {
-    initVM();
+    if (vm->gcMaxHeap > 0 && vm->gcMinHeap > vm->gcMaxHeap) {
+        fprintf(stderr, "--gc-min-heap can't be above --gc-max-heap.\n");
+        exit(64);
+    }
+    // the first collection waits for the heap to reach its minimum
+    vm->nextGC = vm->gcMinHeap;
+    if (allocPath != NULL) vm->allocProfile = newAllocProfile(allocPath, allocSample);
+    if (callPath != NULL) {
+        // an inlined call has no frame of its own, its time would go to the caller
+        vm->inlineEnabled = false;
+        // compiled code would skip the instrumented loop, which times the calls
+        vm->jitEnabled = false;
+        vm->callProfile = newCallProfile(callPath);
+    }
+    if (cpuPath != NULL) {
+#ifdef CPU_PROFILER
+        if (!startCpuProfile(vm, cpuPath, cpuHz)) {
+            fprintf(stderr, "Could not start the CPU profiler.\n");
+            exit(71);
+        }
+#else
+        fprintf(stderr, "--cpu-profile isn't supported on this platform.\n");
+        exit(64);
+#endif
+    }
+    if (perfPath != NULL) {
+#ifdef PERF_COUNTERS
+        if (!startPerfCounters(vm, perfPath)) {
+            perror("Could not open the performance counters");
+            exit(71);
+        }
+#else
+        fprintf(stderr, "--perf-counters isn't supported on this platform.\n");
+        exit(64);
+#endif
+    }
+    if (opcodePath != NULL) {
+#ifdef OPCODE_STATS
+        // compiled code doesn't go through `run`, where the instructions are counted
+        vm->jitEnabled = false;
+        vm->opcodeStats = newOpcodeStats(opcodePath);
+#else
+        fprintf(stderr, "--opcode-stats needs the clox_stats build.\n");
+        exit(64);
+#endif
+    }
 
-    if(argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    InterpretResult result = INTERPRET_OK;
+    if (path == NULL) {
+        repl(vm);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        result = runFile(vm, path);
     }
 
-    freeVM();
+    freeVM(vm);
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,258 @@
+#include "common.h"
+#include "marker.h"
+
+#ifdef PARALLEL_MARK
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "vm.h"
+
+// Parallel mark phase (see PARALLEL_MARK).
+// The collecting thread marks the roots as usual, deals `vm->grayStack` out among the markers,
+// and marks along with the helper threads until every marker runs out of gray objects.
+//
+// A marker pushes and pops its own gray objects without any lock. Once it has plenty, it moves the
+// oldest ones (the ones likely to lead to the most work) to its shared deque, where idle markers
+// steal half of them at a time, so one marker with a deep object graph doesn't mark it alone.
+// Mark bits are flipped with an atomic exchange, the thread that flips one grays the object.
+//
+// Marking is over once every marker is idle at the same time: an idle marker has no gray objects,
+// and only a busy marker makes new ones, so there's none left anywhere.
+
+typedef struct {
+    struct MarkPool* pool;
+    Obj** stack; // its own gray objects
+    int count;
+    int capacity;
+
+    pthread_mutex_t lock; // guards `shared`
+    Obj** shared; // gray objects the others may steal
+    int sharedCapacity;
+    atomic_int sharedCount; // read without the lock, to find a deque worth locking
+} Marker;
+
+typedef struct MarkPool {
+    VM* vm;
+    int count; // markers, the collecting thread is `markers[0]`, the rest have a helper thread of their own
+    Marker* markers;
+    pthread_t* threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // a new round of marking, or quitting
+    pthread_cond_t finished; // the last helper is done with the round
+    int round;
+    int busy; // helpers still marking in this round
+    bool quit;
+
+    atomic_int idle; // markers out of gray objects
+} MarkPool;
+
+// the marker the calling thread is, during a parallel mark phase
+static _Thread_local Marker* marker = NULL;
+
+int gcThreadsAvailable() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return 1;
+    return cpus > GC_MAX_THREADS ? GC_MAX_THREADS : (int)cpus;
+}
+
+// note: plain `realloc` like the gray stack, marking mustn't allocate from the heap it's marking
+static void reserveGray(Obj*** stack, int* capacity, int count) {
+    if (count <= *capacity) return;
+    while (*capacity < count) *capacity = GROW_CAPACITY(*capacity);
+    *stack = (Obj**)realloc(*stack, sizeof(Obj*) * *capacity);
+    if (*stack == NULL) exit(1);
+}
+
+// move the bottom GC_MARK_SPILL gray objects to the shared deque, only while it's empty
+static void spill(Marker* self) {
+    if (atomic_load_explicit(&self->sharedCount, memory_order_relaxed) != 0) return;
+
+    pthread_mutex_lock(&self->lock);
+    reserveGray(&self->shared, &self->sharedCapacity, GC_MARK_SPILL);
+    memcpy(self->shared, self->stack, sizeof(Obj*) * GC_MARK_SPILL);
+    atomic_store_explicit(&self->sharedCount, GC_MARK_SPILL, memory_order_relaxed);
+    pthread_mutex_unlock(&self->lock);
+
+    self->count -= GC_MARK_SPILL;
+    memmove(self->stack, self->stack + GC_MARK_SPILL, sizeof(Obj*) * self->count);
+}
+
+bool markerGray(Obj* object) {
+    Marker* self = marker;
+    if (self == NULL) return false;
+    if (atomic_exchange_explicit(&object->isMarked, true, memory_order_relaxed)) return true;
+
+    reserveGray(&self->stack, &self->capacity, self->count + 1);
+    self->stack[self->count++] = object;
+    if (self->count >= GC_MARK_SPILL * 2) spill(self);
+    return true;
+}
+
+// move half of `victim`'s shared gray objects (at least one) to the stack of `self`
+// `victim` may be `self`, taking back the ones nobody stole
+static bool steal(Marker* self, Marker* victim) {
+    if (atomic_load_explicit(&victim->sharedCount, memory_order_relaxed) == 0) return false;
+
+    pthread_mutex_lock(&victim->lock);
+    int count = atomic_load_explicit(&victim->sharedCount, memory_order_relaxed);
+    int taken = victim == self ? count : (count + 1) / 2;
+    if (taken > 0) {
+        reserveGray(&self->stack, &self->capacity, self->count + taken);
+        memcpy(self->stack + self->count, victim->shared + count - taken, sizeof(Obj*) * taken);
+        self->count += taken;
+        atomic_store_explicit(&victim->sharedCount, count - taken, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&victim->lock);
+    return taken > 0;
+}
+
+static bool stealAny(Marker* self) {
+    MarkPool* pool = self->pool;
+    int index = (int)(self - pool->markers);
+    // start with the next marker, so thieves don't all pile onto the first deque
+    for (int i = 1; i < pool->count; i++) {
+        if (steal(self, &pool->markers[(index + i) % pool->count])) return true;
+    }
+    return false;
+}
+
+static bool anyShared(MarkPool* pool) {
+    for (int i = 0; i < pool->count; i++) {
+        if (atomic_load_explicit(&pool->markers[i].sharedCount, memory_order_relaxed) > 0) return true;
+    }
+    return false;
+}
+
+static void drain(Marker* self) {
+    MarkPool* pool = self->pool;
+    marker = self;
+    for (;;) {
+        while (self->count > 0 || steal(self, self)) {
+            blackenObject(self->stack[--self->count]);
+        }
+
+        atomic_fetch_add_explicit(&pool->idle, 1, memory_order_acq_rel);
+        for (;;) {
+            if (atomic_load_explicit(&pool->idle, memory_order_acquire) == pool->count) {
+                marker = NULL;
+                return;
+            }
+            if (anyShared(pool)) {
+                // busy again before holding any gray object, or the others could think marking is over
+                atomic_fetch_sub_explicit(&pool->idle, 1, memory_order_acq_rel);
+                if (stealAny(self)) break;
+                atomic_fetch_add_explicit(&pool->idle, 1, memory_order_acq_rel);
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void* helperMain(void* arg) {
+    Marker* self = (Marker*)arg;
+    MarkPool* pool = self->pool;
+    vm = pool->vm;
+
+    int round = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->round == round && !pool->quit) pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit) break;
+        round = pool->round;
+        pthread_mutex_unlock(&pool->lock);
+
+        drain(self);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) pthread_cond_signal(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static MarkPool* newMarkPool(int count) {
+    MarkPool* pool = (MarkPool*)calloc(1, sizeof(MarkPool));
+    if (pool == NULL) exit(1);
+    pool->vm = vm;
+    pool->count = count;
+    pool->markers = (Marker*)calloc(count, sizeof(Marker));
+    pool->threads = (pthread_t*)calloc(count, sizeof(pthread_t));
+    if (pool->markers == NULL || pool->threads == NULL) exit(1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    for (int i = 0; i < count; i++) {
+        pool->markers[i].pool = pool;
+        pthread_mutex_init(&pool->markers[i].lock, NULL);
+    }
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, helperMain, &pool->markers[i]) != 0) {
+            fprintf(stderr, "Could not start GC thread %d.\n", i);
+            exit(71);
+        }
+    }
+    return pool;
+}
+
+void markParallel() {
+    if (vm->markPool == NULL) vm->markPool = newMarkPool(vm->gcThreads);
+    MarkPool* pool = vm->markPool;
+
+    // deal the roots out round-robin
+    for (int i = 0; i < vm->grayCount; i++) {
+        Marker* to = &pool->markers[i % pool->count];
+        reserveGray(&to->stack, &to->capacity, to->count + 1);
+        to->stack[to->count++] = vm->grayStack[i];
+    }
+    vm->grayCount = 0;
+    atomic_store_explicit(&pool->idle, 0, memory_order_relaxed);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->busy = pool->count - 1;
+    pool->round++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    drain(&pool->markers[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void freeMarkers() {
+    MarkPool* pool = vm->markPool;
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for (int i = 0; i < pool->count; i++) {
+        pthread_mutex_destroy(&pool->markers[i].lock);
+        free(pool->markers[i].stack);
+        free(pool->markers[i].shared);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->finished);
+    free(pool->markers);
+    free(pool->threads);
+    free(pool);
+    vm->markPool = NULL;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef clox_marker_h
+#define clox_marker_h
+
+#include "common.h"
+#include "object.h"
+
+// more threads than this rarely pay off, the heap is only so wide
+#define GC_MAX_THREADS 8
+// a heap smaller than this is marked by the collecting thread alone, waking the others costs more
+#define GC_PARALLEL_MIN_HEAP (4 * 1024 * 1024)
+// a marker keeps twice this many gray objects to itself, beyond that it offers this many to the others
+#define GC_MARK_SPILL 128
+
+struct MarkPool;
+
+// the default number of marking threads: one per core, up to GC_MAX_THREADS
+int gcThreadsAvailable();
+// during a parallel mark phase: gray `object` on the calling marker's stack, unless another thread beat it to it
+// false outside of one, `markObject` then grays it the serial way
+bool markerGray(Obj* object);
+// blacken everything reachable from `vm->grayStack` with `vm->gcThreads` threads, the mutator waits
+void markParallel();
+// stop and join the marking threads, once the VM is freed
+void freeMarkers();
+
+#endif
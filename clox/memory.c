@@ -1,29 +1,33 @@
+#include <stdio.h>
 #include <stdlib.h>
-
+#include <string.h>
+#include <time.h>
+
+#include "callprof.h"
+#include "collector.h"
+#include "compactor.h"
+#include "cpuprof.h"
+#include "jit.h"
+#include "marker.h"
 #include "memory.h"
+#include "opstats.h"
+#include "scheduler.h"
+#include "trace.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
-
 // handle all dynamic memory operation
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
-
-    // only trigger GC when expanding, since GC itself will call `reallocate` to free or shrink
-    if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-        collectGarbage();
+#ifdef CONCURRENT_GC
+    if (newSize == 0 && collectorFree(pointer, oldSize)) return NULL;
 #endif
+    vm->bytesAllocated += newSize - oldSize;
 
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
-        }
-    }
+    // only trigger GC when expanding, since GC itself will call `reallocate` to free or shrink
+    if (newSize > oldSize) collectIfDue();
 
     if (newSize == 0) {
         free(pointer);
@@ -36,10 +40,25 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+void collectIfDue() {
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#endif
+
+    if (vm->bytesAllocated > vm->nextGC) {
+        collectGarbage();
+    }
+}
+
 void markObject(Obj* object) {
     if (object == NULL) return;
     // ensure GC won't stuck in reference cycles
-    if (object->isMarked) return;
+    // note: just a load, a shared string (see intern.c) is never written
+    if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) return;
+#ifdef PARALLEL_MARK
+    // a marking thread grays it on its own stack
+    if (markerGray(object)) return;
+#endif
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -47,19 +66,19 @@ void markObject(Obj* object) {
     printf("\n");
 #endif
 
-    object->isMarked = true;
+    atomic_store_explicit(&object->isMarked, true, memory_order_relaxed);
 
     // put gray objects in the worklist
     // note: use stack here since it's the simplest to implement with a dynamic array in C
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
         // use system `realloc`, not our own `reallocate`: prevent recursive GC invoke
-        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+        vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
 
-        if (vm.grayStack == NULL) exit(1);
+        if (vm->grayStack == NULL) exit(1);
     }
 
-    vm.grayStack[vm.grayCount++] = object;
+    vm->grayStack[vm->grayCount++] = object;
 }
 
 // only heap objects need to be marked
@@ -76,7 +95,7 @@ static void markArray(ValueArray* array) {
 // turn white objects gray, gray objects black
 // definition of black: `isMarked == true` and no longer in the gray stack
 // trace outgoing references by type
-static void blackenObject(Obj* object) {
+void blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     printValue(OBJ_VAL(object));
@@ -100,7 +119,24 @@ static void blackenObject(Obj* object) {
             ObjClosure* closure = (ObjClosure*) object;
             markObject((Obj*)closure->function);
             for (int i = 0; i < closure->upvalueCount; i++) {
-                markObject((Obj*)closure->upvalues[i]);
+                markObject((Obj*)SHARED_LOAD(closure->upvalues[i]));
+            }
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            markObject((Obj*)fiber->closure);
+            markObject((Obj*)fiber->caller);
+            // its own stacks while suspended, its resumer's while running, the same roots either way
+            for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+                markValue(*slot);
+            }
+            for (int i = 0; i < fiber->frameCount; i++) {
+                markObject((Obj*)fiber->frames[i].closure);
+                markObject((Obj*)fiber->frames[i].generator);
+            }
+            for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+                markObject((Obj*)upvalue);
             }
             break;
         }
@@ -110,6 +146,17 @@ static void blackenObject(Obj* object) {
             markArray(&function->chunk.constants);
             break;
         }
+        case OBJ_GENERATOR: {
+            ObjGenerator* generator = (ObjGenerator*)object;
+            markObject((Obj*)generator->closure);
+            for (int i = 0; i < generator->slotCount; i++) {
+                markValue(generator->slots[i]);
+            }
+            for (ObjUpvalue* upvalue = generator->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+                markObject((Obj*)upvalue);
+            }
+            break;
+        }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*) object;
             markObject((Obj*)instance->klass);
@@ -119,7 +166,9 @@ static void blackenObject(Obj* object) {
         }
         case OBJ_UPVALUE:
             // note: when upvalue is still open, `closed` is NIL_VAL, so only closed upvalue will be marked
-            markValue(((ObjUpvalue*)object)->closed);
+            markValue(SHARED_LOAD(((ObjUpvalue*)object)->closed));
+            // an open upvalue keeps the stack it points into alive, even once its owner is otherwise unreachable
+            markObject(SHARED_LOAD(((ObjUpvalue*)object)->owner));
             break;
         case OBJ_NATIVE:
         case OBJ_STRING:
@@ -128,10 +177,11 @@ static void blackenObject(Obj* object) {
 }
 
 // type-specific code to handle each object type's special needs of freeing
-static void freeObject(Obj* object) {
+void freeObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)object, object->type);
 #endif
+    vm->gcStats.freed[object->type]++;
 
     switch (object->type) {
         case OBJ_BOUND_METHOD: {
@@ -154,18 +204,48 @@ static void freeObject(Obj* object) {
             FREE(ObjClosure, object);
             break;
         }
+        case OBJ_FIBER: {
+            // the stacks may be the ones of the fiber's resumer (see ObjFiber), every stack is counted the same
+            ObjFiber* fiber = (ObjFiber*)object;
+            FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+            FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+            FREE(ObjFiber, object);
+            break;
+        }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
+#ifdef BASELINE_JIT
+            jitFree(function->jit);
+#endif
+#ifdef TRACING_JIT
+            freeTraces(function->traces, function->loopCount);
+#endif
+            if (vm->callProfile != NULL) freeCallStats(function);
+#ifdef OPCODE_STATS
+            if (vm->opcodeStats != NULL) vm->opcodeStats->freedInstructions += function->instructions;
+#endif
             // note: function name (ObjString) will be handled by garbage collector (once we have one)
             FREE(ObjFunction, object);
             break;
         }
+        case OBJ_GENERATOR: {
+            // the saved window is plain `malloc`ed, like the stacks it's copied from and to
+            free(((ObjGenerator*)object)->slots);
+            FREE(ObjGenerator, object);
+            break;
+        }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             // note: only freeing the entry (pointer) array, not the actual entries in the table
             // because there may be other references to these objects, just leave them to GC
             freeTable(&instance->fields);
+#ifdef COMPACTING_GC
+            if (vm->compactGC) {
+                freeInstance(instance);
+                break;
+            }
+#endif
             FREE(ObjInstance, object);
             break;
         }
@@ -186,48 +266,67 @@ static void freeObject(Obj* object) {
     }
 }
 
-static void markRoots() {
+void markRoots() {
     // (Lox) Value on stack
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
         markValue(*slot);
     }
 
     // ObjClosure
-    for (int i = 0; i < vm.frameCount; i++) {
-        markObject((Obj*)vm.frames[i].closure);
+    for (int i = 0; i < vm->frameCount; i++) {
+        markObject((Obj*)vm->frames[i].closure);
+        markObject((Obj*)vm->frames[i].generator);
     }
 
     // ObjUpvalue
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
         markObject((Obj*)upvalue);
     }
 
+    // the running fiber holds the stacks of whoever resumed it, and so on down to the main program's
+    markObject((Obj*)vm->fiber);
+#ifdef ASYNC_IO
+    // fibers parked in the event loop
+    markScheduler();
+#endif
+#ifdef CPU_PROFILER
+    // the functions of the sampled stacks, their names are written out at the end
+    markCpuProfile();
+#endif
+
     // globals
-    markTable(&vm.globals);
+    markTable(&vm->globals);
+    markTable(&vm->natives);
 
     // GC can also begin during compilation. Any value the compiler directly accesses is also root.
     markCompilerRoots();
 
     // initString should stick around and not cleaned during the whole compiling and runtime
-    markObject((Obj*)vm.initString);
+    markObject((Obj*)vm->initString);
 }
 
-static void traceReferences() {
-    while (vm.grayCount > 0) {
-        Obj* object = vm.grayStack[--vm.grayCount];
+void traceReferences() {
+#ifdef PARALLEL_MARK
+    if (vm->gcThreads > 1 && vm->bytesAllocated >= GC_PARALLEL_MIN_HEAP) {
+        markParallel();
+        return;
+    }
+#endif
+    while (vm->grayCount > 0) {
+        Obj* object = vm->grayStack[--vm->grayCount];
         blackenObject(object);
     }
 }
 
-// delete every unreachable object from `vm.objects` and free it
+// delete every unreachable object from `vm->objects` and free it
 // also resets `isMarked` for reachable objects to prepare for next run of GC
 static void sweep() {
     Obj* previous = NULL;
-    Obj* object = vm.objects;
+    Obj* object = vm->objects;
     while (object != NULL) {
-        if (object->isMarked) {
+        if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) {
             // reset `isMarked` for reachable objects
-            object->isMarked = false;
+            atomic_store_explicit(&object->isMarked, false, memory_order_relaxed);
             previous = object;
             object = object->next;
         } else {
@@ -237,7 +336,7 @@ static void sweep() {
             if (previous != NULL) {
                 previous->next = object;
             } else {
-                vm.objects = object;
+                vm->objects = object;
             }
 
             freeObject(unreached);
@@ -245,35 +344,164 @@ static void sweep() {
     }
 }
 
-void collectGarbage() {
+double gcClock() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+void applyHeapLimits() {
+    if (vm->nextGC < vm->gcMinHeap) vm->nextGC = vm->gcMinHeap;
+    if (vm->gcMaxHeap > 0 && vm->nextGC > vm->gcMaxHeap) vm->nextGC = vm->gcMaxHeap;
+}
+
+void sizeHeap(double gcSeconds, double pausedSeconds) {
+    double now = gcClock();
+    double mutatorSeconds = now - vm->gcIdleSince - pausedSeconds;
+    vm->gcIdleSince = now;
+
+    if (vm->bytesAllocated < GC_ADAPT_HEAP) {
+        vm->gcGrowth = vm->gcGrowFactor;
+    } else if (vm->gcTarget > 0 && gcSeconds > 0 && mutatorSeconds > 0) {
+        // the program runs for about `growth - 1` times the heap left between two collections,
+        // and collecting the same heap costs about the same every time:
+        // scale the growth by how far the collection's share of the time was off the target
+        double share = gcSeconds / (gcSeconds + mutatorSeconds);
+        double target = vm->gcTarget / 100;
+        double growth = (vm->gcGrowth - 1) * (share / (1 - share)) * ((1 - target) / target);
+        // only go halfway there, one odd collection shouldn't swing the heap size
+        growth = 1 + ((vm->gcGrowth - 1) + growth) / 2;
+        if (growth < vm->gcGrowFactor) growth = vm->gcGrowFactor;
+        if (growth > GC_HEAP_GROW_MAX) growth = GC_HEAP_GROW_MAX;
+        vm->gcGrowth = growth;
+    }
+
+    if (vm->gcMaxHeap > 0 && vm->bytesAllocated > vm->gcMaxHeap) {
+        fprintf(stderr, "Out of memory: %zu bytes still in use after a collection, the heap limit is %zu.\n",
+                vm->bytesAllocated, vm->gcMaxHeap);
+        exit(1);
+    }
+    vm->nextGC = (size_t)(vm->bytesAllocated * vm->gcGrowth);
+    applyHeapLimits();
+}
+
+// a stop-the-world collection
+static void collectFully() {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
+    size_t before = vm->bytesAllocated;
 #endif
+    double start = gcClock();
+    size_t allocated = vm->bytesAllocated;
 
     markRoots();
     traceReferences();
     // note: hash table keys are weak references
-    tableRemoveWhite(&vm.strings);
+    tableRemoveWhite(&vm->strings);
     sweep();
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    double end = gcClock();
+    sizeHeap(end - start, end - start);
+    vm->gcStats.collections++;
+    vm->gcStats.bytesFreed += allocated - vm->bytesAllocated;
+    recordPause("collect", start, end);
+#ifdef COMPACTING_GC
+    // the instances can't move yet, whoever allocated may hold one (see compactor.c)
+    if (vm->compactGC) checkFragmentation();
+#endif
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
     printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+           before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+void collectGarbage() {
+#ifdef CONCURRENT_GC
+    // the compiler grows the constants of the functions it's working on, the collector thread mustn't read them
+    if (vm->concurrentGC && !isCompiling()) {
+        collectConcurrently();
+        return;
+    }
+    finishConcurrentCycle();
 #endif
+    collectFully();
+}
+
+void collectNow() {
+#ifdef CONCURRENT_GC
+    finishConcurrentCycle();
+#endif
+    collectFully();
+}
+
+// gcCollect(): collect right away, evaluates to the number of bytes freed
+static Value gcCollectNative(int argCount, Value* args) {
+    if (argCount != 0) return nativeError("gcCollect() takes no arguments but got %d.", argCount);
+    size_t before = vm->bytesAllocated;
+    collectNow();
+    return NUMBER_VAL(before > vm->bytesAllocated ? (double)(before - vm->bytesAllocated) : 0);
+}
+
+// gcTune(setting, [value]): evaluates to a setting of the collector, and changes it if given a value
+//   "growFactor": the least the heap grows by between two collections
+//   "target": percent of the time to spend collecting at most (0: always grow by "growFactor")
+//   "minHeap", "maxHeap": bytes (a "maxHeap" of 0: no limit)
+static Value gcTuneNative(int argCount, Value* args) {
+    if (argCount < 1 || argCount > 2 || !IS_STRING(args[0])) return nativeError("gcTune() takes a setting and a value.");
+    if (argCount == 2 && (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 0)) {
+        return nativeError("A GC setting takes a number, 0 or more.");
+    }
+    const char* setting = AS_CSTRING(args[0]);
+    bool set = argCount == 2;
+    double value = set ? AS_NUMBER(args[1]) : 0;
+
+    double old;
+    if (strcmp(setting, "growFactor") == 0) {
+        old = vm->gcGrowFactor;
+        if (set && (value <= 1 || value > GC_HEAP_GROW_MAX)) {
+            return nativeError("The grow factor must be above 1 and at most %d.", GC_HEAP_GROW_MAX);
+        }
+        if (set) vm->gcGrowFactor = vm->gcGrowth = value;
+    } else if (strcmp(setting, "target") == 0) {
+        old = vm->gcTarget;
+        if (set && value >= 100) return nativeError("The GC target must be below 100 percent.");
+        if (set) vm->gcTarget = value;
+    } else if (strcmp(setting, "minHeap") == 0) {
+        old = (double)vm->gcMinHeap;
+        if (set && vm->gcMaxHeap > 0 && (size_t)value > vm->gcMaxHeap) {
+            return nativeError("The minimum heap can't be above the maximum heap.");
+        }
+        if (set) vm->gcMinHeap = (size_t)value;
+    } else if (strcmp(setting, "maxHeap") == 0) {
+        old = (double)vm->gcMaxHeap;
+        // 0: no maximum
+        if (set && value > 0 && (size_t)value < vm->gcMinHeap) {
+            return nativeError("The maximum heap can't be below the minimum heap.");
+        }
+        if (set) vm->gcMaxHeap = (size_t)value;
+    } else {
+        return nativeError("Unknown GC setting '%s'.", setting);
+    }
+    applyHeapLimits();
+    return NUMBER_VAL(old);
+}
+
+void defineGcNatives() {
+    defineNative("gcCollect", gcCollectNative);
+    defineNative("gcTune", gcTuneNative);
+    defineNative("gcStats", gcStatsNative);
 }
 
 
 void freeObjects() {
-    Obj* object = vm.objects;
+    Obj* object = vm->objects;
     while (object != NULL) {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
 
-    free(vm.grayStack);
+    free(vm->grayStack);
 }
\ No newline at end of file
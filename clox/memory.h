@@ -12,6 +12,18 @@
 #define FREE(type, pointer) \
     reallocate(pointer, sizeof(type), 0)
 
+// the next collection starts once the heap has grown this many times what the last one left (`--gc-grow`)
+#define GC_HEAP_GROW_FACTOR 2
+// however much time collecting takes, the heap doesn't grow more than this many times between two collections
+#define GC_HEAP_GROW_MAX 8
+// no collection before the heap reaches this many bytes (`--gc-min-heap`)
+#define GC_MIN_HEAP (1024 * 1024)
+// percent of the time a program should spend collecting at most, a heap costing more grows faster (`--gc-target`)
+#define GC_TARGET_PERCENT 5
+// the heap grows faster than `--gc-grow` only once a collection leaves this many bytes: a smaller heap fits
+// the caches, a collection of it is quick and spreading the allocations over more memory costs more than it saves
+#define GC_ADAPT_HEAP (4 * 1024 * 1024)
+
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
@@ -22,9 +34,28 @@
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+// collect if the heap has grown past `vm->nextGC`, for memory counted into `bytesAllocated` without `reallocate`
+void collectIfDue();
 void markObject(Obj* object);
 void markValue(Value value);
+// trace the references of a gray object, from the collecting thread or a marking thread (see marker.c)
+void blackenObject(Obj* object);
+// the steps of a collection, a concurrent one (see collector.c) takes them apart
+void markRoots();
+void traceReferences();
+void freeObject(Obj* object);
 void collectGarbage();
+// a whole stop-the-world collection right away, however the VM collects otherwise (for `gcCollect()`)
+void collectNow();
+// seconds on the clock collections are timed with
+double gcClock();
+// after a collection: set `vm->nextGC` from what's left of the heap, adapting the growth to `vm->gcTarget`
+// `gcSeconds` is what the collection cost, `pausedSeconds` how much of it the program waited for
+void sizeHeap(double gcSeconds, double pausedSeconds);
+// keep `vm->nextGC` within `gcMinHeap` and `gcMaxHeap`, after they're changed
+void applyHeapLimits();
+// gcCollect and gcTune
+void defineGcNatives();
 void freeObjects();
 
 
@@ -1,6 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "allocprof.h"
+#include "compactor.h"
+#include "intern.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -12,14 +16,21 @@
     (type*)allocateObject(sizeof(type), objectType)
 
 static Obj* allocateObject(size_t size, ObjType type) {
+#ifdef COMPACTING_GC
+    // instances of a compacting VM live in blocks of their own (see compactor.c)
+    Obj* object = type == OBJ_INSTANCE && vm->compactGC ? (Obj*)allocateInstance() : (Obj*)reallocate(NULL, 0, size);
+#else
     Obj* object = (Obj*) reallocate(NULL, 0, size);
+#endif
     object->type = type;
-    object->isMarked = false;
+    atomic_init(&object->isMarked, false);
+    vm->gcStats.allocated[type]++;
+    if (vm->allocProfile != NULL) profileAllocation(size, type);
 
     // insert the new object at the head of the linked list
     // therefore no need to maintain its tail
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -56,12 +67,53 @@ ObjClosure* newClosure(ObjFunction* function) {
     return closure;
 }
 
+ObjFiber* newFiber(ObjClosure* closure) {
+    ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+    fiber->closure = closure;
+    fiber->status = FIBER_NEW;
+    fiber->caller = NULL;
+    fiber->openUpvalues = NULL;
+    // note: plain `malloc` like the VM's own stacks, they get swapped in and grown by the VM (see `growStack`)
+    // yet counted into `bytesAllocated` the same way, and freed with the fiber
+    fiber->frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    fiber->stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+    if (fiber->frames == NULL || fiber->stack == NULL) exit(1);
+    vm->bytesAllocated += sizeof(CallFrame) * FRAMES_INITIAL + sizeof(Value) * STACK_INITIAL;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = FRAMES_INITIAL;
+    fiber->stackTop = fiber->stack;
+    fiber->stackCapacity = STACK_INITIAL;
+    return fiber;
+}
+
+ObjGenerator* newGenerator(ObjClosure* closure) {
+    ObjGenerator* generator = ALLOCATE_OBJ(ObjGenerator, OBJ_GENERATOR);
+    generator->closure = closure;
+    generator->status = GENERATOR_SUSPENDED;
+    generator->ip = closure->function->chunk.code;
+    generator->slots = NULL;
+    generator->slotCount = 0;
+    generator->slotCapacity = 0;
+    generator->openUpvalues = NULL;
+    return generator;
+}
+
 // create a Lox function object and initialize it to an empty state
 ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxSlots = 1;
     function->name = NULL;
+    function->isGenerator = false;
+    function->callCount = 0;
+    function->jit = NULL;
+    function->loopCount = 0;
+    function->traces = NULL;
+    function->profile = (CallStats){0, 0, 0, 0};
+#ifdef OPCODE_STATS
+    function->instructions = 0;
+#endif
     initChunk(&function->chunk);
     return function;
 }
@@ -76,6 +128,7 @@ ObjInstance* newInstance(ObjClass* klass) {
 ObjNative* newNative(NativeFn function) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->profile = (CallStats){0, 0, 0, 0};
     return native;
 }
 
@@ -89,7 +142,7 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
     // note: in clox, all strings are interned
     // push & pop: keep alive for GC
     push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
+    tableSet(&vm->strings, string, NIL_VAL);
     pop();
     return string;
 }
@@ -104,12 +157,22 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
+// the VM's own strings come first: a string it already has must stay the one it gets,
+// even if another VM adds the same characters to the shared pool later on
+static ObjString* findString(const char* chars, int length, uint32_t hash) {
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+#ifdef SHARED_STRINGS
+    if (interned == NULL && sharedStrings) interned = findSharedString(chars, length, hash);
+#endif
+    return interned;
+}
+
 // claims ownership of `chars` passed in
 ObjString* takeString(char* chars, int length) {
     uint32_t hash = hashString(chars, length);
 
     // if already exist a same string, return the reference to it
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findString(chars, length, hash);
     if (interned != NULL) {
         // already obtained ownership, no longer need the duplicate string
         FREE_ARRAY(char, chars, length + 1);
@@ -126,7 +189,7 @@ ObjString* copyString(const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
 
     // if already exist a same string, just return the reference to it, and skip the copying
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findString(chars, length, hash);
     if (interned != NULL) return interned;
 
     char* heapChars = ALLOCATE(char, length + 1);
@@ -136,10 +199,25 @@ ObjString* copyString(const char* chars, int length) {
     return allocateString(heapChars, length, hash);
 }
 
+// like `copyString`, for the names and literals of the program (rather than strings it makes at runtime)
+// they're the ones every VM running the same kind of scripts has, so they go into the shared pool if it's on
+ObjString* internString(const char* chars, int length) {
+#ifdef SHARED_STRINGS
+    if (sharedStrings) {
+        uint32_t hash = hashString(chars, length);
+        ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+        if (interned != NULL) return interned;
+        return internSharedString(chars, length, hash);
+    }
+#endif
+    return copyString(chars, length);
+}
+
 ObjUpvalue* newUpvalue(Value* slot) {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
+    upvalue->owner = NULL;
     return upvalue;
 }
 
@@ -164,9 +242,15 @@ void printObject(Value value) {
             // from user's perspective, difference between ObjClosure and ObjFunction is just implementation detail
             printFunction(AS_CLOSURE(value)->function);
             break;
+        case OBJ_FIBER:
+            printf("<fiber>");
+            break;
         case OBJ_FUNCTION:
             printFunction(AS_FUNCTION(value));
             break;
+        case OBJ_GENERATOR:
+            printf("<generator>");
+            break;
         case OBJ_INSTANCE:
             printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
             break;
@@ -1,6 +1,8 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include <stdatomic.h>
+
 #include "common.h"
 #include "chunk.h"
 #include "table.h"
@@ -11,7 +13,9 @@
 #define IS_BOUND_METHOD(value) (isObjType(value, OBJ_BOUND_METHOD))
 #define IS_CLASS(value)        (isObjType(value, OBJ_CLASS))
 #define IS_CLOSURE(value)      (isObjType(value, OBJ_CLOSURE))
+#define IS_FIBER(value)        (isObjType(value, OBJ_FIBER))
 #define IS_FUNCTION(value)     (isObjType(value, OBJ_FUNCTION))
+#define IS_GENERATOR(value)    (isObjType(value, OBJ_GENERATOR))
 #define IS_INSTANCE(value)     (isObjType(value, OBJ_INSTANCE))
 #define IS_NATIVE(value)       (isObjType(value, OBJ_NATIVE))
 #define IS_STRING(value)       (isObjType(value, OBJ_STRING))
@@ -19,7 +23,9 @@
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
+#define AS_FIBER(value)        ((ObjFiber*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
+#define AS_GENERATOR(value)    ((ObjGenerator*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
@@ -29,26 +35,50 @@ typedef enum {
     OBJ_BOUND_METHOD,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FIBER,
     OBJ_FUNCTION,
+    OBJ_GENERATOR,
     OBJ_INSTANCE,
     OBJ_NATIVE,
     OBJ_STRING,
     OBJ_UPVALUE
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
 // base class for heap-allocated objects
 struct Obj {
     ObjType type;
-    bool isMarked; // marked as reachable (for GC)
+    // marked as reachable (for GC), shared strings (see intern.c) stay marked for good
+    // atomic: parallel markers (see marker.c) race to flip it, everything else uses relaxed loads and stores
+    atomic_bool isMarked;
     struct Obj* next;
 };
 
+// calls of a function or native, and the time they took (see callprof.c), in ticks of `callClock`
+typedef struct {
+    uint64_t calls;
+    uint64_t inclusive; // callees included, recursive calls only counted once
+    uint64_t exclusive; // callees left out
+    int depth; // calls in progress, in any fiber
+} CallStats;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    int maxSlots; // the deepest its frame's stack window gets, callee slot and temporaries included
     Chunk chunk; // each function's bytecode lives in its own chunk
     ObjString* name;
+    bool isGenerator; // its body contains `yield`, calling it creates an ObjGenerator
+    int callCount; // calls so far, to find hot functions for the JIT (-1: don't try to compile)
+    struct JitCode* jit; // machine code compiled from `chunk`, NULL until the function gets hot
+    int loopCount; // the OP_LOOP instructions numbered in `chunk` (see LOOP_UNNUMBERED)
+    struct Trace** traces; // by loop number: its counters, and its trace once it gets hot (NULL until needed)
+    CallStats profile; // only counted with `vm->callProfile` on
+#ifdef OPCODE_STATS
+    uint64_t instructions; // executed by `run` so far (see opstats.c)
+#endif
 } ObjFunction;
 
 // pointer to a C function
@@ -58,6 +88,7 @@ typedef Value (*NativeFn)(int argCount, Value* args);
 typedef struct {
     Obj obj;
     NativeFn function; // pointer to the C function implementing native behavior
+    CallStats profile; // only counted with `vm->callProfile` on
 } ObjNative;
 
 struct ObjString {
@@ -73,6 +104,8 @@ typedef struct ObjUpvalue {
     Value* location; // pointer to the value (open: on stack, closed: in heap)
     Value closed; // where the closed-over values live in heap
     struct ObjUpvalue* next; // intrusive list of ObjUpvalues, use to ensure only 1 Upvalue for each local
+    // while open: the fiber or generator whose stack `location` points into (NULL: the main program's)
+    struct Obj* owner;
 } ObjUpvalue;
 
 // runtime representation of a function with captured variables
@@ -95,6 +128,49 @@ typedef struct {
     Table fields; // each instance has its own fields, and user can add fields at runtime
 } ObjInstance;
 
+typedef enum {
+    FIBER_NEW, // not resumed yet
+    FIBER_RUNNING, // running, or waiting for a fiber it resumed
+    FIBER_SUSPENDED,
+    FIBER_DONE, // its function returned (or a runtime error ended it)
+} FiberStatus;
+
+// a coroutine: a closure running on a value stack and CallFrames of its own
+// resuming a fiber swaps these with the VM's, so while it runs they hold the stacks of its resumer
+typedef struct ObjFiber {
+    Obj obj;
+    ObjClosure* closure; // the fiber's body, called on the first resume
+    FiberStatus status;
+    struct ObjFiber* caller; // while running: the fiber which resumed it (NULL: the main program)
+
+    struct CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    Value* stack;
+    Value* stackTop;
+    int stackCapacity;
+    ObjUpvalue* openUpvalues;
+} ObjFiber;
+
+typedef enum {
+    GENERATOR_SUSPENDED, // not called yet, or stopped at a `yield`
+    GENERATOR_RUNNING,
+    GENERATOR_DONE, // its function returned (or a runtime error ended it)
+} GeneratorStatus;
+
+// a call of a generator function, which produces a value each time the generator is called
+// between two calls its CallFrame's stack window (from the callee slot up) is kept here
+typedef struct ObjGenerator {
+    Obj obj;
+    ObjClosure* closure;
+    GeneratorStatus status;
+    uint8_t* ip; // where it goes on once it's called again
+    Value* slots;
+    int slotCount;
+    int slotCapacity;
+    ObjUpvalue* openUpvalues; // the upvalues pointing into `slots` while it's suspended
+} ObjGenerator;
+
 // an ObjClosure with `this` bounded to an ObjInstance
 typedef struct {
     Obj obj;
@@ -105,11 +181,14 @@ typedef struct {
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjClass* newClass(ObjString* name);
 ObjClosure* newClosure(ObjFunction* function);
+ObjFiber* newFiber(ObjClosure* closure);
+ObjGenerator* newGenerator(ObjClosure* closure);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 ObjNative* newNative(NativeFn function);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* internString(const char* chars, int length);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
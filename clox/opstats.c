@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "opstats.h"
+#include "vm.h"
+
+#ifdef OPCODE_STATS
+
+// Opcode statistics (`--opcode-stats`, in the `clox_stats` build only).
+// `run` counts every instruction before dispatching it: by opcode, by pair of consecutive opcodes (the
+// candidates for superinstructions) and by the function executing it. Pairs follow the order instructions
+// execute in, so a call pairs with the first instruction of the callee. Only `run` counts: compiled code
+// doesn't go through it, which is why `--opcode-stats` turns the JIT off.
+
+typedef struct {
+    uint8_t first;
+    uint8_t second;
+    uint64_t count;
+} Pair;
+
+OpcodeStats* newOpcodeStats(const char* path) {
+    OpcodeStats* stats = (OpcodeStats*)calloc(1, sizeof(OpcodeStats));
+    if (stats == NULL) exit(1);
+    stats->path = path;
+    return stats;
+}
+
+static int comparePairs(const void* a, const void* b) {
+    const Pair* left = (const Pair*)a;
+    const Pair* right = (const Pair*)b;
+    if (left->count != right->count) return left->count < right->count ? 1 : -1;
+    return 0;
+}
+
+static int compareFunctions(const void* a, const void* b) {
+    const ObjFunction* left = *(const ObjFunction* const*)a;
+    const ObjFunction* right = *(const ObjFunction* const*)b;
+    if (left->instructions != right->instructions) return left->instructions < right->instructions ? 1 : -1;
+    return 0;
+}
+
+static double percent(uint64_t count, uint64_t total) {
+    return total > 0 ? (double)count * 100 / total : 0;
+}
+
+static const char* functionName(ObjFunction* function) {
+    return function->name == NULL ? "script" : function->name->chars;
+}
+
+static void writeTable(FILE* file, OpcodeStats* stats, Pair* pairs, int pairCount,
+                       ObjFunction** functions, int functionCount) {
+    fprintf(file, "== opcodes: %llu instructions ==\n", (unsigned long long)stats->total);
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (stats->counts[op] == 0) continue;
+        fprintf(file, "%14llu %5.1f%%  %s\n", (unsigned long long)stats->counts[op],
+                percent(stats->counts[op], stats->total), opcodeName((uint8_t)op));
+    }
+
+    fprintf(file, "== pairs ==\n");
+    for (int i = 0; i < pairCount && i < OPSTATS_REPORT_ROWS; i++) {
+        fprintf(file, "%14llu %5.1f%%  %s %s\n", (unsigned long long)pairs[i].count,
+                percent(pairs[i].count, stats->total), opcodeName(pairs[i].first), opcodeName(pairs[i].second));
+    }
+    if (pairCount > OPSTATS_REPORT_ROWS) fprintf(file, "... %d more pairs ...\n", pairCount - OPSTATS_REPORT_ROWS);
+
+    fprintf(file, "== functions ==\n");
+    for (int i = 0; i < functionCount && i < OPSTATS_REPORT_ROWS; i++) {
+        ObjFunction* function = functions[i];
+        fprintf(file, "%14llu %5.1f%%  %s (line %d)\n", (unsigned long long)function->instructions,
+                percent(function->instructions, stats->total), functionName(function),
+                function->chunk.count > 0 ? function->chunk.lines[0] : 0);
+    }
+    if (functionCount > OPSTATS_REPORT_ROWS) {
+        fprintf(file, "... %d more functions ...\n", functionCount - OPSTATS_REPORT_ROWS);
+    }
+    if (stats->freedInstructions > 0) {
+        fprintf(file, "%14llu %5.1f%%  (freed functions)\n", (unsigned long long)stats->freedInstructions,
+                percent(stats->freedInstructions, stats->total));
+    }
+}
+
+// one row per count: kind,first,second,count (a function's line goes in `second`)
+static void writeCsv(FILE* file, OpcodeStats* stats, Pair* pairs, int pairCount,
+                     ObjFunction** functions, int functionCount) {
+    fprintf(file, "kind,first,second,count\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (stats->counts[op] == 0) continue;
+        fprintf(file, "opcode,%s,,%llu\n", opcodeName((uint8_t)op), (unsigned long long)stats->counts[op]);
+    }
+    for (int i = 0; i < pairCount; i++) {
+        fprintf(file, "pair,%s,%s,%llu\n", opcodeName(pairs[i].first), opcodeName(pairs[i].second),
+                (unsigned long long)pairs[i].count);
+    }
+    for (int i = 0; i < functionCount; i++) {
+        ObjFunction* function = functions[i];
+        fprintf(file, "function,%s,%d,%llu\n", functionName(function),
+                function->chunk.count > 0 ? function->chunk.lines[0] : 0, (unsigned long long)function->instructions);
+    }
+    if (stats->freedInstructions > 0) {
+        fprintf(file, "function,(freed functions),,%llu\n", (unsigned long long)stats->freedInstructions);
+    }
+}
+
+void finishOpcodeStats() {
+    OpcodeStats* stats = vm->opcodeStats;
+    if (stats == NULL) return;
+
+    Pair* pairs = (Pair*)malloc(sizeof(Pair) * OP_COUNT * OP_COUNT);
+    if (pairs == NULL) exit(1);
+    int pairCount = 0;
+    for (int first = 0; first < OP_COUNT; first++) {
+        for (int second = 0; second < OP_COUNT; second++) {
+            if (stats->pairs[first][second] == 0) continue;
+            pairs[pairCount++] = (Pair){(uint8_t)first, (uint8_t)second, stats->pairs[first][second]};
+        }
+    }
+    qsort(pairs, pairCount, sizeof(Pair), comparePairs);
+
+    int functionCount = 0;
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_FUNCTION && ((ObjFunction*)object)->instructions > 0) functionCount++;
+    }
+    ObjFunction** functions = (ObjFunction**)malloc(sizeof(ObjFunction*) * (functionCount > 0 ? functionCount : 1));
+    if (functions == NULL) exit(1);
+    functionCount = 0;
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_FUNCTION && ((ObjFunction*)object)->instructions > 0) {
+            functions[functionCount++] = (ObjFunction*)object;
+        }
+    }
+    qsort(functions, functionCount, sizeof(ObjFunction*), compareFunctions);
+
+    FILE* file = strcmp(stats->path, "-") == 0 ? stderr : fopen(stats->path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write the opcode statistics to \"%s\".\n", stats->path);
+    } else {
+        size_t length = strlen(stats->path);
+        if (length > 4 && strcmp(stats->path + length - 4, ".csv") == 0) {
+            writeCsv(file, stats, pairs, pairCount, functions, functionCount);
+        } else {
+            writeTable(file, stats, pairs, pairCount, functions, functionCount);
+        }
+        if (file != stderr) fclose(file);
+    }
+
+    free(functions);
+    free(pairs);
+    free(stats);
+    vm->opcodeStats = NULL;
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef clox_opstats_h
+#define clox_opstats_h
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+
+// the table lists this many pairs and functions at most, the most executed first
+#define OPSTATS_REPORT_ROWS 40
+
+#ifdef OPCODE_STATS
+// executions of every opcode, and of every opcode right after another one
+typedef struct OpcodeStats {
+    const char* path;
+    uint64_t total;
+    uint64_t counts[OP_COUNT];
+    uint64_t pairs[OP_COUNT][OP_COUNT]; // [first][second]
+    uint8_t previous; // the opcode executed last, whichever frame it was in
+    uint64_t freedInstructions; // executed by functions freed since
+} OpcodeStats;
+
+// `run` with `vm->opcodeStats` on: `function` is about to execute `opcode`
+static inline void countInstruction(OpcodeStats* stats, ObjFunction* function, uint8_t opcode) {
+    stats->total++;
+    stats->counts[opcode]++;
+    stats->pairs[stats->previous][opcode]++;
+    stats->previous = opcode;
+    function->instructions++;
+}
+
+// for `vm->opcodeStats`: count every instruction `run` executes, written to the file at `path`
+// ("-": stderr) once the VM is freed, as CSV if it ends in ".csv" and as a table otherwise
+OpcodeStats* newOpcodeStats(const char* path);
+// write out the counts, before the VM frees its functions
+void finishOpcodeStats();
+#endif
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "opstats.h"
+#include "perfcount.h"
+
+#ifdef PERF_COUNTERS
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware performance counters (`--perf-counters`).
+// One perf_event_open counter per event, on the program's thread only (the marking and collector threads
+// aren't counted), in user space only, so the default perf_event_paranoid of 2 allows it. They run while
+// `interpret` does, compiling included. The PMU may not offer an event (or any, in most virtual machines):
+// that counter is left out of the report. When there are more events than the PMU has counters, the kernel
+// takes turns, and a count is scaled up from the share of the time it ran.
+//
+// The instructions per bytecode need the bytecodes executed, which only the `clox_stats` build counts
+// (`--opcode-stats`), its counting included. bench.sh divides the instructions of plain `clox --no-jit`
+// by the bytecodes of `clox_stats` instead.
+
+typedef struct {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} PerfEvent;
+
+#define CACHE_READ_MISSES(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const PerfEvent events[] = {
+    {"taskClockNs", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branchMisses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"l1dReadMisses", PERF_TYPE_HW_CACHE, CACHE_READ_MISSES(PERF_COUNT_HW_CACHE_L1D)},
+    {"llcReadMisses", PERF_TYPE_HW_CACHE, CACHE_READ_MISSES(PERF_COUNT_HW_CACHE_LL)},
+};
+
+#define EVENT_COUNT ((int)(sizeof(events) / sizeof(events[0])))
+
+typedef struct PerfCounters {
+    const char* path;
+    int fds[EVENT_COUNT]; // -1: the event isn't available
+} PerfCounters;
+
+bool startPerfCounters(VM* instance, const char* path) {
+    PerfCounters* counters = (PerfCounters*)malloc(sizeof(PerfCounters));
+    if (counters == NULL) exit(1);
+    counters->path = path;
+
+    int opened = 0;
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // this thread, on any CPU
+        counters->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fds[i] >= 0) opened++;
+    }
+    if (opened == 0) {
+        free(counters);
+        return false;
+    }
+    instance->perfCounters = counters;
+    return true;
+}
+
+void countPerfEvents(bool on) {
+    PerfCounters* counters = vm->perfCounters;
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        if (counters->fds[i] >= 0) ioctl(counters->fds[i], on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+// the count of event `i`, scaled up if it had to share the PMU, false if there's none
+static bool readCounter(PerfCounters* counters, int i, double* count, double* share) {
+    struct {
+        uint64_t value;
+        uint64_t enabled;
+        uint64_t running;
+    } reading;
+    if (counters->fds[i] < 0 || read(counters->fds[i], &reading, sizeof(reading)) != (ssize_t)sizeof(reading)) {
+        return false;
+    }
+    *share = reading.enabled > 0 ? (double)reading.running / (double)reading.enabled : 1;
+    *count = *share > 0 ? (double)reading.value / *share : 0;
+    return true;
+}
+
+static double ratio(double a, double b) {
+    return b > 0 ? a / b : 0;
+}
+
+void finishPerfCounters() {
+    PerfCounters* counters = vm->perfCounters;
+    if (counters == NULL) return;
+
+    double counts[EVENT_COUNT];
+    double shares[EVENT_COUNT];
+    bool counted[EVENT_COUNT];
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        counted[i] = readCounter(counters, i, &counts[i], &shares[i]);
+        if (counters->fds[i] >= 0) close(counters->fds[i]);
+    }
+
+    uint64_t bytecodes = 0;
+#ifdef OPCODE_STATS
+    if (vm->opcodeStats != NULL) bytecodes = vm->opcodeStats->total;
+#endif
+
+    FILE* file = strcmp(counters->path, "-") == 0 ? stderr : fopen(counters->path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write the performance counters to \"%s\".\n", counters->path);
+    } else {
+        // one "name: count" per line, for bench.sh, then what they add up to
+        for (int i = 0; i < EVENT_COUNT; i++) {
+            if (!counted[i]) {
+                fprintf(file, "%-14s -\n", events[i].name);
+            } else if (shares[i] < 1) {
+                fprintf(file, "%-14s %.0f  (scaled, counted %.0f%% of the time)\n", events[i].name, counts[i],
+                        shares[i] * 100);
+            } else {
+                fprintf(file, "%-14s %.0f\n", events[i].name, counts[i]);
+            }
+        }
+        if (bytecodes > 0) fprintf(file, "%-14s %llu\n", "bytecodes", (unsigned long long)bytecodes);
+
+        // indices into `events`
+        enum { TASK_CLOCK, CYCLES, INSTRUCTIONS, BRANCHES, BRANCH_MISSES, L1D_MISSES, LLC_MISSES };
+        if (counted[CYCLES] && counted[INSTRUCTIONS]) {
+            fprintf(file, "== %.2f instructions per cycle", ratio(counts[INSTRUCTIONS], counts[CYCLES]));
+            if (counted[TASK_CLOCK]) fprintf(file, ", %.2f GHz", ratio(counts[CYCLES], counts[TASK_CLOCK]));
+            fprintf(file, " ==\n");
+        }
+        if (counted[BRANCHES] && counted[BRANCH_MISSES]) {
+            fprintf(file, "== %.2f%% of branches mispredicted ==\n", ratio(counts[BRANCH_MISSES], counts[BRANCHES]) * 100);
+        }
+        if (counted[INSTRUCTIONS] && counted[L1D_MISSES]) {
+            fprintf(file, "== %.2f L1d read misses per 1000 instructions ==\n",
+                    ratio(counts[L1D_MISSES], counts[INSTRUCTIONS]) * 1000);
+        }
+        if (bytecodes > 0) {
+            if (counted[INSTRUCTIONS]) {
+                fprintf(file, "== %.2f instructions per bytecode (counting them included) ==\n",
+                        ratio(counts[INSTRUCTIONS], (double)bytecodes));
+            }
+            if (counted[BRANCH_MISSES]) {
+                fprintf(file, "== %.3f branch misses per bytecode ==\n", ratio(counts[BRANCH_MISSES], (double)bytecodes));
+            }
+        }
+        if (file != stderr) fclose(file);
+    }
+
+    free(counters);
+    vm->perfCounters = NULL;
+}
+
+#endif
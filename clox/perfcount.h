@@ -0,0 +1,19 @@
+#ifndef clox_perfcount_h
+#define clox_perfcount_h
+
+#include "common.h"
+#include "vm.h"
+
+struct PerfCounters;
+
+#ifdef PERF_COUNTERS
+// open the hardware counters for the calling thread, which runs `instance`, reported in the file at `path`
+// ("-": stderr) once it's freed, false if not even one counter could be opened
+bool startPerfCounters(VM* instance, const char* path);
+// `interpret` begins or ends: the counters only run in between
+void countPerfEvents(bool on);
+// write out the counts and close the counters, before the VM frees its opcode statistics
+void finishPerfCounters();
+#endif
+
+#endif
@@ -0,0 +1,43 @@
+#include <stdio.h>
+
+#include "perfmap.h"
+
+#ifdef BASELINE_JIT
+
+#include <unistd.h>
+
+// Symbols for code compiled by the JIT (`--perf-map`).
+// perf, and the profilers reading its format, look up addresses outside of any mapped file in
+// /tmp/perf-<pid>.map: one line per symbol, "start size name", both numbers in hex. Each compiled function
+// becomes "lox:name:line" and each trace "lox:name:line:loop" (the line of the loop header), so a
+// `perf record` of clox shows the Lox functions running as machine code next to `run` and the C helpers.
+// The file is only ever appended to: code that's freed keeps its line, and perf takes the later symbol
+// when the same memory gets another function. The time spent interpreting stays with `run`, see
+// `--cpu-profile` for that.
+
+static FILE* perfMap = NULL;
+
+bool openPerfMap() {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    perfMap = fopen(path, "w");
+    if (perfMap == NULL) return false;
+    // a line at a time: perf reads the file while the process still runs, or after it crashed
+    setvbuf(perfMap, NULL, _IOLBF, 0);
+    return true;
+}
+
+void perfMapCode(uint8_t* code, size_t size, ObjFunction* function, int loop) {
+    if (perfMap == NULL) return;
+
+    const char* name = function->name == NULL ? "script" : function->name->chars;
+    int line = function->chunk.count > 0 ? function->chunk.lines[loop >= 0 ? loop : 0] : 0;
+    // one call, so lines written by VMs on other threads don't interleave
+    if (loop >= 0) {
+        fprintf(perfMap, "%lx %zx lox:%s:%d:loop\n", (unsigned long)(uintptr_t)code, size, name, line);
+    } else {
+        fprintf(perfMap, "%lx %zx lox:%s:%d\n", (unsigned long)(uintptr_t)code, size, name, line);
+    }
+}
+
+#endif
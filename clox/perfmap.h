@@ -0,0 +1,16 @@
+#ifndef clox_perfmap_h
+#define clox_perfmap_h
+
+#include "common.h"
+#include "object.h"
+
+#ifdef BASELINE_JIT
+// start /tmp/perf-<pid>.map, every piece of code compiled from here on gets a line in it (for the whole
+// process, whichever VM compiles it), false if it can't be created
+bool openPerfMap();
+// `size` bytes at `code` were compiled from `function`: all of it, or the loop at bytecode offset `loop`
+// (-1: the whole function)
+void perfMapCode(uint8_t* code, size_t size, ObjFunction* function, int loop);
+#endif
+
+#endif
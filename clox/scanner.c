@@ -10,7 +10,7 @@ typedef struct {
     int line;            // line number current lexeme is on
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
 
 void initScanner(const char* source) {
     scanner.start = source;
@@ -140,6 +140,7 @@ static TokenType identifierType() {
             }
         case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
         case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+        case 'y': return checkKeyword(1, 4, "ield", TOKEN_YIELD);
     }
 
 
@@ -0,0 +1,563 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "scheduler.h"
+
+#ifdef ASYNC_IO
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compactor.h"
+#include "memory.h"
+
+// Event loop for fibers (see ObjFiber).
+// An async native tries its operation right away, and only if it would block does it park the running fiber
+// here and suspend it, back to whoever resumed it. The loop resumes the fiber once the operation completed,
+// with the operation's result as what the native call evaluates to.
+// Sockets wait in epoll, timers in a min-heap on their deadline, and regular files (which epoll can't watch)
+// are read a chunk per turn. Failed operations on a socket evaluate to nil.
+// A socket is its descriptor's number, and the socket natives only take the ones this VM opened: not stdout,
+// nor, in clox_host, another VM's sockets or its epoll instance. Those still open go with the VM.
+
+typedef enum {
+    WAIT_NONE,
+    WAIT_ACCEPT,
+    WAIT_CONNECT,
+    WAIT_READ,
+    WAIT_WRITE,
+    WAIT_READ_FILE,
+} WaitKind;
+
+// a fiber waiting on a file descriptor, indexed by the descriptor
+typedef struct {
+    WaitKind kind;
+    ObjFiber* fiber;
+    ObjString* data; // WAIT_WRITE: the string being written
+    size_t done; // WAIT_WRITE: bytes of it written so far
+    char* buffer; // WAIT_READ_FILE: the contents read so far
+    size_t length;
+    size_t capacity;
+} Wait;
+
+typedef struct {
+    double deadline;
+    ObjFiber* fiber;
+} Timer;
+
+// a fiber to be resumed with `value`
+typedef struct {
+    ObjFiber* fiber;
+    Value value;
+} Ready;
+
+typedef struct Scheduler {
+    int epoll;
+
+    bool* sockets; // indexed by descriptor: opened by `listen`, `accept` or `connect`, and not closed yet
+    int socketCapacity;
+
+    Wait* waits;
+    int waitCapacity;
+    int waitCount;
+    int fileReads; // waits of WAIT_READ_FILE among them, they don't go through epoll
+
+    Timer* timers; // binary min-heap on `deadline`
+    int timerCount;
+    int timerCapacity;
+
+    Ready* ready; // FIFO of fibers to resume, `readyHead` is the next one
+    int readyHead;
+    int readyCount;
+    int readyCapacity;
+} Scheduler;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+// note: the scheduler's own arrays use plain `realloc` like the gray stack, bookkeeping mustn't trigger a GC
+static void* grow(void* array, size_t size, int* capacity, int needed) {
+    if (needed <= *capacity) return array;
+    int newCapacity = *capacity;
+    while (newCapacity < needed) newCapacity = GROW_CAPACITY(newCapacity);
+    array = realloc(array, size * newCapacity);
+    if (array == NULL) exit(1);
+    *capacity = newCapacity;
+    return array;
+}
+
+static Scheduler* getScheduler() {
+    if (vm->scheduler != NULL) return vm->scheduler;
+
+    Scheduler* scheduler = (Scheduler*)calloc(1, sizeof(Scheduler));
+    if (scheduler == NULL) exit(1);
+    scheduler->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (scheduler->epoll == -1) exit(1);
+    vm->scheduler = scheduler;
+    return scheduler;
+}
+
+static void makeReady(ObjFiber* fiber, Value value) {
+    Scheduler* scheduler = getScheduler();
+    scheduler->ready = (Ready*)grow(scheduler->ready, sizeof(Ready), &scheduler->readyCapacity,
+                                    scheduler->readyCount + 1);
+    scheduler->ready[scheduler->readyCount].fiber = fiber;
+    scheduler->ready[scheduler->readyCount].value = value;
+    scheduler->readyCount++;
+}
+
+static void addTimer(double deadline, ObjFiber* fiber) {
+    Scheduler* scheduler = getScheduler();
+    scheduler->timers = (Timer*)grow(scheduler->timers, sizeof(Timer), &scheduler->timerCapacity,
+                                     scheduler->timerCount + 1);
+    // sift up
+    int i = scheduler->timerCount++;
+    while (i > 0 && scheduler->timers[(i - 1) / 2].deadline > deadline) {
+        scheduler->timers[i] = scheduler->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    scheduler->timers[i].deadline = deadline;
+    scheduler->timers[i].fiber = fiber;
+}
+
+static ObjFiber* popTimer(Scheduler* scheduler) {
+    ObjFiber* fiber = scheduler->timers[0].fiber;
+    Timer last = scheduler->timers[--scheduler->timerCount];
+    // sift down
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= scheduler->timerCount) break;
+        if (child + 1 < scheduler->timerCount &&
+            scheduler->timers[child + 1].deadline < scheduler->timers[child].deadline) {
+            child++;
+        }
+        if (scheduler->timers[child].deadline >= last.deadline) break;
+        scheduler->timers[i] = scheduler->timers[child];
+        i = child;
+    }
+    if (scheduler->timerCount > 0) scheduler->timers[i] = last;
+    return fiber;
+}
+
+static void ownSocket(int fd) {
+    Scheduler* scheduler = getScheduler();
+    int capacity = scheduler->socketCapacity;
+    scheduler->sockets = (bool*)grow(scheduler->sockets, sizeof(bool), &scheduler->socketCapacity, fd + 1);
+    memset(scheduler->sockets + capacity, 0, sizeof(bool) * (scheduler->socketCapacity - capacity));
+    scheduler->sockets[fd] = true;
+}
+
+static void closeSocket(int fd) {
+    Scheduler* scheduler = getScheduler();
+    if (fd < scheduler->socketCapacity) scheduler->sockets[fd] = false;
+    close(fd);
+}
+
+// park the running fiber until `fd` is ready for the operation, and suspend it
+static Value waitOn(int fd, WaitKind kind) {
+    if (vm->fiber == NULL) return nativeError("Can only wait inside a fiber.");
+
+    Scheduler* scheduler = getScheduler();
+    if (fd < scheduler->waitCapacity && scheduler->waits[fd].kind != WAIT_NONE) {
+        return nativeError("Another fiber is already waiting on %d.", fd);
+    }
+    int capacity = scheduler->waitCapacity;
+    scheduler->waits = (Wait*)grow(scheduler->waits, sizeof(Wait), &scheduler->waitCapacity, fd + 1);
+    memset(scheduler->waits + capacity, 0, sizeof(Wait) * (scheduler->waitCapacity - capacity));
+
+    if (kind == WAIT_READ_FILE) {
+        scheduler->fileReads++;
+    } else {
+        struct epoll_event event;
+        event.events = (kind == WAIT_WRITE || kind == WAIT_CONNECT ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+        event.data.fd = fd;
+        if (epoll_ctl(scheduler->epoll, EPOLL_CTL_ADD, fd, &event) == -1) {
+            return nativeError("Can't wait on %d (%s).", fd, strerror(errno));
+        }
+    }
+
+    Wait* wait = &scheduler->waits[fd];
+    wait->kind = kind;
+    wait->fiber = vm->fiber;
+    scheduler->waitCount++;
+    vm->transfer = vm->fiber;
+    return NIL_VAL;
+}
+
+static void endWait(Scheduler* scheduler, int fd, Value result) {
+    Wait* wait = &scheduler->waits[fd];
+    if (wait->kind == WAIT_READ_FILE) {
+        scheduler->fileReads--;
+        free(wait->buffer);
+    } else {
+        epoll_ctl(scheduler->epoll, EPOLL_CTL_DEL, fd, NULL);
+    }
+    ObjFiber* fiber = wait->fiber;
+    memset(wait, 0, sizeof(Wait));
+    scheduler->waitCount--;
+    makeReady(fiber, result);
+}
+
+// the non-blocking operations, shared by the natives' first try and the event loop's retries
+// `*result` is only set once the operation completed
+
+static bool tryAccept(int fd, Value* result) {
+    int connection = accept(fd, NULL, NULL);
+    if (connection == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+    if (connection != -1) {
+        fcntl(connection, F_SETFL, fcntl(connection, F_GETFL) | O_NONBLOCK);
+        fcntl(connection, F_SETFD, FD_CLOEXEC);
+        ownSocket(connection);
+    }
+    *result = connection == -1 ? NIL_VAL : NUMBER_VAL(connection);
+    return true;
+}
+
+static bool tryRead(int fd, Value* result) {
+    char buffer[SCHEDULER_READ_SIZE];
+    ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+    if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+    // nil at the end of the stream
+    *result = count <= 0 ? NIL_VAL : OBJ_VAL(copyString(buffer, (int)count));
+    return true;
+}
+
+static bool tryWrite(int fd, ObjString* data, size_t* done, Value* result) {
+    while (*done < (size_t)data->length) {
+        ssize_t count = send(fd, data->chars + *done, data->length - *done, MSG_NOSIGNAL);
+        if (count == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+            *result = NIL_VAL;
+            return true;
+        }
+        *done += count;
+    }
+    *result = NUMBER_VAL((double)*done);
+    return true;
+}
+
+// one chunk of a regular file, it's done at the end of the file
+static bool tryReadFile(int fd, Wait* wait, Value* result) {
+    if (wait->capacity < wait->length + SCHEDULER_FILE_CHUNK) {
+        wait->capacity = wait->length + SCHEDULER_FILE_CHUNK;
+        wait->buffer = (char*)realloc(wait->buffer, wait->capacity);
+        if (wait->buffer == NULL) exit(1);
+    }
+    ssize_t count = read(fd, wait->buffer + wait->length, SCHEDULER_FILE_CHUNK);
+    if (count > 0) {
+        wait->length += count;
+        return false;
+    }
+
+    *result = count == 0 ? OBJ_VAL(copyString(wait->buffer == NULL ? "" : wait->buffer, (int)wait->length))
+                         : NIL_VAL;
+    close(fd);
+    return true;
+}
+
+static bool retry(Scheduler* scheduler, int fd, Value* result) {
+    Wait* wait = &scheduler->waits[fd];
+    switch (wait->kind) {
+        case WAIT_ACCEPT: return tryAccept(fd, result);
+        case WAIT_READ: return tryRead(fd, result);
+        case WAIT_WRITE: return tryWrite(fd, wait->data, &wait->done, result);
+        case WAIT_READ_FILE: return tryReadFile(fd, wait, result);
+        case WAIT_CONNECT: {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0) closeSocket(fd);
+            *result = error == 0 ? NUMBER_VAL(fd) : NIL_VAL;
+            return true;
+        }
+        case WAIT_NONE: break;
+    }
+    return false;
+}
+
+// a descriptor this VM opened as a socket, and hasn't closed
+static bool isSocket(Value value) {
+    if (!IS_NUMBER(value) || AS_NUMBER(value) < 0 || AS_NUMBER(value) != (int)AS_NUMBER(value)) return false;
+    Scheduler* scheduler = vm->scheduler;
+    int fd = (int)AS_NUMBER(value);
+    return scheduler != NULL && fd < scheduler->socketCapacity && scheduler->sockets[fd];
+}
+
+static bool checkFiberFunction(int argCount, Value* args) {
+    if (argCount < 1 || argCount > 2 || !IS_CLOSURE(args[0])) return false;
+    ObjFunction* function = AS_CLOSURE(args[0])->function;
+    return function->arity <= 1 && !function->isGenerator;
+}
+
+// spawn(fn, [value]): a fiber running fn(value), started by the event loop
+static Value spawnNative(int argCount, Value* args) {
+    if (!checkFiberFunction(argCount, args)) {
+        return nativeError("spawn() takes a function of at most 1 parameter and its argument.");
+    }
+    ObjFiber* fiber = newFiber(AS_CLOSURE(args[0]));
+    makeReady(fiber, argCount == 2 ? args[1] : NIL_VAL);
+    return OBJ_VAL(fiber);
+}
+
+// sleep(seconds): let the other fibers run for a while
+static Value sleepNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_NUMBER(args[0])) return nativeError("sleep() takes a number of seconds.");
+    if (vm->fiber == NULL) return nativeError("Can only wait inside a fiber.");
+    addTimer(now() + AS_NUMBER(args[0]), vm->fiber);
+    vm->transfer = vm->fiber;
+    return NIL_VAL;
+}
+
+// readFileAsync(path): the contents of the file, nil if it can't be read
+static Value readFileAsyncNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_STRING(args[0])) return nativeError("readFileAsync() takes a path.");
+    int fd = open(AS_CSTRING(args[0]), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) return NIL_VAL;
+    Value result = waitOn(fd, WAIT_READ_FILE);
+    if (vm->nativeFailed) close(fd);
+    return result;
+}
+
+static bool localAddress(int port, struct sockaddr_in* address) {
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_port = htons((uint16_t)port);
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return port >= 0 && port <= 65535;
+}
+
+// listen(port): a socket accepting connections on the loopback interface
+static Value listenNative(int argCount, Value* args) {
+    struct sockaddr_in address;
+    if (argCount != 1 || !IS_NUMBER(args[0]) || !localAddress((int)AS_NUMBER(args[0]), &address)) {
+        return nativeError("listen() takes a port number.");
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+        bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        int error = errno;
+        if (fd != -1) close(fd);
+        return nativeError("Can't listen on port %d (%s).", (int)AS_NUMBER(args[0]), strerror(error));
+    }
+    ownSocket(fd);
+    return NUMBER_VAL(fd);
+}
+
+// accept(listener): the next connection
+static Value acceptNative(int argCount, Value* args) {
+    if (argCount != 1 || !isSocket(args[0])) return nativeError("accept() takes a socket.");
+    int fd = (int)AS_NUMBER(args[0]);
+    Value result;
+    if (tryAccept(fd, &result)) return result;
+    return waitOn(fd, WAIT_ACCEPT);
+}
+
+// connect(port): a connection to a port on the loopback interface
+static Value connectNative(int argCount, Value* args) {
+    struct sockaddr_in address;
+    if (argCount != 1 || !IS_NUMBER(args[0]) || !localAddress((int)AS_NUMBER(args[0]), &address)) {
+        return nativeError("connect() takes a port number.");
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return NIL_VAL;
+    ownSocket(fd);
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) return NUMBER_VAL(fd);
+    if (errno != EINPROGRESS) {
+        closeSocket(fd);
+        return NIL_VAL;
+    }
+    Value result = waitOn(fd, WAIT_CONNECT);
+    if (vm->nativeFailed) closeSocket(fd);
+    return result;
+}
+
+// read(socket): the next bytes received, nil at the end of the stream
+static Value readNative(int argCount, Value* args) {
+    if (argCount != 1 || !isSocket(args[0])) return nativeError("read() takes a socket.");
+    int fd = (int)AS_NUMBER(args[0]);
+    Value result;
+    if (tryRead(fd, &result)) return result;
+    return waitOn(fd, WAIT_READ);
+}
+
+// write(socket, string): the number of bytes written, which is all of them, nil on failure
+static Value writeNative(int argCount, Value* args) {
+    if (argCount != 2 || !isSocket(args[0]) || !IS_STRING(args[1])) {
+        return nativeError("write() takes a socket and a string.");
+    }
+    int fd = (int)AS_NUMBER(args[0]);
+    ObjString* data = AS_STRING(args[1]);
+    size_t done = 0;
+    Value result;
+    if (tryWrite(fd, data, &done, &result)) return result;
+
+    result = waitOn(fd, WAIT_WRITE);
+    if (!vm->nativeFailed) {
+        vm->scheduler->waits[fd].data = data;
+        vm->scheduler->waits[fd].done = done;
+    }
+    return result;
+}
+
+// close(socket)
+static Value closeNative(int argCount, Value* args) {
+    if (argCount != 1 || !isSocket(args[0])) return nativeError("close() takes a socket.");
+    int fd = (int)AS_NUMBER(args[0]);
+    Scheduler* scheduler = vm->scheduler;
+    // a fiber still waiting on it would never wake up, it gets nil instead
+    if (scheduler != NULL && fd < scheduler->waitCapacity && scheduler->waits[fd].kind != WAIT_NONE) {
+        endWait(scheduler, fd, NIL_VAL);
+    }
+    closeSocket(fd);
+    return NIL_VAL;
+}
+
+void defineAsyncNatives() {
+    defineNative("spawn", spawnNative);
+    defineNative("sleep", sleepNative);
+    defineNative("readFileAsync", readFileAsyncNative);
+    defineNative("listen", listenNative);
+    defineNative("accept", acceptNative);
+    defineNative("connect", connectNative);
+    defineNative("read", readNative);
+    defineNative("write", writeNative);
+    defineNative("close", closeNative);
+}
+
+// resume everything that's ready, including the fibers those make ready in turn
+static InterpretResult runReady(Scheduler* scheduler) {
+    while (scheduler->readyHead < scheduler->readyCount) {
+        // copied out: running the fiber may grow the array
+        Ready ready = scheduler->ready[scheduler->readyHead++];
+        // a fiber woken up for a closed socket may have been resumed by someone else in the meantime
+        if (ready.fiber->status != FIBER_NEW && ready.fiber->status != FIBER_SUSPENDED) continue;
+        InterpretResult result = runFiber(ready.fiber, ready.value);
+        if (result != INTERPRET_OK) return result;
+    }
+    scheduler->readyHead = 0;
+    scheduler->readyCount = 0;
+    return INTERPRET_OK;
+}
+
+InterpretResult runScheduler() {
+    Scheduler* scheduler = vm->scheduler;
+    if (scheduler == NULL) return INTERPRET_OK;
+
+    struct epoll_event events[SCHEDULER_MAX_EVENTS];
+    for (;;) {
+        InterpretResult result = runReady(scheduler);
+        if (result != INTERPRET_OK) {
+            // what's left would only run with the next program (in the REPL)
+            scheduler->readyHead = 0;
+            scheduler->readyCount = 0;
+            return result;
+        }
+
+        if (scheduler->fileReads > 0) {
+            for (int fd = 0; fd < scheduler->waitCapacity; fd++) {
+                Value value;
+                if (scheduler->waits[fd].kind == WAIT_READ_FILE && retry(scheduler, fd, &value)) {
+                    endWait(scheduler, fd, value);
+                }
+            }
+        }
+
+        double current = now();
+        while (scheduler->timerCount > 0 && scheduler->timers[0].deadline <= current) {
+            makeReady(popTimer(scheduler), NIL_VAL);
+        }
+
+        if (scheduler->readyCount == 0 && scheduler->timerCount == 0 && scheduler->waitCount == 0) break;
+
+        // don't block while there's something to do anyway
+        int timeout = -1;
+        if (scheduler->readyCount > 0 || scheduler->fileReads > 0) {
+            timeout = 0;
+        } else if (scheduler->timerCount > 0) {
+            timeout = (int)((scheduler->timers[0].deadline - current) * 1000) + 1;
+        }
+        if (scheduler->waitCount == scheduler->fileReads && timeout != 0) {
+            // only timers left, nothing for epoll to watch
+            struct timespec pause = {timeout / 1000, (long)(timeout % 1000) * 1000000};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        int count = epoll_wait(scheduler->epoll, events, SCHEDULER_MAX_EVENTS, timeout);
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            Value value;
+            if (retry(scheduler, fd, &value)) {
+                endWait(scheduler, fd, value);
+            } else {
+                // not ready after all, watch it again (the event is one-shot)
+                struct epoll_event event = events[i];
+                event.events = (scheduler->waits[fd].kind == WAIT_WRITE ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+                epoll_ctl(scheduler->epoll, EPOLL_CTL_MOD, fd, &event);
+            }
+        }
+    }
+    return INTERPRET_OK;
+}
+
+void markScheduler() {
+    Scheduler* scheduler = vm->scheduler;
+    if (scheduler == NULL) return;
+
+    for (int i = scheduler->readyHead; i < scheduler->readyCount; i++) {
+        markObject((Obj*)scheduler->ready[i].fiber);
+        markValue(scheduler->ready[i].value);
+    }
+    for (int i = 0; i < scheduler->timerCount; i++) {
+        markObject((Obj*)scheduler->timers[i].fiber);
+    }
+    for (int fd = 0; fd < scheduler->waitCapacity; fd++) {
+        markObject((Obj*)scheduler->waits[fd].fiber);
+        markObject((Obj*)scheduler->waits[fd].data);
+    }
+}
+
+#ifdef COMPACTING_GC
+void forwardScheduler() {
+    Scheduler* scheduler = vm->scheduler;
+    if (scheduler == NULL) return;
+
+    for (int i = scheduler->readyHead; i < scheduler->readyCount; i++) {
+        forwardValue(&scheduler->ready[i].value);
+    }
+}
+#endif
+
+void freeScheduler() {
+    Scheduler* scheduler = vm->scheduler;
+    if (scheduler == NULL) return;
+
+    for (int fd = 0; fd < scheduler->waitCapacity; fd++) {
+        free(scheduler->waits[fd].buffer);
+    }
+    for (int fd = 0; fd < scheduler->socketCapacity; fd++) {
+        if (scheduler->sockets[fd]) close(fd);
+    }
+    close(scheduler->epoll);
+    free(scheduler->sockets);
+    free(scheduler->waits);
+    free(scheduler->timers);
+    free(scheduler->ready);
+    free(scheduler);
+    vm->scheduler = NULL;
+}
+
+#endif
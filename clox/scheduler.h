@@ -0,0 +1,26 @@
+#ifndef clox_scheduler_h
+#define clox_scheduler_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// bytes a file read takes per turn of the event loop, so one big file doesn't hold up the other fibers
+#define SCHEDULER_FILE_CHUNK (64 * 1024)
+// bytes a single `read()` on a socket returns at most
+#define SCHEDULER_READ_SIZE 4096
+// events taken from epoll per turn of the event loop
+#define SCHEDULER_MAX_EVENTS 64
+
+struct Scheduler;
+
+// spawn, sleep, readFileAsync and the socket natives
+void defineAsyncNatives();
+// run the event loop until no fiber is ready or waiting any more, called once the main program is done
+InterpretResult runScheduler();
+void markScheduler();
+// the values the ready fibers get resumed with, during a compaction (see compactor.c)
+void forwardScheduler();
+void freeScheduler();
+
+#endif
@@ -1,10 +1,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "collector.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
 
 #define TABLE_MAX_LOAD 0.75
 
@@ -89,9 +91,12 @@ static void adjustCapacity(Table* table, int capacity) {
     }
 
     // release the old array
+    // note: the collector thread may be in the middle of marking the old one (see collector.c)
+    lockTables();
     FREE_ARRAY(Entry, table->entries, table->capacity);
     table->entries = entries;
     table->capacity = capacity;
+    unlockTables();
 }
 
 // add the given key/value pair to the given hash table
@@ -108,6 +113,14 @@ bool tableSet(Table* table, ObjString* key, Value value) {
     // increment count only if the new entry goes into an entirely empty bucket (not reusing tombstone)
     if (isNewKey && IS_NIL(entry->value)) table->count++;
 
+#ifdef CONCURRENT_GC
+    // the barrier only matters while the collector thread marks (see collector.c)
+    // and the string table is weak, it doesn't keep anything alive
+    if (vm->marking && table != &vm->strings) {
+        WRITE_BARRIER(OBJ_VAL(key));
+        WRITE_BARRIER(value);
+    }
+#endif
     entry->key = key;
     entry->value = value;
     return isNewKey;
@@ -170,7 +183,7 @@ void tableRemoveWhite(Table* table) {
     // they are definitely unreachable, yet still need to be removed during GC
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
+        if (entry->key != NULL && !atomic_load_explicit(&entry->key->obj.isMarked, memory_order_relaxed)) {
             tableDelete(table, entry->key);
         }
     }
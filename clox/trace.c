@@ -0,0 +1,231 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "trace.h"
+
+#ifdef TRACING_JIT
+
+#include "memory.h"
+
+// Tracing JIT for loops executed by the interpreter.
+// Every back-edge (OP_LOOP) is counted per loop, under the number the compiler gave its OP_LOOP.
+// Once a loop gets hot, the instructions of its next iteration are recorded together with the
+// types they saw (by a dispatch loop of `run` that does nothing else), and compiled by jit.c
+// into a native loop with guards. From then on the interpreter runs the trace whenever it
+// reaches the loop header, until a guard fails and it has to take over again.
+
+// find loop number `loop` of the function, or start counting it (its back-edge jumps to `header`)
+static Trace* findTrace(ObjFunction* function, int loop, int header) {
+    if (function->traces == NULL) {
+        function->traces = (Trace**)calloc(function->loopCount, sizeof(Trace*));
+        if (function->traces == NULL) exit(1);
+    }
+    if (function->traces[loop] != NULL) return function->traces[loop];
+
+    Trace* trace = (Trace*)malloc(sizeof(Trace));
+    if (trace == NULL) exit(1);
+    trace->header = header;
+    trace->hotness = 0;
+    trace->aborts = 0;
+    trace->failedRuns = 0;
+    trace->entryDepth = 0;
+    trace->steps = NULL;
+    trace->length = 0;
+    trace->capacity = 0;
+    trace->code = NULL;
+    trace->entries = 0;
+    trace->iterations = 0;
+    function->traces[loop] = trace;
+    return trace;
+}
+
+JitStatus traceLoop(CallFrame* frame, int loop) {
+    if (loop == LOOP_UNNUMBERED) return JIT_INTERPRET;
+
+    ObjFunction* function = frame->closure->function;
+    Trace* trace = findTrace(function, loop, (int)(frame->ip - function->chunk.code));
+    if (trace->code != NULL) {
+        // the recorder can't see what compiled code executes: an outer loop would get a trace
+        // with a hole where this inner loop ran, and wrong stack slots after it
+        if (vm->recording != NULL) traceAbort();
+        uint64_t iterations = trace->iterations;
+        trace->entries++;
+        JitStatus status = jitExecuteTrace(frame, trace->code);
+        if (trace->iterations != iterations) {
+            trace->failedRuns = 0;
+        } else if (++trace->failedRuns == TRACE_MAX_FAILED_RUNS) {
+            jitFree(trace->code);
+            trace->code = NULL;
+            trace->failedRuns = 0;
+            trace->aborts++;
+        }
+        return status;
+    }
+
+    // only one recording at a time, the innermost loop usually gets hot first
+    if (vm->recording == NULL && trace->aborts < TRACE_MAX_ABORTS && ++trace->hotness >= TRACE_HOT_LOOPS) {
+        trace->length = 0;
+        // the stack height at a loop header is the same every iteration (just the locals in scope)
+        trace->entryDepth = (int)(vm->stackTop - frame->slots);
+        vm->recording = trace;
+        vm->recordingFrame = (int)(frame - vm->frames);
+    }
+    return JIT_INTERPRET;
+}
+
+void traceAbort() {
+    vm->recording->aborts++;
+    vm->recording->hotness = 0;
+    vm->recording = NULL;
+}
+
+static void appendStep(Trace* trace, int offset, uint8_t observed) {
+    if (trace->capacity < trace->length + 1) {
+        trace->capacity = GROW_CAPACITY(trace->capacity);
+        trace->steps = (TraceStep*)realloc(trace->steps, sizeof(TraceStep) * trace->capacity);
+        if (trace->steps == NULL) exit(1);
+    }
+    trace->steps[trace->length].offset = offset;
+    trace->steps[trace->length].observed = observed;
+    trace->length++;
+}
+
+static uint8_t observeNumbers(Value a, Value b) {
+    return IS_NUMBER(a) && IS_NUMBER(b) ? OBSERVED_NUMBERS : 0;
+}
+
+void traceRecord(CallFrame* frame) {
+    Trace* trace = vm->recording;
+    if (frame != &vm->frames[vm->recordingFrame]) {
+        traceAbort();
+        return;
+    }
+
+    ObjFunction* function = frame->closure->function;
+    Value* constants = function->chunk.constants.values;
+    uint8_t* ip = frame->ip;
+    int offset = (int)(ip - function->chunk.code);
+    uint8_t observed = 0;
+
+    switch (*ip) {
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+        case OP_CLOSURE:
+        case OP_RETURN:
+        case OP_YIELD:
+        case OP_CLASS:
+        case OP_INHERIT:
+        case OP_METHOD:
+            // a trace stays within one frame and doesn't build classes or closures
+            traceAbort();
+            return;
+        case OP_LOOP: {
+            int target = offset + 4 - (uint16_t)(ip[1] << 8 | ip[2]);
+            if (target != trace->header) {
+                // a `for` loop jumps back twice per iteration (to the increment, then to the condition)
+                // only a jump back into what we've recorded already is an inner loop,
+                // which will get a trace of its own
+                for (int i = 0; i < trace->length; i++) {
+                    if (trace->steps[i].offset == target) {
+                        traceAbort();
+                        return;
+                    }
+                }
+                break;
+            }
+
+            // back at the header: the iteration is complete
+            appendStep(trace, offset, 0);
+            vm->recording = NULL;
+            trace->code = jitCompileTrace(function, trace);
+            if (trace->code == NULL) trace->aborts = TRACE_MAX_ABORTS;
+            return;
+        }
+        case OP_CALL_INLINE:
+        case OP_INVOKE_INLINE:
+            // the trace follows the inlined body, a real call would leave the frame
+            if (!inlineGuardHolds(frame, ip)) {
+                traceAbort();
+                return;
+            }
+            break;
+        case OP_JUMP_IF_FALSE:
+            if (isFalsey(vm->stackTop[-1])) observed = OBSERVED_FALSEY;
+            break;
+        case OP_NEGATE:
+            if (IS_NUMBER(vm->stackTop[-1])) observed = OBSERVED_NUMBERS;
+            break;
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            observed = observeNumbers(vm->stackTop[-2], vm->stackTop[-1]);
+            break;
+        case OP_ADD_LL:
+        case OP_SUBTRACT_LL:
+        case OP_MULTIPLY_LL:
+        case OP_DIVIDE_LL:
+        case OP_LESS_LL:
+        case OP_GREATER_LL:
+            observed = observeNumbers(frame->slots[ip[1]], frame->slots[ip[2]]);
+            break;
+        case OP_ADD_LK:
+        case OP_SUBTRACT_LK:
+        case OP_MULTIPLY_LK:
+        case OP_DIVIDE_LK:
+        case OP_LESS_LK:
+        case OP_GREATER_LK:
+            observed = observeNumbers(frame->slots[ip[1]], constants[ip[2]]);
+            break;
+    }
+
+    if (trace->length == TRACE_MAX_LENGTH) {
+        traceAbort();
+        return;
+    }
+    appendStep(trace, offset, observed);
+}
+
+void freeTraces(Trace** traces, int loopCount) {
+    if (traces == NULL) return;
+    for (int i = 0; i < loopCount; i++) {
+        if (traces[i] == NULL) continue;
+        jitFree(traces[i]->code);
+        free(traces[i]->steps);
+        free(traces[i]);
+    }
+    free(traces);
+}
+
+void printTraceStats() {
+    fprintf(stderr, "%-20s %6s %8s %6s %10s %12s\n", "function", "line", "status", "steps", "entries", "iterations");
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+        if (object->type != OBJ_FUNCTION) continue;
+
+        ObjFunction* function = (ObjFunction*)object;
+        for (int i = 0; function->traces != NULL && i < function->loopCount; i++) {
+            Trace* trace = function->traces[i];
+            if (trace == NULL) continue;
+            const char* status = "cold";
+            if (trace->code != NULL) {
+                status = "compiled";
+            } else if (trace->aborts >= TRACE_MAX_ABORTS) {
+                status = "aborted";
+            }
+            fprintf(stderr, "%-20s %6d %8s %6d %10" PRIu64 " %12" PRIu64 "\n",
+                    function->name == NULL ? "<script>" : function->name->chars,
+                    function->chunk.lines[trace->header], status, trace->length,
+                    trace->entries, trace->iterations);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "jit.h"
+#include "object.h"
+#include "vm.h"
+
+// a loop's back-edge has to be taken this many times before we record a trace for it
+#define TRACE_HOT_LOOPS 50
+// longer traces are aborted, the loop body is probably too branchy to be worth it
+#define TRACE_MAX_LENGTH 1024
+// after this many aborted recordings the loop is left to the interpreter for good
+#define TRACE_MAX_ABORTS 3
+// a trace leaving this many times in a row without completing an iteration is recorded again,
+// the path through the loop body has most likely changed since it was recorded
+#define TRACE_MAX_FAILED_RUNS 20
+
+// what the recorder saw while the instruction executed
+#define OBSERVED_NUMBERS 0x1 // all operands were numbers
+#define OBSERVED_FALSEY  0x2 // the condition of OP_JUMP_IF_FALSE was falsey (the jump was taken)
+
+// one executed instruction of a trace
+typedef struct {
+    int offset; // bytecode offset of the instruction
+    uint8_t observed;
+} TraceStep;
+
+// a loop, found by the number of its OP_LOOP, and its trace once there is one
+typedef struct Trace {
+    int header; // bytecode offset of the first instruction of the loop
+    int hotness; // back-edges taken so far (while there's no code yet)
+    int aborts; // failed recordings (and traces thrown away)
+    int failedRuns; // consecutive runs of `code` which left before the first back-edge
+    int entryDepth; // stack slots in use at the loop header
+
+    TraceStep* steps;
+    int length;
+    int capacity;
+
+    JitCode* code; // NULL until the recorded trace is compiled
+
+    // statistics for `--trace-stats`
+    uint64_t entries; // times the interpreter jumped into `code`
+    uint64_t iterations; // back-edges taken inside `code`
+} Trace;
+
+// called by `run()` whenever OP_LOOP number `loop` jumped back, runs the loop's trace if it has one
+// returns JIT_INTERPRET to go on interpreting at frame->ip (or JIT_RUNTIME_ERROR)
+// a recording it starts is left to `run()`'s recording loop
+JitStatus traceLoop(CallFrame* frame, int loop);
+// called by `run()` before each instruction while a trace is being recorded
+void traceRecord(CallFrame* frame);
+void traceAbort();
+void freeTraces(Trace** traces, int loopCount);
+void printTraceStats();
+
+#endif
@@ -1,29 +1,95 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "common.h"
+#include "allocprof.h"
+#include "callprof.h"
+#include "collector.h"
+#include "compactor.h"
 #include "compiler.h"
+#include "cpuprof.h"
 #include "debug.h"
+#include "jit.h"
+#include "marker.h"
 #include "object.h"
 #include "memory.h"
+#include "opstats.h"
+#include "perfcount.h"
+#include "scheduler.h"
+#include "trace.h"
 #include "vm.h"
 
-VM vm;
+// see vm.h
+_Thread_local VM* vm = NULL;
 
 static Value clockNative(int argCount, Value* args) {
     // clock(void) returns the number of clock ticks elapsed since the program was launched
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+// Fiber(fn): a fiber that runs `fn` (taking no or one argument) once it's resumed
+static Value fiberNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_CLOSURE(args[0])) return nativeError("Fiber() takes a function.");
+    if (AS_CLOSURE(args[0])->function->isGenerator) return nativeError("A fiber's function can't be a generator.");
+    int arity = AS_CLOSURE(args[0])->function->arity;
+    if (arity > 1) return nativeError("A fiber's function takes at most 1 argument but got %d.", arity);
+    return OBJ_VAL(newFiber(AS_CLOSURE(args[0])));
+}
+
+// resume(fiber, [value]): run the fiber until it suspends or returns, and evaluate to what it passed out
+// `value` is the argument of the fiber's function on the first resume, and the result of `suspend()` after that
+static Value resumeNative(int argCount, Value* args) {
+    if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0])) return nativeError("resume() takes a fiber and a value.");
+    ObjFiber* fiber = AS_FIBER(args[0]);
+    if (fiber->status == FIBER_RUNNING) return nativeError("Can't resume a running fiber.");
+    if (fiber->status == FIBER_DONE) return nativeError("Can't resume a finished fiber.");
+    vm->transfer = fiber;
+    return argCount == 2 ? args[1] : NIL_VAL;
+}
+
+// suspend([value]): hand control back to the resumer of the running fiber, whose `resume` evaluates to `value`
+static Value suspendNative(int argCount, Value* args) {
+    if (argCount > 1) return nativeError("suspend() takes at most 1 argument but got %d.", argCount);
+    if (vm->fiber == NULL) return nativeError("Can only suspend inside a fiber.");
+    vm->transfer = vm->fiber;
+    return argCount == 1 ? args[0] : NIL_VAL;
+}
+
+// isDone(fiber or generator): whether its function has returned
+static Value isDoneNative(int argCount, Value* args) {
+    if (argCount == 1 && IS_GENERATOR(args[0])) return BOOL_VAL(AS_GENERATOR(args[0])->status == GENERATOR_DONE);
+    if (argCount != 1 || !IS_FIBER(args[0])) return nativeError("isDone() takes a fiber or a generator.");
+    return BOOL_VAL(AS_FIBER(args[0])->status == FIBER_DONE);
+}
+
+// the generators running in the current stacks won't get their frames back
+static void endGenerators() {
+    for (int i = 0; i < vm->frameCount; i++) {
+        if (vm->frames[i].generator != NULL) vm->frames[i].generator->status = GENERATOR_DONE;
+    }
+}
+
 static void resetStack() {
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    // a runtime error ends the running fiber and all fibers waiting on it, back to the main program
+    // along with every generator running in them
+    endGenerators();
+    while (vm->fiber != NULL) {
+        leaveFiber(FIBER_DONE);
+        endGenerators();
+    }
+    vm->transfer = NULL;
+
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
+    // a runtime error ends any recording
+    vm->recording = NULL;
 }
 
-static void runtimeError(const char* format, ...) {
+void runtimeError(const char* format, ...) {
     // forward formatting to printf
     va_list args;
     va_start(args, format);
@@ -32,12 +98,23 @@ static void runtimeError(const char* format, ...) {
     fputs("\n", stderr);
 
     // print stack trace (innermost first)
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        // a runaway recursion only shows both ends of the stack
+        if (i == vm->frameCount - STACK_TRACE_ENDS - 1 && i >= STACK_TRACE_ENDS) {
+            fprintf(stderr, "... %d more frames ...\n", i - STACK_TRACE_ENDS + 1);
+            i = STACK_TRACE_ENDS - 1;
+        }
+        CallFrame* frame = &vm->frames[i];
         ObjFunction* function = frame->closure->function;
         // -1: ip already sitting on the next instruction to be executed, but we want the previous failed instruction.
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        // an inlined call has no frame of its own, show the one it would have had
+        InlineSite* site = findInlineSite(&function->chunk, (int)instruction);
+        if (site != NULL) {
+            fprintf(stderr, "[line %d] in %s()\n", function->chunk.lines[instruction],
+                    AS_FUNCTION(site->function)->name->chars);
+        }
+        fprintf(stderr, "[line %d] in ", site != NULL ? site->line : function->chunk.lines[instruction]);
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -48,98 +125,437 @@ static void runtimeError(const char* format, ...) {
     resetStack();
 }
 
+// natives report a runtime error by returning this, the call fails as soon as the native returns
+Value nativeError(const char* format, ...) {
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    runtimeError("%s", message);
+    vm->nativeFailed = true;
+    return NIL_VAL;
+}
+
 // define a new native function exposed to Lox programs
-static void defineNative(const char* name, NativeFn function) {
+void defineNative(const char* name, NativeFn function) {
     // push and pop on the stack: ensure GC knows we're not done with the name and ObjFunction yet.
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    push(OBJ_VAL(internString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    tableSet(&vm->natives, AS_STRING(vm->stack[0]), vm->stack[1]);
     pop();
     pop();
 }
 
-void initVM() {
+VM* newVM() {
+    VM* instance = (VM*)malloc(sizeof(VM));
+    if (instance == NULL) exit(1);
+    // everything allocated from here on belongs to the new VM
+    VM* previous = vm;
+    vm = instance;
+
+    initGcStats(&vm->gcStats);
+    vm->allocProfile = NULL;
+    vm->callProfile = NULL;
+    vm->cpuProfile = NULL;
+    vm->perfCounters = NULL;
+    vm->opcodeStats = NULL;
+    vm->framesMoving = false;
+    vm->frames = NULL;
+    vm->frameCapacity = 0;
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    // note: plain `realloc` like the gray stack, growing the stacks mustn't trigger a GC
+    vm->frames = (CallFrame*)realloc(vm->frames, sizeof(CallFrame) * FRAMES_INITIAL);
+    vm->stack = (Value*)realloc(vm->stack, sizeof(Value) * STACK_INITIAL);
+    if (vm->frames == NULL || vm->stack == NULL) exit(1);
+    vm->frameCapacity = FRAMES_INITIAL;
+    vm->stackCapacity = STACK_INITIAL;
+    vm->frameCount = 0;
+    vm->fiber = NULL;
+    vm->nativeFailed = false;
+    vm->scheduler = NULL;
     resetStack();
-    vm.objects = NULL;
-    vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    vm->objects = NULL;
+    // the stacks are counted as well, a fiber's are freed along with it (see `freeObject`)
+    vm->bytesAllocated = sizeof(CallFrame) * vm->frameCapacity + sizeof(Value) * vm->stackCapacity;
+    vm->gcGrowFactor = GC_HEAP_GROW_FACTOR;
+    vm->gcGrowth = GC_HEAP_GROW_FACTOR;
+    vm->gcTarget = GC_TARGET_PERCENT;
+    vm->gcMinHeap = GC_MIN_HEAP;
+    vm->gcMaxHeap = 0;
+    vm->nextGC = GC_MIN_HEAP;
+    vm->gcIdleSince = gcClock();
 
-    vm.grayCount = 0;
-    vm.grayCapacity = 0;
-    vm.grayStack = NULL;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+#ifdef PARALLEL_MARK
+    vm->gcThreads = gcThreadsAvailable();
+#else
+    vm->gcThreads = 1;
+#endif
+    vm->markPool = NULL;
+    vm->concurrentGC = false;
+    vm->marking = false;
+    vm->collector = NULL;
+    vm->compactGC = false;
+    vm->interrupts = 0;
+    vm->compactor = NULL;
+
+    initTable(&vm->globals);
+    initTable(&vm->natives);
+    initTable(&vm->strings);
 
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+    // explicitly zero `vm->initString` to prevent GC read its uninitialized state
+    vm->initString = NULL;
+    vm->initString = internString("init", 4);
 
-    // explicitly zero `vm.initString` to prevent GC read its uninitialized state
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
+    vm->jitEnabled = true;
+    vm->traceStats = false;
+    vm->inlineEnabled = true;
+    vm->inlineReport = false;
+    vm->printCode = false;
+    vm->traceExecution = false;
 
     defineNative("clock", clockNative);
+    defineNative("Fiber", fiberNative);
+    defineNative("resume", resumeNative);
+    defineNative("suspend", suspendNative);
+    defineNative("isDone", isDoneNative);
+    defineGcNatives();
+    defineNative("allocReport", allocReportNative);
+#ifdef ASYNC_IO
+    defineAsyncNatives();
+#endif
+
+    vm = previous;
+    return instance;
 }
 
-void freeVM() {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    vm.initString = NULL;
+void freeVM(VM* instance) {
+    VM* previous = vm;
+    vm = instance;
+#ifdef CONCURRENT_GC
+    freeCollector();
+#endif
+    finishGcStats();
+    finishAllocProfile();
+    finishCallProfile();
+#ifdef CPU_PROFILER
+    finishCpuProfile();
+#endif
+#ifdef PERF_COUNTERS
+    finishPerfCounters();
+#endif
+#ifdef OPCODE_STATS
+    finishOpcodeStats();
+#endif
+#ifdef TRACING_JIT
+    if (vm->traceStats) printTraceStats();
+#endif
+    freeTable(&vm->globals);
+    freeTable(&vm->natives);
+    freeTable(&vm->strings);
+    vm->initString = NULL;
+#ifdef ASYNC_IO
+    freeScheduler();
+#endif
+#ifdef PARALLEL_MARK
+    freeMarkers();
+#endif
     freeObjects();
+#ifdef COMPACTING_GC
+    freeCompactor();
+#endif
+    free(vm->frames);
+    free(vm->stack);
+    free(instance);
+    vm = previous == instance ? NULL : previous;
 }
 
 void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
 Value pop() {
-    vm.stackTop--;
+    vm->stackTop--;
     // no need to explicitly erase
-    return *vm.stackTop;
+    return *vm->stackTop;
 }
 
 // return a Value from stack, but doesn't pop it
 // `distance`: 0 is the top, 1 is one slot down
 static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+    return vm->stackTop[-1 - distance];
 }
 
-// initializes the next CallFrame on the stack
-static bool call(ObjClosure* closure, int argCount) {
-    if (argCount != closure->function->arity) {
-        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
-        return false;
+// move the value stack to a bigger array, with room for at least `slots` values
+// everything still pointing into the old one has to be moved over: the stack top,
+// the window of every CallFrame, and the open upvalues
+static void growStack(int slots) {
+    int capacity = vm->stackCapacity;
+    while (capacity < slots) capacity = GROW_CAPACITY(capacity);
+
+    Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+    if (stack == NULL) exit(1);
+    memcpy(stack, vm->stack, sizeof(Value) * (vm->stackTop - vm->stack));
+
+    vm->stackTop = stack + (vm->stackTop - vm->stack);
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
     }
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+
+    free(vm->stack);
+    vm->stack = stack;
+    // the stacks count towards the heap, yet growing them doesn't start a collection right away
+    vm->bytesAllocated += sizeof(Value) * (capacity - vm->stackCapacity);
+    vm->stackCapacity = capacity;
+}
+
+// exchange the stacks (and open upvalues) in use with the ones kept in `fiber`
+static void swapStacks(ObjFiber* fiber) {
+#define SWAP(type, field) \
+    do { \
+        type field = vm->field; \
+        vm->field = fiber->field; \
+        fiber->field = field; \
+    } while (false)
+
+    vm->framesMoving = true;
+    atomic_signal_fence(memory_order_seq_cst);
+    SWAP(CallFrame*, frames);
+    SWAP(int, frameCount);
+    SWAP(int, frameCapacity);
+    atomic_signal_fence(memory_order_seq_cst);
+    vm->framesMoving = false;
+    SWAP(Value*, stack);
+    SWAP(Value*, stackTop);
+    SWAP(int, stackCapacity);
+    SWAP(ObjUpvalue*, openUpvalues);
+#undef SWAP
+}
+
+// count calls until the function is hot enough to be worth compiling
+// a negative count means the JIT gave up on it
+static ALWAYS_INLINE void countCall(VM* const vm, ObjFunction* function) {
+#ifdef BASELINE_JIT
+    if (vm->jitEnabled && function->jit == NULL && function->callCount >= 0 &&
+        ++function->callCount >= JIT_HOT_CALLS) {
+        jitCompile(function);
+    }
+#else
+    (void)vm;
+    (void)function;
+#endif
+}
 
-    if (vm.frameCount == FRAMES_MAX) {
+// make room for one more CallFrame, and for `slots` more values above the stack top
+// note: growing either stack invalidates any CallFrame* or stack pointer the caller holds
+static bool reserveFrame(int slots) {
+    if (vm->frameCount == FRAMES_MAX) {
         runtimeError("Stack overflow.");
         return false;
     }
+    if (vm->frameCount == vm->frameCapacity) {
+        vm->framesMoving = true;
+        atomic_signal_fence(memory_order_seq_cst);
+        int capacity = GROW_CAPACITY(vm->frameCapacity);
+        vm->frames = (CallFrame*)realloc(vm->frames, sizeof(CallFrame) * capacity);
+        if (vm->frames == NULL) exit(1);
+        vm->bytesAllocated += sizeof(CallFrame) * (capacity - vm->frameCapacity);
+        vm->frameCapacity = capacity;
+        atomic_signal_fence(memory_order_seq_cst);
+        vm->framesMoving = false;
+    }
+    slots += (int)(vm->stackTop - vm->stack);
+    if (slots > vm->stackCapacity) growStack(slots);
+    return true;
+}
+
+// keep the stack window [slots, slots + count) in the generator, along with the open upvalues pointing into it
+// the window is the topmost one, so those upvalues are at the head of the (sorted) list
+static void saveWindow(ObjGenerator* generator, Value* slots, int count) {
+    if (count > generator->slotCapacity) {
+        generator->slotCapacity = count;
+        generator->slots = (Value*)realloc(generator->slots, sizeof(Value) * count);
+        if (generator->slots == NULL) exit(1);
+    }
+    memcpy(generator->slots, slots, sizeof(Value) * count);
+    generator->slotCount = count;
+
+    ObjUpvalue** tail = &generator->openUpvalues;
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= slots) {
+        ObjUpvalue* upvalue = vm->openUpvalues;
+        vm->openUpvalues = upvalue->next;
+        upvalue->location = generator->slots + (upvalue->location - slots);
+        SHARED_STORE(upvalue->owner, (Obj*)generator);
+        upvalue->next = NULL;
+        *tail = upvalue;
+        tail = &upvalue->next;
+    }
+}
+
+// calling a generator function runs none of its body yet: the callee and the arguments
+// become the window of the generator, which takes their place on the stack
+static bool callGenerator(ObjClosure* closure, int argCount) {
+    ObjGenerator* generator = newGenerator(closure);
+    saveWindow(generator, vm->stackTop - argCount - 1, argCount + 1);
+    vm->stackTop -= argCount + 1;
+    push(OBJ_VAL(generator));
+    return true;
+}
+
+// initializes the next CallFrame on the stack
+// the body of `call`, copied into the dispatch loop for OP_CALL on a closure (see `execute`)
+static ALWAYS_INLINE bool callClosure(VM* const vm, ObjClosure* closure, int argCount) {
+    ObjFunction* function = closure->function;
+    if (argCount != function->arity) {
+        runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+    if (function->isGenerator) return callGenerator(closure, argCount);
+
+    // both stacks nearly always have room to spare, `reserveFrame` grows them (or overflows) when not
+    // the frame capacity doubles up to FRAMES_MAX, so a full array is also where the overflow is caught
+    if (vm->frameCount == vm->frameCapacity ||
+        (int)(vm->stackTop - vm->stack) + function->maxSlots > vm->stackCapacity) {
+        if (!reserveFrame(function->maxSlots)) return false;
+    }
+
+    countCall(vm, function);
 
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    CallFrame* frame = &vm->frames[vm->frameCount];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->ip = function->chunk.code;
     // ensure the argument already on the stack line up with parameters
     // -1: account for stack slot 0 set aside by compiler (for when we add methods later)
     // parameters starts at slot 1
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = vm->stackTop - argCount - 1;
+    frame->generator = NULL;
+    // not entered yet, as far as the call profile goes (see `execute`)
+    frame->profileStart = 0;
+    // counted once it's filled in, the CPU profiler may read it right away
+    atomic_signal_fence(memory_order_release);
+    vm->frameCount++;
+    return true;
+}
+
+static bool call(ObjClosure* closure, int argCount) {
+    return callClosure(vm, closure, argCount);
+}
+
+// calling a generator: its saved window goes back onto the stack, in place of the generator,
+// and the frame goes on from where it last yielded until it yields or returns again
+static bool resumeGenerator(ObjGenerator* generator, int argCount) {
+    if (argCount != 0) {
+        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return false;
+    }
+    if (generator->status == GENERATOR_RUNNING) {
+        runtimeError("Generator is already running.");
+        return false;
+    }
+    if (generator->status == GENERATOR_DONE) {
+        // a finished generator keeps producing nil
+        vm->stackTop[-1] = NIL_VAL;
+        return true;
+    }
+
+    if (!reserveFrame(generator->closure->function->maxSlots)) return false;
+
+    Value* slots = vm->stackTop - 1;
+    memcpy(slots, generator->slots, sizeof(Value) * generator->slotCount);
+    vm->stackTop = slots + generator->slotCount;
+
+    // its upvalues point above every other open one, so they go at the head of the list
+    ObjUpvalue* upvalue = generator->openUpvalues;
+    if (upvalue != NULL) {
+        ObjUpvalue* last = NULL;
+        for (; upvalue != NULL; upvalue = upvalue->next) {
+            upvalue->location = slots + (upvalue->location - generator->slots);
+            SHARED_STORE(upvalue->owner, (Obj*)vm->fiber);
+            last = upvalue;
+        }
+        last->next = vm->openUpvalues;
+        vm->openUpvalues = generator->openUpvalues;
+        generator->openUpvalues = NULL;
+    }
+
+    CallFrame* frame = &vm->frames[vm->frameCount];
+    frame->closure = generator->closure;
+    frame->ip = generator->ip;
+    frame->slots = slots;
+    frame->generator = generator;
+    frame->profileStart = 0;
+    atomic_signal_fence(memory_order_release);
+    vm->frameCount++;
+    generator->status = GENERATOR_RUNNING;
+    return true;
+}
+
+// run `fiber` on the VM, while the current stacks are kept in it until it suspends or returns
+static bool resumeFiber(ObjFiber* fiber, Value value) {
+    swapStacks(fiber);
+    fiber->caller = vm->fiber;
+    vm->fiber = fiber;
+
+    if (fiber->status == FIBER_NEW) {
+        fiber->status = FIBER_RUNNING;
+        int arity = fiber->closure->function->arity;
+        push(OBJ_VAL(fiber->closure));
+        if (arity == 1) push(value);
+        return call(fiber->closure, arity);
+    }
+
+    fiber->status = FIBER_RUNNING;
+    // what `suspend()` evaluates to inside the fiber
+    push(value);
+    return true;
+}
+
+// give the stacks back to the resumer of the running fiber
+// the caller pushes the result of its `resume()`
+void leaveFiber(FiberStatus status) {
+    ObjFiber* fiber = vm->fiber;
+    swapStacks(fiber);
+    vm->fiber = fiber->caller;
+    fiber->caller = NULL;
+    fiber->status = status;
+}
+
+static bool transferControl(Value result) {
+    ObjFiber* fiber = vm->transfer;
+    vm->transfer = NULL;
+    if (fiber != vm->fiber) return resumeFiber(fiber, result);
+
+    leaveFiber(FIBER_SUSPENDED);
+    push(result);
     return true;
 }
 
 // make sure the callee is indeed callable
-static bool callValue(Value callee, int argCount) {
+// the body of `callValue`, copied into the dispatch loop for OP_CALL (see `execute`)
+static ALWAYS_INLINE bool callObject(VM* const vm, Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-                vm.stackTop[-argCount - 1] = bound->receiver;
-                return call(bound->method, argCount);
+                vm->stackTop[-argCount - 1] = bound->receiver;
+                return callClosure(vm, bound->method, argCount);
             }
             case OBJ_CLASS: {
                 ObjClass* klass = AS_CLASS(callee);
-                vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
                 Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)) {
+                if (tableGet(&klass->methods, vm->initString, &initializer)) {
                     // note: at execution, the arguments are already on stack
-                    return call(AS_CLOSURE(initializer), argCount);
+                    return callClosure(vm, AS_CLOSURE(initializer), argCount);
                 } else if (argCount != 0) {
                     // passing arguments when there is no initializer
                     runtimeError("Expect 0 arguments but got %d.", argCount);
@@ -148,14 +564,22 @@ static bool callValue(Value callee, int argCount) {
                 return true;
             }
             case OBJ_CLOSURE:
-                return call(AS_CLOSURE(callee), argCount);
+                return callClosure(vm, AS_CLOSURE(callee), argCount);
+            case OBJ_GENERATOR:
+                return resumeGenerator(AS_GENERATOR(callee), argCount);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
                 // invoke the underlying C function
-                Value result = native(argCount, vm.stackTop - argCount);
+                Value result = native(argCount, vm->stackTop - argCount);
+                if (vm->nativeFailed) {
+                    vm->nativeFailed = false;
+                    return false;
+                }
                 // note: the callee is also popped out along with arguments
-                vm.stackTop -= argCount + 1;
-                push(result);
+                vm->stackTop -= argCount + 1;
+                // `resume` and `suspend` switch to another fiber's stacks, the result goes there
+                if (vm->transfer != NULL) return transferControl(result);
+                *vm->stackTop++ = result;
                 return true;
             }
             default:
@@ -166,19 +590,63 @@ static bool callValue(Value callee, int argCount) {
     return false;
 }
 
-static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
+bool callValue(Value callee, int argCount) {
+    return callObject(vm, callee, argCount);
+}
+
+// OP_TAIL_CALL: the caller is done with its locals, so a Lox callee takes over the caller's CallFrame
+// and the arguments are moved down to its stack window, a tail-recursive loop never runs out of frames
+// anything else is called the usual way, the OP_RETURN following OP_TAIL_CALL returns its result
+bool tailCall(Value callee, int argCount) {
+    ObjClosure* closure;
+    if (IS_CLOSURE(callee)) {
+        closure = AS_CLOSURE(callee);
+    } else if (IS_BOUND_METHOD(callee)) {
+        ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        closure = bound->method;
+    } else {
+        return callValue(callee, argCount);
+    }
+    // calling a generator function only creates the generator
+    if (closure->function->isGenerator) return call(closure, argCount);
+
+    if (argCount != closure->function->arity) {
+        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        return false;
+    }
+    countCall(vm, closure->function);
+
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    // the callee's window starts where the caller's did, and may go deeper
+    int slots = (int)(frame->slots - vm->stack) + closure->function->maxSlots;
+    if (slots > vm->stackCapacity) growStack(slots);
+    // the upvalues still pointing into the stack window are about to be overwritten
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, vm->stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm->stackTop = frame->slots + argCount + 1;
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    frame->profileStart = 0;
+    return true;
+}
+
+// `tail`: the method takes over the caller's CallFrame (OP_TAIL_INVOKE / OP_TAIL_SUPER_INVOKE, see `tailCall`)
+// the bodies of `invokeFromClass` and `invoke`, copied into the dispatch loop for OP_INVOKE (see `execute`)
+static ALWAYS_INLINE bool invokeClass(VM* const vm, ObjClass* klass, ObjString* name, int argCount, bool tail) {
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
     // note: at execution, the receiver and method arguments are already where right where they need to be
-    return call(AS_CLOSURE(method), argCount);
+    if (tail) return tailCall(method, argCount);
+    return callClosure(vm, AS_CLOSURE(method), argCount);
 }
 
 // invoke: access a method and immediately calls it
-static bool invoke(ObjString* name, int argCount) {
-    Value receiver = peek(argCount);
+static ALWAYS_INLINE bool invokeMethod(VM* const vm, ObjString* name, int argCount, bool tail) {
+    Value receiver = vm->stackTop[-1 - argCount];
 
     if (!IS_INSTANCE(receiver)) {
         runtimeError("Only instance has methods.");
@@ -192,15 +660,44 @@ static bool invoke(ObjString* name, int argCount) {
     Value value;
     if (tableGet(&instance->fields, name, &value)) {
         // if found, place it on the stack in place of the receiver, under the argument list
-        vm.stackTop[-argCount - 1] = value;
+        vm->stackTop[-argCount - 1] = value;
         // callValue will check the value's type
-        return callValue(value, argCount);
+        return tail ? tailCall(value, argCount) : callObject(vm, value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    return invokeClass(vm, instance->klass, name, argCount, tail);
+}
+
+bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount, bool tail) {
+    return invokeClass(vm, klass, name, argCount, tail);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name) {
+bool invoke(ObjString* name, int argCount, bool tail) {
+    return invokeMethod(vm, name, argCount, tail);
+}
+
+// the guard of an inlined method: would invoking `name` on `receiver` call `function`?
+bool invokesFunction(Value receiver, ObjString* name, ObjFunction* function) {
+    if (!IS_INSTANCE(receiver)) return false;
+
+    ObjInstance* instance = AS_INSTANCE(receiver);
+    Value value;
+    // a field shadows the method
+    if (tableGet(&instance->fields, name, &value)) return false;
+    return tableGet(&instance->klass->methods, name, &value) && AS_CLOSURE(value)->function == function;
+}
+
+// the same guards as OP_CALL_INLINE and OP_INVOKE_INLINE, for the instruction at `ip`
+bool inlineGuardHolds(CallFrame* frame, uint8_t* ip) {
+    Value* constants = frame->closure->function->chunk.constants.values;
+    if (*ip == OP_CALL_INLINE) {
+        Value callee = peek(ip[1]);
+        return IS_CLOSURE(callee) && AS_CLOSURE(callee)->function == AS_FUNCTION(constants[ip[2]]);
+    }
+    return invokesFunction(peek(ip[2]), AS_STRING(constants[ip[1]]), AS_FUNCTION(constants[ip[3]]));
+}
+
+bool bindMethod(ObjClass* klass, ObjString* name) {
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
@@ -213,11 +710,92 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
     return true;
 }
 
+// the bodies of OP_GET_GLOBAL, OP_SET_GLOBAL, OP_GET_PROPERTY and OP_SET_PROPERTY, copied into the dispatch loop
+// on the VM it keeps in a register (see `execute`), and into `getGlobal` and the others for the JIT's helpers
+
+// OP_GET_GLOBAL: push the value of the global variable `name`
+// a native is only looked for once the program's globals don't have the name, a global of the same name hides it
+static ALWAYS_INLINE bool loadGlobal(VM* const vm, ObjString* name) {
+    Value value;
+    if (!tableGet(&vm->globals, name, &value) && !tableGet(&vm->natives, name, &value)) {
+        runtimeError("Undefined variable '%s'.", name->chars);
+        return false;
+    }
+    *vm->stackTop++ = value;
+    return true;
+}
+
+// OP_SET_GLOBAL: assign the top of the stack to the global variable `name`, leaving it on the stack
+static ALWAYS_INLINE bool storeGlobal(VM* const vm, ObjString* name) {
+    if (tableSet(&vm->globals, name, vm->stackTop[-1])) {
+        // assigning to a native's name: the new global hides the native from now on
+        Value native;
+        if (tableGet(&vm->natives, name, &native)) return true;
+        // call to `tableSet` stores the variable, even if the variable wasn't defined
+        // (tableSet returns true if the key is new)
+        // need to delete the zombie value from the table
+        tableDelete(&vm->globals, name);
+        runtimeError("Undefined variable '%s'.", name->chars);
+        return false;
+    }
+    return true;
+}
+
+// OP_GET_PROPERTY: replace the instance on top of the stack with its field or bound method `name`
+static ALWAYS_INLINE bool loadProperty(VM* const vm, ObjString* name) {
+    if (!IS_INSTANCE(vm->stackTop[-1])) {
+        // property def: general term we use to refer to any named entity you can access on an instance
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(vm->stackTop[-1]);
+    // field has higher priority over methods
+    Value value;
+    if (tableGet(&instance->fields, name, &value)) {
+        vm->stackTop[-1] = value; // in place of the instance
+        return true;
+    }
+    return bindMethod(instance->klass, name);
+}
+
+// OP_SET_PROPERTY: [instance] [value] becomes [value], stored in the field `name`
+static ALWAYS_INLINE bool storeProperty(VM* const vm, ObjString* name) {
+    if (!IS_INSTANCE(vm->stackTop[-2])) {
+        // fields def: subset of properties that are backed by the instance’s state.
+        // in Lox, we can only set fields, not non-field properties
+        runtimeError("Only instances have fields");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(vm->stackTop[-2]);
+    tableSet(&instance->fields, name, vm->stackTop[-1]);
+    vm->stackTop[-2] = vm->stackTop[-1]; // the value, in place of the instance
+    vm->stackTop--;
+    return true;
+}
+
+bool getGlobal(ObjString* name) {
+    return loadGlobal(vm, name);
+}
+
+bool setGlobal(ObjString* name) {
+    return storeGlobal(vm, name);
+}
+
+bool getProperty(ObjString* name) {
+    return loadProperty(vm, name);
+}
+
+bool setProperty(ObjString* name) {
+    return storeProperty(vm, name);
+}
+
 // closing over a local variable
-static ObjUpvalue* captureUpvalue(Value* local) {
+ObjUpvalue* captureUpvalue(Value* local) {
     // try to reuse an existing upvalue if there is one
     ObjUpvalue* prevUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openUpvalues;
+    ObjUpvalue* upvalue = vm->openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
         prevUpvalue = upvalue;
         upvalue = upvalue->next;
@@ -231,9 +809,10 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     // not found, create a new upvalue and add that to the open upvalue list
     ObjUpvalue* createdUpvalue = newUpvalue(local);
     createdUpvalue->next = upvalue;
+    createdUpvalue->owner = (Obj*)vm->fiber;
 
     if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
+        vm->openUpvalues = createdUpvalue;
     } else {
         prevUpvalue->next = createdUpvalue;
     }
@@ -242,16 +821,18 @@ static ObjUpvalue* captureUpvalue(Value* local) {
 }
 
 // close every open upvalue it can find pointing to the slot, or any slot above it on stack
-static void closeUpvalues(Value* last) {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = vm.openUpvalues;
-        upvalue->closed = *upvalue->location;
+void closeUpvalues(Value* last) {
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        ObjUpvalue* upvalue = vm->openUpvalues;
+        WRITE_BARRIER(*upvalue->location);
+        SHARED_STORE(upvalue->closed, *upvalue->location);
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        SHARED_STORE(upvalue->owner, NULL);
+        vm->openUpvalues = upvalue->next;
     }
 }
 
-static void defineMethod(ObjString* name) {
+void defineMethod(ObjString* name) {
     // at execution, on stack: [class] [method] (top)
     Value method = peek(0);
     // note: AS_CLASS is safe since the bytecode is generated by the VM's own compiler
@@ -262,11 +843,11 @@ static void defineMethod(ObjString* name) {
 
 // in Lox, only `nil` and `false` are falsey
 // every other value behaves like `true`
-static bool isFalsey(Value value) {
+bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
+void concatenate() {
     // peek and pop later: keep alive for GC
     ObjString* b = AS_STRING(peek(0));
     ObjString* a = AS_STRING(peek(1));
@@ -284,12 +865,41 @@ static void concatenate() {
     push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
+// take up the requests in `vm->interrupts`, at a safepoint of the dispatch loop
+static void handleInterrupts() {
+#ifdef COMPACTING_GC
+    if (vm->interrupts & INTERRUPT_COMPACT) compactHeap();
+#endif
+}
+
+// the copies of the dispatch loop, each with the hooks it needs and no others
+typedef enum {
+    LOOP_PLAIN,
+    LOOP_INSTRUMENTED, // `--trace-execution`, `--opcode-stats` and `--call-profile`: look at each instruction and call
+    LOOP_RECORDING // record each instruction into the loop trace being recorded (see trace.c), until it's done
+} LoopMode;
+
+// what the recording loop returns once the recording is over, the plain loop goes on from `frame->ip`
+#define INTERPRET_RECORDED ((InterpretResult)-1)
+
+#ifdef TRACING_JIT
+static InterpretResult runRecording(VM* vm);
+#endif
+
+// the dispatch loop, every caller passes a constant `mode` and gets a copy of its own,
+// so the plain loop carries none of the others' hooks
+// `vm` is the thread's VM passed in, so the loop keeps it in a register instead of reading the thread-local each time
+static ALWAYS_INLINE InterpretResult execute(VM* const vm, LoopMode mode) {
     // current topmost CallFrame
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
 
 // make that scoping more explicit
 
+// `push`, `pop` and `peek` on the VM passed in
+#define PUSH(value) (*vm->stackTop++ = (value))
+#define POP() (*--vm->stackTop)
+#define PEEK(distance) (vm->stackTop[-1 - (distance)])
+
 // read the byte and advance
 // note: ip advanced after reading and before executing
 #define READ_BYTE() (*frame->ip++)
@@ -307,28 +917,126 @@ static InterpretResult run() {
 // note: pop out in reverse order (right first, left second)
 #define BINARY_OP(valueType, op) \
     do {  \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            runtimeError("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        double b = AS_NUMBER(POP()); \
+        double a = AS_NUMBER(POP()); \
+        PUSH(valueType(a op b)); \
+    } while (false)
+
+// between two instructions nothing but the roots holds an instance, they may move (see compactor.c)
+// polled at back-edges, after the instructions that allocate and whenever compiled code hands back,
+// calls and returns don't poll (an instance a call creates waits for the next of those)
+#define SAFEPOINT() \
+    do { \
+        if (vm->interrupts != 0) handleInterrupts(); \
+    } while (false)
+
+// hand the (new) topmost frame to compiled code for as long as its function has some
+// compiled code returns whenever the topmost frame changes, `frame` is refreshed after each round
+// with the JIT off no function has any, and the check stops at the flag
+#ifdef BASELINE_JIT
+#define ENTER_JIT() \
+    do { \
+        while (vm->jitEnabled && frame->closure->function->jit != NULL) { \
+            JitStatus status = jitExecute(frame); \
+            if (status == JIT_RUNTIME_ERROR) return INTERPRET_RUNTIME_ERROR; \
+            if (status == JIT_FINISHED) return INTERPRET_OK; \
+            if (vm->frameCount == 0) return INTERPRET_OK; \
+            frame = &vm->frames[vm->frameCount - 1]; \
+            SAFEPOINT(); \
+        } \
+    } while (false)
+#else
+#define ENTER_JIT() do { } while (false)
+#endif
+
+// the call profile, kept by the instrumented loop alone (see callprof.c): a call leaves the frame it pushed
+// (or took over) with `profileStart` 0, the clock of its function starts once the loop gets to it
+#define PROFILE_ENTER() \
+    do { \
+        if (mode == LOOP_INSTRUMENTED && vm->callProfile != NULL && frame->profileStart == 0) enterCall(frame); \
+    } while (false)
+
+// a tail call took over `frame` for another function: stop the clock of `caller`, which was running since `start`
+#define PROFILE_TAIL_CALL(caller, start) \
+    do { \
+        if (mode == LOOP_INSTRUMENTED && vm->callProfile != NULL && frame->profileStart == 0) { \
+            switchCall(frame, caller, start); \
+        } \
+    } while (false)
+
+// pick up the topmost frame after a call or a return changed it
+// no frame at all: a fiber run by the event loop suspended or returned to it (see `runFiber`)
+#define REFRESH_FRAME() \
+    do { \
+        if (vm->frameCount == 0) return INTERPRET_OK; \
+        frame = &vm->frames[vm->frameCount - 1]; \
+        PROFILE_ENTER(); \
+        ENTER_JIT(); \
+    } while (false)
+
+#ifdef FUSED_OPERANDS
+// fused form of BINARY_OP: the left operand is always a local slot
+// the right operand is read by `readRight` (another local slot or a constant)
+#define FUSED_BINARY_OP(valueType, op, readRight) \
+    do { \
+        Value a = frame->slots[READ_BYTE()]; \
+        Value b = readRight; \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
             runtimeError("Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
+        PUSH(valueType(AS_NUMBER(a) op AS_NUMBER(b))); \
     } while (false)
 
+// fused form of OP_ADD, strings still have to go through the stack to be concatenated
+#define FUSED_ADD(readRight) \
+    do { \
+        Value a = frame->slots[READ_BYTE()]; \
+        Value b = readRight; \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b))); \
+        } else if (IS_STRING(a) && IS_STRING(b)) { \
+            PUSH(a); \
+            PUSH(b); \
+            concatenate(); \
+            SAFEPOINT(); \
+        } else { \
+            runtimeError("Operands must be two numbers or two strings."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+    } while (false)
+
+#define READ_LOCAL() (frame->slots[READ_BYTE()])
+#endif
+
+    PROFILE_ENTER();
     for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        // show value stack
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
+        if (mode == LOOP_INSTRUMENTED && vm->traceExecution) {
+            // show value stack
+            printf("          ");
+            for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+                printf("[ ");
+                printValue(*slot);
+                printf(" ]");
+            }
+            printf("\n");
+
+            disassembleInstruction(&frame->closure->function->chunk,
+                                   (int)(frame->ip - frame->closure->function->chunk.code));
         }
-        printf("\n");
 
-        disassembleInstruction(&frame->closure->function->chunk,
-                               (int)(frame->ip - frame->closure->function->chunk.code));
+#ifdef TRACING_JIT
+        // the instrumented loop records along the way, the plain loop hands a recording to the recording loop
+        if (mode != LOOP_PLAIN && vm->recording != NULL) traceRecord(frame);
+        // the recording is over (or was aborted) at this instruction, the plain loop executes it
+        if (mode == LOOP_RECORDING && vm->recording == NULL) return INTERPRET_RECORDED;
+#endif
+#ifdef OPCODE_STATS
+        if (mode == LOOP_INSTRUMENTED && vm->opcodeStats != NULL) countInstruction(vm->opcodeStats, frame->closure->function, *frame->ip);
 #endif
 
         uint8_t instruction;
@@ -336,32 +1044,26 @@ static InterpretResult run() {
         switch (instruction = READ_BYTE()) {
             case OP_CONSTANT: {
                 Value constant = READ_CONSTANT();
-                push(constant);
+                PUSH(constant);
                 break;
             }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
+            case OP_NIL: PUSH(NIL_VAL); break;
+            case OP_TRUE: PUSH(BOOL_VAL(true)); break;
+            case OP_FALSE: PUSH(BOOL_VAL(false)); break;
+            case OP_POP: POP(); break;
             case OP_GET_LOCAL: {
                 uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]); // so later instructions can find it
+                PUSH(frame->slots[slot]); // so later instructions can find it
                 break;
             }
             case OP_SET_LOCAL: {
                 uint8_t slot = READ_BYTE();
                 // don't pop, assignment is an expression, which produces a value.
-                frame->slots[slot] = peek(0);
+                frame->slots[slot] = PEEK(0);
                 break;
             }
             case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
+                if (!loadGlobal(vm, READ_STRING())) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
             case OP_DEFINE_GLOBAL: {
@@ -370,77 +1072,41 @@ static InterpretResult run() {
                 // note: don't pop until after the variable is added into `globals`
                 // ensure the VM can still find the value if a GC is triggered in the middle of adding
                 // which is possible since hash table requires dynamic allocation when resizing
-                tableSet(&vm.globals, name, peek(0));
-                pop();
+                tableSet(&vm->globals, name, PEEK(0));
+                POP();
                 break;
             }
             case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    // call to `tableSet` stores the variable, even if the variable wasn't defined
-                    // (tableSet returns true if the key is new)
-                    // need to delete the zombie value from the table
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+                if (!storeGlobal(vm, READ_STRING())) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
             case OP_GET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
+                PUSH(*frame->closure->upvalues[slot]->location);
                 break;
             }
             case OP_SET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                // a closed upvalue is on the heap
+                WRITE_BARRIER(PEEK(0));
+                SHARED_STORE(*frame->closure->upvalues[slot]->location, PEEK(0));
                 // note: don't pop, assignment is an expression, and the assigned value needs to remain on stack
                 break;
             }
             case OP_GET_PROPERTY: {
                 // find a field or a method with the given name, and replace the top of the stack with it
-                if (!IS_INSTANCE(peek(0))) {
-                    // property def: general term we use to refer to any named entity you can access on an instance
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
-
-                // field has higher priority over methods
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
-
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+                if (!loadProperty(vm, READ_STRING())) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
             case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    // fields def: subset of properties that are backed by the instance’s state.
-                    // in Lox, we can only set fields, not non-field properties
-                    runtimeError("Only instances have fields");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
                 // before execution, on stack: [instance] [value] (top)
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop(); // Instance.
-                push(value);
+                if (!storeProperty(vm, READ_STRING())) return INTERPRET_RUNTIME_ERROR;
                 // after execution, on stack: [value] (top)
                 break;
             }
             case OP_GET_SUPER: {
                 ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
+                ObjClass* superclass = AS_CLASS(POP());
 
                 // bind the method to superclass, not the receiver's own class
                 // note: only 1 pop here: another pop in `bindMethod` to pop the ObjInstance
@@ -450,20 +1116,21 @@ static InterpretResult run() {
                 break;
             }
             case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
+                Value b = POP();
+                Value a = POP();
+                PUSH(BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
             case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
             case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
             case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
                     concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+                    SAFEPOINT();
+                } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                    double b = AS_NUMBER(POP());
+                    double a = AS_NUMBER(POP());
+                    PUSH(NUMBER_VAL(a + b));
                 } else {
                     runtimeError("Operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
@@ -474,17 +1141,18 @@ static InterpretResult run() {
             case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
             case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
             case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
+                // in place: the operand's slot takes the result
+                PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
                 break;
             case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
+                if (!IS_NUMBER(PEEK(0))) {
                     runtimeError("Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
+                PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
                 break;
             case OP_PRINT: {
-                printValue(pop());
+                printValue(POP());
                 printf("\n");
                 break;
             }
@@ -497,119 +1165,281 @@ static InterpretResult run() {
                 uint16_t offset = READ_SHORT();
                 // if false, apply the jump offset
                 // note: if we want, this can be done purely arithmetically
-                if (isFalsey(peek(0))) frame->ip += offset;
+                if (isFalsey(PEEK(0))) frame->ip += offset;
                 break;
             }
             case OP_LOOP: {
                 uint16_t offset = READ_SHORT();
+                uint8_t loop = READ_BYTE();
                 frame->ip -= offset; // jump backwards
+#ifdef TRACING_JIT
+                // hot loops run as a compiled trace, which hands back when it leaves the loop (or a guard fails)
+                if (vm->jitEnabled) {
+                    if (traceLoop(frame, loop) == JIT_RUNTIME_ERROR) return INTERPRET_RUNTIME_ERROR;
+                    // the loop just got hot, its next iteration is recorded
+                    if (mode == LOOP_PLAIN && vm->recording != NULL) {
+                        InterpretResult result = runRecording(vm);
+                        if (result != INTERPRET_RECORDED) return result;
+                        frame = &vm->frames[vm->frameCount - 1];
+                    }
+                }
+#else
+                (void)loop;
+#endif
+                SAFEPOINT();
                 break;
             }
             case OP_CALL: {
                 int argCount = READ_BYTE();
                 // peek(argCount): the function to be called
-                if (!callValue(peek(argCount), argCount)) {
+                // the profile times a native around the C function, it has no frame to do that in
+                bool profiled = mode == LOOP_INSTRUMENTED && vm->callProfile != NULL;
+                if (!(profiled ? profileCallValue(PEEK(argCount), argCount) : callObject(vm, PEEK(argCount), argCount))) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 // update the (local) cached pointer of current frame in `run()`
                 // VM will read the `ip` from the new CallFrame in the next cycle
-                frame = &vm.frames[vm.frameCount - 1];
+                REFRESH_FRAME();
+                break;
+            }
+            case OP_TAIL_CALL: {
+                int argCount = READ_BYTE();
+                ObjFunction* caller = frame->closure->function;
+                uint64_t callerStart = frame->profileStart;
+                bool profiled = mode == LOOP_INSTRUMENTED && vm->callProfile != NULL && IS_NATIVE(PEEK(argCount));
+                if (!(profiled ? profileCallValue(PEEK(argCount), argCount) : tailCall(PEEK(argCount), argCount))) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                PROFILE_TAIL_CALL(caller, callerStart);
+                // the same CallFrame running another function, or a new one for an initializer
+                REFRESH_FRAME();
                 break;
             }
-            case OP_INVOKE: {
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE: {
+                bool tail = instruction == OP_TAIL_INVOKE;
                 ObjString* method = READ_STRING();
                 int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
+                ObjFunction* caller = frame->closure->function;
+                uint64_t callerStart = frame->profileStart;
+                if (!invokeMethod(vm, method, argCount, tail)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                PROFILE_TAIL_CALL(caller, callerStart);
                 // update the (local) cached pointer of current frame in `run()`
-                frame = &vm.frames[vm.frameCount - 1];
+                REFRESH_FRAME();
                 break;
             }
-            case OP_SUPER_INVOKE: {
+            case OP_SUPER_INVOKE:
+            case OP_TAIL_SUPER_INVOKE: {
                 // combine OP_GET_SUPER and OP_CALL
+                bool tail = instruction == OP_TAIL_SUPER_INVOKE;
                 ObjString* method = READ_STRING();
                 int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
+                ObjClass* superclass = AS_CLASS(POP());
+                ObjFunction* caller = frame->closure->function;
+                uint64_t callerStart = frame->profileStart;
                 // note: after the pop, the stack is just right for a method call
-                if (!invokeFromClass(superclass, method, argCount)) {
+                if (!invokeClass(vm, superclass, method, argCount, tail)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
+                PROFILE_TAIL_CALL(caller, callerStart);
+                REFRESH_FRAME();
                 break;
             }
             case OP_CLOSURE: {
                 // all function calls are now wrapped in ObjClosure
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
                 ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
+                PUSH(OBJ_VAL(closure));
                 for (int i = 0; i < closure->upvalueCount; i++) {
                     uint8_t isLocal = READ_BYTE();
                     uint8_t index = READ_BYTE();
                     if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                        SHARED_STORE(closure->upvalues[i], captureUpvalue(frame->slots + index));
                     } else {
                         // when OP_CLOSURE executes, current function is the surrounding one of the closure
                         // and current function's closure is stored in the topmost CallFrame
-                        closure->upvalues[i] = frame->closure->upvalues[i];
+                        SHARED_STORE(closure->upvalues[i], frame->closure->upvalues[index]);
                     }
                 }
+                SAFEPOINT();
                 break;
             }
             case OP_CLOSE_UPVALUE:
                 // on execution, the local to be closed is on top of the stack
-                closeUpvalues(vm.stackTop - 1);
+                closeUpvalues(vm->stackTop - 1);
                 // after moving the variable to heap, its slot can be discarded
-                pop();
+                POP();
                 break;
             case OP_RETURN: {
                 // return value is at the top of value stack
-                Value result = pop();
+                Value result = POP();
                 // close every remaining open upvalue owned by the returning function
-                closeUpvalues(frame->slots);
+                if (vm->openUpvalues != NULL) closeUpvalues(frame->slots);
+                if (frame->generator != NULL) frame->generator->status = GENERATOR_DONE;
+                if (mode == LOOP_INSTRUMENTED && vm->callProfile != NULL) leaveCall(frame);
                 // discard current CallFrame
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
+                vm->frameCount--;
+                if (vm->frameCount == 0) {
+                    POP();
+                    if (vm->fiber == NULL) return INTERPRET_OK;
+                    // a fiber's function returned, its result is what `resume()` evaluates to
+                    leaveFiber(FIBER_DONE);
+                } else {
+                    vm->stackTop = frame->slots;
                 }
-
-                vm.stackTop = frame->slots;
                 // push the return value back to the value stack of previous frame
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
+                PUSH(result);
+                REFRESH_FRAME();
+                break;
+            }
+            case OP_YIELD: {
+                // like OP_RETURN, except the frame's window is kept in its generator for the next call
+                Value result = POP();
+                ObjGenerator* generator = frame->generator;
+                generator->ip = frame->ip;
+                generator->status = GENERATOR_SUSPENDED;
+                saveWindow(generator, frame->slots, (int)(vm->stackTop - frame->slots));
+                if (mode == LOOP_INSTRUMENTED && vm->callProfile != NULL) leaveCall(frame);
+                vm->frameCount--;
+                vm->stackTop = frame->slots;
+                PUSH(result);
+                REFRESH_FRAME();
                 break;
             }
             case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
+                PUSH(OBJ_VAL(newClass(READ_STRING())));
+                SAFEPOINT();
                 break;
             case OP_INHERIT: {
-                Value superclass = peek(1);
+                Value superclass = PEEK(1);
                 if (!IS_CLASS(superclass)) {
                     runtimeError("Superclass must be a class.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                ObjClass* subclass = AS_CLASS(peek(0));
+                ObjClass* subclass = AS_CLASS(PEEK(0));
                 // copy-down inheritance
                 // note: won't affect method override, since all OP_METHOD comes after OP_INHERIT
                 tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass;
+                POP(); // Subclass;
                 break;
             }
             case OP_METHOD:
                 defineMethod(READ_STRING());
                 break;
+#ifdef FUSED_OPERANDS
+            case OP_ADD_LL:      FUSED_ADD(READ_LOCAL()); break;
+            case OP_SUBTRACT_LL: FUSED_BINARY_OP(NUMBER_VAL, -, READ_LOCAL()); break;
+            case OP_MULTIPLY_LL: FUSED_BINARY_OP(NUMBER_VAL, *, READ_LOCAL()); break;
+            case OP_DIVIDE_LL:   FUSED_BINARY_OP(NUMBER_VAL, /, READ_LOCAL()); break;
+            case OP_LESS_LL:     FUSED_BINARY_OP(BOOL_VAL, <, READ_LOCAL()); break;
+            case OP_GREATER_LL:  FUSED_BINARY_OP(BOOL_VAL, >, READ_LOCAL()); break;
+            case OP_EQUAL_LL: {
+                Value a = READ_LOCAL();
+                Value b = READ_LOCAL();
+                PUSH(BOOL_VAL(valuesEqual(a, b)));
+                break;
+            }
+            case OP_ADD_LK:      FUSED_ADD(READ_CONSTANT()); break;
+            case OP_SUBTRACT_LK: FUSED_BINARY_OP(NUMBER_VAL, -, READ_CONSTANT()); break;
+            case OP_MULTIPLY_LK: FUSED_BINARY_OP(NUMBER_VAL, *, READ_CONSTANT()); break;
+            case OP_DIVIDE_LK:   FUSED_BINARY_OP(NUMBER_VAL, /, READ_CONSTANT()); break;
+            case OP_LESS_LK:     FUSED_BINARY_OP(BOOL_VAL, <, READ_CONSTANT()); break;
+            case OP_GREATER_LK:  FUSED_BINARY_OP(BOOL_VAL, >, READ_CONSTANT()); break;
+            case OP_EQUAL_LK: {
+                Value a = READ_LOCAL();
+                Value b = READ_CONSTANT();
+                PUSH(BOOL_VAL(valuesEqual(a, b)));
+                break;
+            }
+            case OP_STORE_LOCAL: {
+                uint8_t slot = READ_BYTE();
+                frame->slots[slot] = POP();
+                break;
+            }
+#endif
+            case OP_CALL_INLINE: {
+                int argCount = READ_BYTE();
+                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                uint16_t skip = READ_SHORT();
+                Value callee = PEEK(argCount);
+                // the guard: go on with the inlined body if the callee is what the compiler expected
+                if (IS_CLOSURE(callee) && AS_CLOSURE(callee)->function == function) break;
+
+                // otherwise call it for real, it returns to the end of the inlined body
+                frame->ip += skip;
+                if (!callValue(callee, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                REFRESH_FRAME();
+                break;
+            }
+            case OP_INVOKE_INLINE: {
+                ObjString* method = READ_STRING();
+                int argCount = READ_BYTE();
+                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                uint16_t skip = READ_SHORT();
+                if (invokesFunction(PEEK(argCount), method, function)) break;
+
+                frame->ip += skip;
+                if (!invoke(method, argCount, false)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                REFRESH_FRAME();
+                break;
+            }
+            case OP_PEEK: {
+                Value value = PEEK(READ_BYTE());
+                PUSH(value);
+                break;
+            }
+            case OP_INLINE_RETURN: {
+                Value result = POP();
+                vm->stackTop -= READ_BYTE();
+                PUSH(result);
+                break;
+            }
         }
     }
 
+#undef PUSH
+#undef POP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef SAFEPOINT
+#undef ENTER_JIT
+#undef PROFILE_ENTER
+#undef PROFILE_TAIL_CALL
+#undef REFRESH_FRAME
+#ifdef FUSED_OPERANDS
+#undef FUSED_BINARY_OP
+#undef FUSED_ADD
+#undef READ_LOCAL
+#endif
 }
 
-InterpretResult interpret(const char* source) {
+// both kept out of `run`, which is left with nothing but the plain loop
+static NOINLINE InterpretResult runInstrumented() {
+    return execute(vm, LOOP_INSTRUMENTED);
+}
+
+#ifdef TRACING_JIT
+static NOINLINE InterpretResult runRecording(VM* vm) {
+    return execute(vm, LOOP_RECORDING);
+}
+#endif
+
+static InterpretResult run() {
+    if (vm->traceExecution || vm->opcodeStats != NULL || vm->callProfile != NULL) return runInstrumented();
+    return execute(vm, LOOP_PLAIN);
+}
+
+static InterpretResult interpretSource(const char* source) {
     ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
@@ -621,5 +1451,33 @@ InterpretResult interpret(const char* source) {
     push(OBJ_VAL(closure));
     call(closure, 0);
 
-    return run();
+    InterpretResult result = run();
+#ifdef ASYNC_IO
+    // fibers still waiting on timers or I/O get to finish before the program does
+    if (result == INTERPRET_OK) result = runScheduler();
+#endif
+    return result;
+}
+
+InterpretResult interpret(VM* instance, const char* source) {
+    // a VM runs on one thread at a time, but may move between threads across calls
+    VM* previous = vm;
+    vm = instance;
+#ifdef PERF_COUNTERS
+    if (vm->perfCounters != NULL) countPerfEvents(true);
+#endif
+    InterpretResult result = interpretSource(source);
+#ifdef PERF_COUNTERS
+    if (vm->perfCounters != NULL) countPerfEvents(false);
+#endif
+    vm = previous;
+    return result;
+}
+
+InterpretResult runFiber(ObjFiber* fiber, Value value) {
+    if (!resumeFiber(fiber, value)) return INTERPRET_RUNTIME_ERROR;
+    InterpretResult result = run();
+    // what `resume()` would evaluate to, there's no caller left to take it
+    if (result == INTERPRET_OK) pop();
+    return result;
 }
\ No newline at end of file
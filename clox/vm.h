@@ -1,40 +1,94 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <signal.h>
+
+#include "gcstats.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-// note: still might overflow if a function use too much local var, yet it's simple
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// both stacks start small and grow as calls nest deeper
+#define FRAMES_INITIAL 8
+// recursion deeper than this is most likely infinite
+#define FRAMES_MAX (1024 * 1024)
+// every call makes sure the stack has room for the callee's `maxSlots`
+#define STACK_INITIAL (UINT8_COUNT * 2)
+// a stack trace deeper than twice this many frames leaves out the ones in the middle
+#define STACK_TRACE_ENDS 32
+
+// the bits of `vm->interrupts`, the dispatch loop polls them all at once where the program loops or allocates
+#define INTERRUPT_COMPACT 0x1 // a collection left the instance blocks mostly empty, compact them (see compactor.c)
 
 // represents a single ongoing function call
-typedef struct {
+typedef struct CallFrame {
     ObjClosure* closure;
     uint8_t* ip; // caller stores its own ip before invoking callee, as the return address
     Value* slots; // pointing to the first slot the function can use in VM's value stack
+    ObjGenerator* generator; // the generator the frame is running, NULL for a plain call
+    uint64_t profileStart; // when the call began, with `vm->callProfile` on (see callprof.c), 0: not entered yet
+    uint64_t profileChildren; // the time its callees took so far
+    bool profileOutermost; // no frame below runs the same function, the call counts towards its inclusive time
 } CallFrame;
 
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount; // height of call stack (number of ongoing calls)
+    int frameCapacity;
+    // the frames are being reallocated or swapped for a fiber's, the CPU profiler (see cpuprof.c) can't read them
+    volatile sig_atomic_t framesMoving;
 
-    Value stack[STACK_MAX]; // value stack
+    Value* stack; // value stack, moves when it grows (see `growStack`)
     Value* stackTop; // where the next value to be pushed will go (not the top)
+    int stackCapacity;
     Table globals; // global variables
+    Table natives; // native functions, apart so they don't crowd the program's globals (see `loadGlobal`)
     Table strings; // a hash table (set) for all interned strings
     ObjString* initString; // just literal "init", but interned so it's fast
     ObjUpvalue* openUpvalues; // a linked list of open upvalues (to ensure only 1 upvalue for each local)
 
     size_t bytesAllocated;
     size_t nextGC; // the threshold of bytes allocated that triggers next GC
+    double gcGrowFactor; // the least the heap grows by between two collections (see GC_HEAP_GROW_FACTOR)
+    double gcGrowth; // what it grows by right now: adapted to `gcTarget`, never below `gcGrowFactor`
+    double gcTarget; // percent of the time to spend collecting at most, 0: always grow by `gcGrowFactor`
+    size_t gcMinHeap; // no collection below this many bytes
+    size_t gcMaxHeap; // the heap left by a collection may never be bigger than this, 0: no limit
+    double gcIdleSince; // when the last collection ended (see `gcClock`)
+    GcStats gcStats;
+    struct AllocProfile* allocProfile; // where the program allocates (see allocprof.c), NULL: not recorded
+    struct CallProfile* callProfile; // calls and time per function (see callprof.c), NULL: not counted
+    struct CpuProfile* cpuProfile; // the sampled call stacks (only in CPU_PROFILER builds), NULL: not sampled
+    struct PerfCounters* perfCounters; // hardware counters (only in PERF_COUNTERS builds), NULL: not counted
+    struct OpcodeStats* opcodeStats; // instructions executed (only in OPCODE_STATS builds), NULL: not counted
 
     Obj* objects; // a linked list of heap-allocated objects
 
     int grayCount;
     int grayCapacity;
     Obj** grayStack; // worklist of gray objects (for GC)
+    int gcThreads; // threads marking a big heap (only in PARALLEL_MARK builds)
+    struct MarkPool* markPool; // their threads, NULL until the first parallel mark phase
+    bool concurrentGC; // collect on a background thread (only in CONCURRENT_GC builds)
+    bool marking; // the background thread is marking, stores into the heap go through WRITE_BARRIER
+    struct Collector* collector; // that thread, NULL until the first concurrent collection
+    bool compactGC; // keep instances in blocks of their own, and compact those (only in COMPACTING_GC builds)
+    int interrupts; // requests for the dispatch loop to take up at its next safepoint (INTERRUPT_*)
+    struct Compactor* compactor; // the blocks, NULL until the first instance
+
+    ObjFiber* fiber; // the running fiber, NULL while the main program runs
+    ObjFiber* transfer; // set by a native handing control to another fiber, see `callValue`
+    bool nativeFailed; // set by a native that reported a runtime error (see `nativeError`)
+    struct Scheduler* scheduler; // event loop of the async natives, NULL until one of them is used
+
+    bool jitEnabled; // compile hot functions to machine code (only in BASELINE_JIT builds)
+    struct Trace* recording; // the loop whose trace is being recorded (only in TRACING_JIT builds)
+    int recordingFrame; // index of the frame running it
+    bool traceStats; // print statistics of all loop traces on exit
+    bool inlineEnabled; // let the compiler inline calls of small functions
+    bool inlineReport; // print every call the compiler inlined
+    bool printCode; // disassemble every function the compiler finishes
+    bool traceExecution; // print the stack and each instruction before executing it, on the instrumented dispatch loop
 } VM;
 
 typedef enum {
@@ -43,12 +97,41 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+// the VM the calling thread is working on, set by `newVM`, `interpret` and `freeVM`,
+// which give the thread back the VM it had before (so a native may run another VM and return to its own)
+// each VM owns its heap, globals and stacks, so VMs on different threads share no mutable state
+// a thread-local rather than a parameter of every function: natives, the GC and the JIT's helpers don't pass it
+// around, and the dispatch loop, where it counts, takes it as a parameter to keep it in a register (see `execute`)
+extern _Thread_local VM* vm;
 
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);
+VM* newVM();
+void freeVM(VM* instance);
+InterpretResult interpret(VM* instance, const char* source);
+// run a fiber on the main program's empty stacks, until it suspends or returns (for the event loop)
+InterpretResult runFiber(ObjFiber* fiber, Value value);
+void defineNative(const char* name, NativeFn function);
 void push(Value value);
 Value pop();
 
+// slow paths shared with compiled code (jit.c), which calls back into the interpreter for them
+void runtimeError(const char* format, ...);
+Value nativeError(const char* format, ...);
+bool callValue(Value callee, int argCount);
+bool tailCall(Value callee, int argCount);
+bool invoke(ObjString* name, int argCount, bool tail);
+bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount, bool tail);
+bool invokesFunction(Value receiver, ObjString* name, ObjFunction* function);
+bool inlineGuardHolds(CallFrame* frame, uint8_t* ip);
+bool bindMethod(ObjClass* klass, ObjString* name);
+bool getGlobal(ObjString* name);
+bool setGlobal(ObjString* name);
+bool getProperty(ObjString* name);
+bool setProperty(ObjString* name);
+ObjUpvalue* captureUpvalue(Value* local);
+void closeUpvalues(Value* last);
+void leaveFiber(FiberStatus status);
+void defineMethod(ObjString* name);
+bool isFalsey(Value value);
+void concatenate();
+
 #endif
\ No newline at end of file